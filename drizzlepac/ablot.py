@@ -327,7 +327,8 @@ def run_blot(imageObjectList,output_wcs,paramDict,wcsmap=wcs_functions.WCSMap):
 
 
 def do_blot(source, source_wcs, blot_wcs, exptime, coeffs = True,
-            interp='poly5', sinscl=1.0, stepsize=10, wcsmap=None):
+            interp='poly5', sinscl=1.0, stepsize=10, wcsmap=None,
+            tile=0, block=0):
     """ Core functionality of performing the 'blot' operation to create a single
         blotted image from a single source image.
         All distortion information is assumed to be included in the WCS specification
@@ -363,6 +364,16 @@ def do_blot(source, source_wcs, blot_wcs, exptime, coeffs = True,
             Custom mapping class to use to provide transformation from
             drizzled to blotted WCS.  Default will be to use
             `drizzlepac.wcs_functions.WCSMap`.
+        tile
+            Blot the output in square tiles of this many pixels, visited in
+            an order that follows the source image, instead of row by row.
+            This cuts the number of memory pages touched per output row
+            when the source is large and rotated with respect to the
+            output.  Default of 0 blots row by row.
+        block
+            Re-lay the source image out in square blocks of this many
+            pixels (a power of two) before interpolating.  Default of 0
+            interpolates from the rows directly.
 
     """
     _outsci = np.zeros(blot_wcs.array_shape, dtype=np.float32)
@@ -413,7 +424,7 @@ def do_blot(source, source_wcs, blot_wcs, exptime, coeffs = True,
         source, _outsci,xmin,xmax,ymin,ymax,
         pix_ratio, kscale, 1.0, 1.0,
         'center',interp, exptime,
-        misval, sinscl, 1, mapping)
+        misval, sinscl, 1, mapping, tile=tile, block=block)
     del mapping
 
     return _outsci
@@ -9,12 +9,16 @@ Interfaces to main drizzle functions.
 import os
 import copy
 import time
+import queue
 import platform
+import threading
+from concurrent.futures import ThreadPoolExecutor
 from . import util
 import numpy as np
 from astropy.io import fits
 from stsci.tools import fileutil, logutil, mputil, teal
 from . import outputimage, wcs_functions
+from .drizstate import footprint_box
 import stwcs
 from stwcs import distortion
 
@@ -34,6 +38,7 @@ if util.can_parallel:
 __all__ = ['drizzle', 'run', 'drizSeparate', 'drizFinal', 'mergeDQarray',
            'updateInputDQArray', 'buildDrizParamDict', 'interpret_maskval',
            'run_driz', 'run_driz_img', 'run_driz_chip', 'do_driz',
+           'do_driz_strips', 'do_driz_tiled', 'fits_strips',
            'get_data', 'create_output', 'help', 'getHelpAsString']
 
 
@@ -580,11 +585,24 @@ def run_driz(imageObjectList, output_wcs, paramDict, single, build, wcsmap=None)
     # Will we be running in parallel?
     pool_size = util.get_pool_size(paramDict.get('num_cores'), len(imageObjectList))
     run_parallel = single and pool_size > 1
+
+    # Final drizzle can run in threads instead, on tiles of the output,
+    # once every chip has been read; a Python mapping would hold them up.
+    # As all of the chips are then held in memory, this is asked for
+    # with final_tiled
+    tiled = None
+    if not single and wcsmap is None and paramDict.get('tiled', False):
+        num_threads = util.get_pool_size(paramDict.get('num_cores'), None)
+        if num_threads > 1:
+            tiled = {'chips': [], 'num_threads': num_threads}
+
     if run_parallel:
         log.info(f'Executing {pool_size:d} parallel workers')
+    elif tiled is not None:
+        log.info(f'Executing final drizzle on output tiles with '
+                 f'{tiled["num_threads"]:d} threads')
     else:
-        if single:  # not yet an option for final drizzle, msg would confuse
-            log.info('Executing serially')
+        log.info('Executing serially')
 
     # Set parameters for each input and run drizzle on it here.
     #
@@ -677,14 +695,15 @@ def run_driz(imageObjectList, output_wcs, paramDict, single, build, wcsmap=None)
                 name='adrizzle.run_driz_img()',  # for err msgs
                 args=(img, chiplist, output_wcs, outwcs, template, paramDict,
                       single, num_in_prod, build, _versions, _numctx, _nplanes,
-                      _chipIdx, None, None, None, None, wcsmap)
+                      _chipIdx, None, None, None, None, wcsmap, tiled)
             )
             subprocs.append(p)
         else:
             # serial run_driz_img run (either separate drizzle or final drizzle)
             run_driz_img(img, chiplist, output_wcs, outwcs, template, paramDict,
                          single, num_in_prod, build, _versions, _numctx, _nplanes,
-                         _chipIdx, _outsci, _outwht, _outctx, _hdrlist, wcsmap)
+                         _chipIdx, _outsci, _outwht, _outctx, _hdrlist, wcsmap,
+                         tiled)
 
         # Increment/reset master chip counter
         _chipIdx += len(chiplist)
@@ -705,7 +724,7 @@ def run_driz(imageObjectList, output_wcs, paramDict, single, build, wcsmap=None)
 
 def run_driz_img(img, chiplist, output_wcs, outwcs, template, paramDict, single,
                  num_in_prod, build, _versions, _numctx, _nplanes, chipIdxCopy,
-                 _outsci, _outwht, _outctx, _hdrlist, wcsmap):
+                 _outsci, _outwht, _outctx, _hdrlist, wcsmap, tiled=None):
     """ Perform the drizzle operation on a single image.
     This is separated out from :py:func:`run_driz` so as to keep together
     the entirety of the code which is inside the loop over
@@ -741,7 +760,8 @@ def run_driz_img(img, chiplist, output_wcs, outwcs, template, paramDict, single,
         # run_driz_chip
         run_driz_chip(img, chip, output_wcs, outwcs, template, paramDict,
                       single, doWrite, build, _versions, _numctx, _nplanes,
-                      chipIdxCopy, _outsci, _outwht, _outctx, _hdrlist, wcsmap)
+                      chipIdxCopy, _outsci, _outwht, _outctx, _hdrlist, wcsmap,
+                      tiled)
 
         # Increment chip counter (also done outside of this function)
         chipIdxCopy += 1
@@ -765,11 +785,15 @@ def run_driz_img(img, chiplist, output_wcs, outwcs, template, paramDict, single,
 
 def run_driz_chip(img, chip, output_wcs, outwcs, template, paramDict, single,
                   doWrite, build, _versions, _numctx, _nplanes, _numchips,
-                  _outsci, _outwht, _outctx, _hdrlist, wcsmap):
+                  _outsci, _outwht, _outctx, _hdrlist, wcsmap, tiled=None):
     """ Perform the drizzle operation on a single chip.
     This is separated out from `run_driz_img` so as to keep together
     the entirety of the code which is inside the loop over
     chips.  See the `run_driz` code for more documentation.
+
+    With ``tiled`` given, the chip is only added to ``tiled['chips']``,
+    and all of them are drizzled with `do_driz_tiled` before the
+    product is written.
     """
     global time_pre_all, time_driz_all, time_post_all, time_write_all
 
@@ -788,19 +812,15 @@ def run_driz_chip(img, chip, output_wcs, outwcs, template, paramDict, single,
     _handle = fileutil.openImage(_expname, mode='readonly', memmap=False)
     _sciext = _handle[chip.header['extname'], chip.header['extver']]
 
-    # Apply sky subtraction and unit conversion to input array
-    if chip.computedSky is None:
-        _insci = _sciext.data
-    else:
+    # Sky subtraction and unit conversion are applied by 'tdriz' as it
+    # reads the input array, so that the SCI array, whether float32 or
+    # still integer (RAW files) and in either byte order, is not copied
+    _insci = _sciext.data
+    _bscale = chip._effGain
+    _bzero = 0.0
+    if chip.computedSky is not None:
         log.info("Applying sky value of %0.6f to %s" % (chip.computedSky, _expname))
-        _insci = _sciext.data - chip.computedSky
-    # If input SCI image is still integer format (RAW files)
-    # transform it to float32 for all subsequent operations
-    # needed for numpy >=1.12.x
-    if np.issubdtype(_insci[0, 0], np.int16):
-        _insci = _insci.astype(np.float32)
-
-    _insci *= chip._effGain
+        _bzero = -chip.computedSky * chip._effGain
 
     # Set additional parameters needed by 'drizzle'
     _in_units = chip.in_units.lower()
@@ -923,12 +943,29 @@ def run_driz_chip(img, chip, output_wcs, outwcs, template, paramDict, single,
 
     time_pre = time.time() - epoch; epoch = time.time()
     # New interface to performing the drizzle operation on a single chip/image
-    _vers = do_driz(_insci, chip.wcs, _inwht, outwcs, _outsci, _outwht, _outctx,
-                _expin, _in_units, chip._wtscl,
-                wcslin_pscale=chip.wcslin_pscale, uniqid=_uniqid,
-                pixfrac=paramDict['pixfrac'], kernel=paramDict['kernel'],
-                fillval=paramDict['fillval'], stepsize=paramDict['stepsize'],
-                wcsmap=wcsmap)
+    if tiled is None:
+        _vers = do_driz(_insci, chip.wcs, _inwht, outwcs, _outsci, _outwht, _outctx,
+                    _expin, _in_units, chip._wtscl,
+                    wcslin_pscale=chip.wcslin_pscale, uniqid=_uniqid,
+                    pixfrac=paramDict['pixfrac'], kernel=paramDict['kernel'],
+                    fillval=paramDict['fillval'], stepsize=paramDict['stepsize'],
+                    wcsmap=wcsmap, bscale=_bscale, bzero=_bzero)
+    else:
+        tiled['chips'].append(dict(
+            insci=_insci, input_wcs=chip.wcs, inwht=_inwht, expin=_expin,
+            in_units=_in_units, wt_scl=chip._wtscl,
+            wcslin_pscale=chip.wcslin_pscale, uniqid=_uniqid,
+            pixfrac=paramDict['pixfrac'], kernel=paramDict['kernel'],
+            bscale=_bscale, bzero=_bzero))
+        _vers = None
+        if doWrite:
+            _vers = do_driz_tiled(tiled['chips'], outwcs, _outsci, _outwht,
+                                  _outctx, fillval=paramDict['fillval'],
+                                  stepsize=paramDict['stepsize'],
+                                  num_threads=tiled['num_threads'])
+            tiled['chips'] = []
+            for outputvals in _hdrlist:
+                outputvals['driz_version'] = _vers
     time_driz = time.time() - epoch; epoch = time.time()
 
     # Set up information for generating output FITS image
@@ -1031,13 +1068,21 @@ def do_driz(insci, input_wcs, inwht,
             output_wcs, outsci, outwht, outcon,
             expin, in_units, wt_scl,
             wcslin_pscale=1.0, uniqid=1, pixfrac=1.0, kernel='square',
-            fillval="INDEF", stepsize=10, wcsmap=None):
+            fillval="INDEF", stepsize=10, wcsmap=None, bscale=1.0, bzero=0.0,
+            sum=False):
     """
     Core routine for performing 'drizzle' operation on a single input image
     All input values will be Python objects such as ndarrays, instead
     of filenames.
     File handling (input and output) will be performed by calling routine.
 
+    The input drizzled is ``bscale * insci + bzero``.  Float32, int16 and
+    uint16 arrays, in either byte order, are read without being copied.
+
+    With ``sum`` set, ``outsci`` holds the sum of the weighted data rather
+    than its weighted mean, and is neither normalized nor filled; see
+    `drizstate.DrizzleState` for keeping such a product between runs.
+
     """
     # Insure that the fillval parameter gets properly interpreted for use with tdriz
     if util.is_blank(fillval):
@@ -1050,6 +1095,52 @@ def do_driz(insci, input_wcs, inwht,
     else:
         expscale = expin
 
+    outctx = _context_plane(outcon, uniqid)
+    pix_ratio = output_wcs.pscale / wcslin_pscale
+    mapping = _driz_mapping(input_wcs, output_wcs, stepsize, wcsmap)
+
+    _shift_fr = 'output'
+    _shift_un = 'output'
+    ystart = 0
+    nmiss = 0
+    nskip = 0
+    #
+    # This call to 'cdriz.tdriz' uses the new C syntax
+    #
+    _dny = insci.shape[0]
+    # Call 'drizzle' to perform image combination
+    if insci.dtype.newbyteorder('=') not in (np.float32, np.int16, np.uint16):
+        # WARNING: Input array recast as a float32 array
+        insci = insci.astype(np.float32)
+
+    # Ask for the time spent in each stage only when it will be logged
+    want_stats = log.isEnabledFor(logutil.logging.DEBUG)
+    result = cdriz.tdriz(insci, inwht, outsci, outwht,
+        outctx, uniqid, ystart, 1, 1, _dny,
+        pix_ratio, 1.0, 1.0, 'center', pixfrac,
+        kernel, in_units, expscale, wt_scl,
+        fillval, nmiss, nskip, 1, mapping, stats=want_stats,
+        bscale=bscale, bzero=bzero, sum=sum)
+    _vers, nmiss, nskip = result[:3]
+
+    if want_stats:
+        stats = result[3]
+        log.debug('Drizzled in %.3f s: mapping %.3f s, kernel %.3f s; '
+                  '%d pixels hit, %d missed, %d lines skipped' %
+                  (stats['total_time'], stats['map_time'],
+                   stats['kernel_time'], stats['nhit'], stats['nmiss'],
+                   stats['nskip']))
+
+    if nmiss > 0:
+        log.warning('! %s points were outside the output image.' % nmiss)
+    if nskip > 0:
+        log.debug('! Note, %s input lines were skipped completely.' % nskip)
+
+    return _vers
+
+
+def _context_plane(outcon, uniqid):
+    """ Return the plane of the context image for the input ``uniqid`` """
     # Compute what plane of the context image this input would
     # correspond to:
     planeid = int((uniqid - 1) / 32)
@@ -1067,16 +1158,17 @@ def do_driz(insci, input_wcs, inwht,
 
     # Alias context image to the requested plane if 3d
     if outcon.ndim == 2:
-        outctx = outcon
+        return outcon
     else:
-        outctx = outcon[planeid]
+        return outcon[planeid]
 
-    pix_ratio = output_wcs.pscale / wcslin_pscale
 
+def _driz_mapping(input_wcs, output_wcs, stepsize, wcsmap):
+    """ Return the mapping from the input onto the output for 'tdriz' """
     if wcsmap is None and cdriz is not None:
         log.info('Using WCSLIB-based coordinate transformation...')
         log.info('stepsize = %s' % stepsize)
-        mapping = cdriz.DefaultWCSMapping(
+        return cdriz.DefaultWCSMapping(
             input_wcs, output_wcs,
             input_wcs.pixel_shape[0], input_wcs.pixel_shape[1],
             stepsize
@@ -1090,34 +1182,257 @@ def do_driz(insci, input_wcs, inwht,
         if wcsmap is None:
             wcsmap = wcs_functions.WCSMap
         wmap = wcsmap(input_wcs, output_wcs)
-        mapping = wmap.forward
+        return wmap.forward
 
-    _shift_fr = 'output'
-    _shift_un = 'output'
-    ystart = 0
+
+def do_driz_tiled(chips, output_wcs, outsci, outwht, outcon, fillval="INDEF",
+                  stepsize=10, tile=512, num_threads=None):
+    """
+    Drizzle several inputs onto one output in threads, each thread
+    drizzling onto its own tiles of the output.
+
+    ``chips`` holds a dict for each input of the arguments of `do_driz`
+    for it: ``insci``, ``input_wcs``, ``inwht``, ``expin``, ``in_units``
+    and ``wt_scl``, and any of ``wcslin_pscale``, ``uniqid``,
+    ``pixfrac``, ``kernel``, ``bscale`` and ``bzero``.
+
+    The output is split into tiles of ``tile`` pixels on a side, and
+    each input is drizzled onto each tile its footprint overlaps, as
+    a window of the output.  A tile is drizzled by one thread, with the
+    inputs in the order of ``chips``, so that no output pixel is written
+    from two threads and the result is that of drizzling the inputs one
+    after another with `do_driz`, whatever the number of threads.
+
+    """
+    if util.is_blank(fillval):
+        fillval = 'INDEF'
+    else:
+        fillval = str(fillval)
+    if num_threads is None:
+        num_threads = util.get_pool_size(None, None)
+
+    ony, onx = outsci.shape
+    ntx = (onx + tile - 1) // tile
+    nty = (ony + tile - 1) // tile
+
+    # The inputs that land on each tile, in order
+    tasks = [[] for _ in range(ntx * nty)]
+    for i, chip in enumerate(chips):
+        nx = chip['input_wcs'].pixel_shape[0]
+        ny = chip['input_wcs'].pixel_shape[1]
+        mapping = cdriz.DefaultWCSMapping(chip['input_wcs'], output_wcs,
+                                          nx, ny, stepsize)
+        xmin, xmax, ymin, ymax = footprint_box(mapping, nx, ny, npoints=16)
+
+        # Grown by as far as the kernel may reach past where the pixels land
+        pix_ratio = output_wcs.pscale / chip.get('wcslin_pscale', 1.0)
+        pixfrac = max(chip.get('pixfrac', 1.0), 1.0)
+        margin = 8 + int(np.ceil(3.0 * pixfrac / pix_ratio))
+        tx0 = max(int(xmin - margin - 1) // tile, 0)
+        tx1 = min(int(xmax + margin - 1) // tile, ntx - 1)
+        ty0 = max(int(ymin - margin - 1) // tile, 0)
+        ty1 = min(int(ymax + margin - 1) // tile, nty - 1)
+        for ty in range(ty0, ty1 + 1):
+            for tx in range(tx0, tx1 + 1):
+                tasks[ty * ntx + tx].append(i)
+
+    # The mappings hold the state of the WCS as they are used, so each
+    # thread has its own
+    local = threading.local()
+
+    def thread_mapping(i):
+        if not hasattr(local, 'mappings'):
+            local.mappings = {}
+        if i not in local.mappings:
+            input_wcs = chips[i]['input_wcs']
+            local.mappings[i] = cdriz.DefaultWCSMapping(
+                copy.deepcopy(input_wcs), copy.deepcopy(output_wcs),
+                input_wcs.pixel_shape[0], input_wcs.pixel_shape[1], stepsize
+            )
+        return local.mappings[i]
+
+    def drizzle_tile(k):
+        _vers = None
+        x0 = (k % ntx) * tile + 1
+        y0 = (k // ntx) * tile + 1
+        x1 = min(x0 + tile - 1, onx)
+        y1 = min(y0 + tile - 1, ony)
+        for i in tasks[k]:
+            chip = chips[i]
+            insci = chip['insci']
+            if insci.dtype.newbyteorder('=') not in (np.float32, np.int16, np.uint16):
+                insci = insci.astype(np.float32)
+            uniqid = chip.get('uniqid', 1)
+            in_units = chip['in_units']
+            expscale = 1.0 if in_units == 'cps' else chip['expin']
+            _vers = cdriz.tdriz(
+                insci, chip['inwht'], outsci, outwht,
+                _context_plane(outcon, uniqid), uniqid, 0, x0, y0,
+                insci.shape[0],
+                output_wcs.pscale / chip.get('wcslin_pscale', 1.0), 1.0, 1.0,
+                'center', chip.get('pixfrac', 1.0),
+                chip.get('kernel', 'square'), in_units, expscale,
+                chip['wt_scl'], 'INDEF', 0, 0, 1, thread_mapping(i),
+                bscale=chip.get('bscale', 1.0), bzero=chip.get('bzero', 0.0),
+                xmax=x1, ymax=y1)[0]
+        return _vers
+
+    # The busiest tiles are started first, so that none is left to last
+    order = sorted(range(ntx * nty), key=lambda k: -len(tasks[k]))
+    with ThreadPoolExecutor(max_workers=num_threads) as pool:
+        versions = list(pool.map(drizzle_tile, order))
+    log.info('Drizzled %d inputs onto %d tiles in %d tasks with %d threads' %
+             (len(chips), sum(1 for t in tasks if t), sum(len(t) for t in tasks),
+              num_threads))
+
+    if fillval != 'INDEF':
+        outsci[outwht == 0] = np.float32(fillval)
+
+    return next((v for v in versions if v is not None), None)
+
+
+def do_driz_strips(strips, input_wcs, output_wcs, outsci, outwht, outcon,
+                   expin, in_units, wt_scl,
+                   wcslin_pscale=1.0, uniqid=1, pixfrac=1.0, kernel='square',
+                   fillval="INDEF", stepsize=10, wcsmap=None, sum=False,
+                   prefetch=2):
+    """
+    Drizzle a single input image a strip of rows at a time, as for
+    `do_driz`, so that no more of the input than a few strips need be
+    held at once.
+
+    ``strips`` yields ``(ystart, sci, wht)`` for successive strips of the
+    input, such as from `fits_strips`: rows ``ystart + 1`` to
+    ``ystart + sci.shape[0]`` of the data and of the weights, which may
+    be None to weigh every pixel by ``wt_scl``.  It is iterated in a
+    thread of its own, up to ``prefetch`` strips ahead, so that the next
+    strips are read while one is drizzled.
+
+    The mapping, made for the whole of ``input_wcs``, and the context
+    carry over from strip to strip, and the output is filled with
+    ``fillval`` once the last strip is drizzled.  Returns the number of
+    input pixels that missed the output.
+
+    """
+    if util.is_blank(fillval):
+        fillval = 'INDEF'
+    else:
+        fillval = str(fillval)
+
+    expscale = 1.0 if in_units == 'cps' else expin
+    outctx = _context_plane(outcon, uniqid)
+    pix_ratio = output_wcs.pscale / wcslin_pscale
+    mapping = _driz_mapping(input_wcs, output_wcs, stepsize, wcsmap)
+
+    def drizzle(strip, fill):
+        ystart, sci, wht = strip
+        if sci.dtype.newbyteorder('=') not in (np.float32, np.int16, np.uint16):
+            sci = sci.astype(np.float32)
+        return cdriz.tdriz(sci, wht, outsci, outwht,
+            outctx, uniqid, ystart, 1, 1, sci.shape[0],
+            pix_ratio, 1.0, 1.0, 'center', pixfrac,
+            kernel, in_units, expscale, wt_scl,
+            fill, 0, 0, 1, mapping, sum=sum)[1:3]
+
+    # Each strip is drizzled once the next has been read, so that the
+    # output is filled only after the last
     nmiss = 0
     nskip = 0
-    #
-    # This call to 'cdriz.tdriz' uses the new C syntax
-    #
-    _dny = insci.shape[0]
-    # Call 'drizzle' to perform image combination
-    if insci.dtype > np.float32:
-        # WARNING: Input array recast as a float32 array
-        insci = insci.astype(np.float32)
-
-    _vers, nmiss, nskip = cdriz.tdriz(insci, inwht, outsci, outwht,
-        outctx, uniqid, ystart, 1, 1, _dny,
-        pix_ratio, 1.0, 1.0, 'center', pixfrac,
-        kernel, in_units, expscale, wt_scl,
-        fillval, nmiss, nskip, 1, mapping)
+    pending = None
+    for strip in _prefetch(strips, prefetch):
+        if pending is not None:
+            miss, skip = drizzle(pending, 'INDEF')
+            nmiss += miss
+            nskip += skip
+        pending = strip
+    if pending is not None:
+        miss, skip = drizzle(pending, fillval)
+        nmiss += miss
+        nskip += skip
 
     if nmiss > 0:
         log.warning('! %s points were outside the output image.' % nmiss)
     if nskip > 0:
         log.debug('! Note, %s input lines were skipped completely.' % nskip)
 
-    return _vers
+    return nmiss
+
+
+def fits_strips(filename, nrows, whtname=None):
+    """
+    Yield ``(ystart, sci, wht)`` for strips of ``nrows`` rows of the
+    image in ``filename``, such as ``'j8bt06nyq_flt.fits[sci,1]'``, and
+    of the weights in ``whtname`` if given, for `do_driz_strips`.  Only
+    the rows of each strip are read from the file.
+    """
+    def open_extn(name):
+        fileroot, extn = fileutil.parseFilename(name)
+        extname = fileutil.parseExtn(extn)
+        if extname[0] == '': extname = "PRIMARY"
+        handle = fits.open(fileroot, memmap=False)
+        return handle, handle[extname]
+
+    handles = []
+    try:
+        handle, sci_hdu = open_extn(filename)
+        handles.append(handle)
+        wht_hdu = None
+        if whtname is not None:
+            handle, wht_hdu = open_extn(whtname)
+            handles.append(handle)
+
+        ny = sci_hdu.header['NAXIS2']
+        for ystart in range(0, ny, nrows):
+            yend = min(ystart + nrows, ny)
+            sci = sci_hdu.section[ystart:yend]
+            wht = None if wht_hdu is None else wht_hdu.section[ystart:yend]
+            yield ystart, sci, wht
+    finally:
+        for handle in handles:
+            handle.close()
+
+
+def _prefetch(iterable, depth):
+    """
+    Iterate over ``iterable`` in a thread of its own, up to ``depth``
+    items ahead of the caller.
+    """
+    items = queue.Queue(maxsize=max(depth, 1))
+    stop = threading.Event()
+    end = object()
+
+    def put(item):
+        while not stop.is_set():
+            try:
+                items.put(item, timeout=0.1)
+                return True
+            except queue.Full:
+                pass
+        return False
+
+    def produce():
+        try:
+            for item in iterable:
+                if not put((item, None)):
+                    return
+        except BaseException as e:
+            put((end, e))
+            return
+        put((end, None))
+
+    thread = threading.Thread(target=produce, daemon=True)
+    thread.start()
+    try:
+        while True:
+            item, exc = items.get()
+            if item is end:
+                if exc is not None:
+                    raise exc
+                break
+            yield item
+    finally:
+        stop.set()
+        thread.join()
 
 
 def get_data(filename):
@@ -0,0 +1,283 @@
+"""
+This module keeps the state of a drizzle product between runs, so that
+new exposures can be added to it without drizzling the old ones again.
+
+The state holds the sum of the weighted data rather than its weighted
+mean, the sum of the weights, the context image and a record of every
+input drizzled onto it.  It is saved to a FITS file with ``SUM``,
+``WHT`` and ``CON`` image extensions and an ``INPUTS`` table, and the
+product itself is made from it with :meth:`DrizzleState.product`::
+
+    state = DrizzleState.load('skycell.state.fits')
+    state.add('new_flt.fits[sci,1]', sci, wht, mapping, expin=exptime)
+    state.remove('bad_flt.fits[sci,1]', badsci, badwht, badmapping)
+    state.save('skycell.state.fits')
+    outsci, outwht, outcon = state.product(fillval=0)
+
+For outputs too large to hold, `tile_order` orders the inputs so that
+those landing on the same tiles of a `cdriz.SparseOutput` kept on disk
+are drizzled one after another, and tiles are mapped in fewer times.
+
+:License: :doc:`LICENSE`
+
+"""
+import os
+
+import numpy as np
+from astropy.io import fits
+
+from . import cdriz
+
+__all__ = ['DrizzleState', 'footprint_box', 'tile_order']
+
+STATE_FORMAT = 'DRIZSTATE'
+STATE_VERSION = 1
+
+# Weight left on a pixel with no context, as a fraction of that an input
+# took off it, below which the pixel counts as empty
+REMOVE_TOLERANCE = 1e-5
+
+# The columns of the INPUTS table: what was drizzled and how
+INPUT_COLUMNS = [('NAME', '128A'), ('UNIQID', 'J'), ('EXPIN', 'D'),
+                 ('INUNITS', '8A'), ('WTSCL', 'D'), ('KERNEL', '16A'),
+                 ('PIXFRAC', 'D'), ('SCALE', 'D')]
+
+
+class DrizzleState:
+    """
+    The sums, weights, context and inputs of a drizzle product.
+
+    Parameters
+    ----------
+    shape : tuple
+        The (ny, nx) shape of the product.
+
+    """
+    def __init__(self, shape):
+        self.sum = np.zeros(shape, dtype=np.float32)
+        self.weight = np.zeros(shape, dtype=np.float32)
+        self.context = np.zeros((1,) + tuple(shape), dtype=np.int32)
+        self.inputs = []
+
+    @property
+    def shape(self):
+        return self.sum.shape
+
+    @property
+    def exptime(self):
+        """ The total exposure time of the inputs drizzled so far """
+        return sum(row['EXPIN'] for row in self.inputs)
+
+    def find(self, name):
+        """ Return the record of the input called ``name``, or None """
+        for row in self.inputs:
+            if row['NAME'] == name:
+                return row
+        return None
+
+    def _context_plane(self, uniqid):
+        """ Return the plane of the context image holding ``uniqid`` """
+        planeid = (uniqid - 1) // 32
+        if self.context.shape[0] <= planeid:
+            planes = np.zeros((planeid + 1 - self.context.shape[0],) +
+                              self.shape, dtype=np.int32)
+            self.context = np.concatenate([self.context, planes])
+        return self.context[planeid]
+
+    def add(self, name, insci, inwht, mapping, expin=1.0, in_units='cps',
+            wt_scl=1.0, kernel='square', pixfrac=1.0, scale=1.0, **kwargs):
+        """
+        Drizzle an input onto the product, and record it.
+
+        Parameters
+        ----------
+        name : str
+            A name for the input, such as its file name and extension,
+            unique among the inputs of the product.
+
+        insci, inwht : ndarray
+            The input data and weights, as for `cdriz.tdriz`.
+
+        mapping : callable
+            The mapping from the input onto the product, such as a
+            `cdriz.DefaultWCSMapping`.
+
+        expin, in_units, wt_scl, kernel, pixfrac, scale
+            As for `cdriz.tdriz`, with ``scale`` the ratio of the output
+            and input pixel scales.
+
+        kwargs
+            Passed on to `cdriz.tdriz`, such as ``bscale``, ``bzero``,
+            ``dq`` and ``bits``.
+
+        Returns
+        -------
+        nmiss, nskip : int
+            The input pixels that missed the product, and the input
+            lines skipped.
+
+        """
+        if self.find(name) is not None:
+            raise ValueError("'{}' has already been drizzled onto this "
+                             "product".format(name))
+
+        uniqid = max([row['UNIQID'] for row in self.inputs], default=0) + 1
+        expscale = 1.0 if in_units == 'cps' else expin
+        _vers, nmiss, nskip = cdriz.tdriz(
+            insci, inwht, self.sum, self.weight,
+            self._context_plane(uniqid), uniqid, 0, 1, 1, insci.shape[0],
+            scale, 1.0, 1.0, 'center', pixfrac,
+            kernel, in_units, expscale, wt_scl,
+            'INDEF', 0, 0, 1, mapping, sum=True, **kwargs
+        )[:3]
+
+        self.inputs.append({'NAME': name, 'UNIQID': uniqid, 'EXPIN': expin,
+                            'INUNITS': in_units, 'WTSCL': wt_scl,
+                            'KERNEL': kernel, 'PIXFRAC': pixfrac,
+                            'SCALE': scale})
+
+        return nmiss, nskip
+
+    def remove(self, name, insci, inwht, mapping, **kwargs):
+        """
+        Take an input back off the product, in time proportional to its
+        footprint rather than to the whole product.
+
+        The input is drizzled again with the parameters it was added
+        with, with its weights negated, and its bit of the context is
+        cleared.  ``insci``, ``inwht``, ``mapping`` and ``kwargs`` must
+        be those it was added with, as for :meth:`add`.
+
+        Returns
+        -------
+        nmiss, nskip : int
+            As for :meth:`add`.
+
+        """
+        row = self.find(name)
+        if row is None:
+            raise ValueError("'{}' has not been drizzled onto this "
+                             "product".format(name))
+
+        uniqid = row['UNIQID']
+        in_units = row['INUNITS']
+        expscale = 1.0 if in_units == 'cps' else row['EXPIN']
+        before = self.weight.copy()
+        _vers, nmiss, nskip = cdriz.tdriz(
+            insci, inwht, self.sum, self.weight,
+            self._context_plane(uniqid), uniqid, 0, 1, 1, insci.shape[0],
+            row['SCALE'], 1.0, 1.0, 'center', row['PIXFRAC'],
+            row['KERNEL'], in_units, expscale, row['WTSCL'],
+            'INDEF', 0, 0, 1, mapping, sum=True, remove=True, **kwargs
+        )[:3]
+
+        # Pixels no input is left on hold nothing, whatever the rounding
+        # of the sums left behind.  The negative lobes of the lanczos
+        # kernels leave weight with no bit of the context, so only the
+        # pixels left with next to none of the weight taken off are emptied
+        empty = ~np.any(self.context, axis=0)
+        empty &= (np.abs(self.weight) <=
+                  REMOVE_TOLERANCE * np.abs(before - self.weight))
+        self.sum[empty] = 0.0
+        self.weight[empty] = 0.0
+
+        self.inputs.remove(row)
+
+        return nmiss, nskip
+
+    def product(self, fillval='INDEF'):
+        """
+        Return the data, weight and context images of the product, with
+        ``fillval`` where nothing was drizzled.  The state is unchanged.
+        """
+        outsci = self.sum.copy()
+        cdriz.normalize(outsci, self.weight, str(fillval))
+        return outsci, self.weight.copy(), self.context.copy()
+
+    def save(self, filename):
+        """
+        Write the state to ``filename``, replacing any state there only
+        once the new one is complete.
+        """
+        phdr = fits.Header()
+        phdr['DSFORMAT'] = (STATE_FORMAT, 'Drizzle product state')
+        phdr['DSVERS'] = (STATE_VERSION, 'Version of the state format')
+        phdr['NDRIZIM'] = (len(self.inputs), 'Number of inputs drizzled')
+        phdr['DRIZEXPT'] = (self.exptime, 'Total exposure time of the inputs')
+
+        columns = [fits.Column(name=col, format=fmt,
+                               array=np.array([row[col] for row in self.inputs]))
+                   for col, fmt in INPUT_COLUMNS]
+
+        hdulist = fits.HDUList([
+            fits.PrimaryHDU(header=phdr),
+            fits.ImageHDU(self.sum, name='SUM'),
+            fits.ImageHDU(self.weight, name='WHT'),
+            fits.ImageHDU(self.context, name='CON'),
+            fits.BinTableHDU.from_columns(columns, name='INPUTS')
+        ])
+
+        tmpname = filename + '.tmp'
+        hdulist.writeto(tmpname, overwrite=True)
+        os.replace(tmpname, filename)
+
+    @classmethod
+    def load(cls, filename):
+        """ Read a state written by :meth:`save` """
+        with fits.open(filename, memmap=False) as hdulist:
+            phdr = hdulist[0].header
+            if (phdr.get('DSFORMAT') != STATE_FORMAT or
+                    phdr.get('DSVERS', 0) > STATE_VERSION):
+                raise ValueError("'{}' is not a drizzle product state "
+                                 "this version can read".format(filename))
+
+            state = cls(hdulist['SUM'].data.shape)
+            state.sum[...] = hdulist['SUM'].data
+            state.weight[...] = hdulist['WHT'].data
+            state.context = np.ascontiguousarray(hdulist['CON'].data,
+                                                 dtype=np.int32)
+
+            table = hdulist['INPUTS'].data
+            for i in range(len(table)):
+                row = {}
+                for col, fmt in INPUT_COLUMNS:
+                    value = table[col][i]
+                    row[col] = str(value) if fmt.endswith('A') else value.item()
+                state.inputs.append(row)
+
+        return state
+
+
+def footprint_box(mapping, nx, ny, npoints=8):
+    """
+    Return the (xmin, xmax, ymin, ymax) output pixels bounding where
+    an ``nx`` x ``ny`` input lands through ``mapping``, from
+    ``npoints`` points along each edge.
+    """
+    t = np.arange(npoints, dtype=np.float64) / npoints
+    x = np.concatenate([1 + (nx - 1) * t, np.full(npoints, float(nx)),
+                        nx - (nx - 1) * t, np.ones(npoints)])
+    y = np.concatenate([np.ones(npoints), 1 + (ny - 1) * t,
+                        np.full(npoints, float(ny)), ny - (ny - 1) * t])
+    xout, yout = mapping(x, y)
+    return xout.min(), xout.max(), yout.min(), yout.max()
+
+
+def tile_order(boxes, tile):
+    """
+    Return the indices of ``boxes``, as from `footprint_box`, in the
+    order in which to drizzle them onto an output in tiles of ``tile``
+    pixels: along a Z-order curve through the tiles of their centres,
+    so that inputs close on the output are drizzled together.
+    """
+    def key(i):
+        xmin, xmax, ymin, ymax = boxes[i]
+        tx = max(int(0.5 * (xmin + xmax) - 1) // tile, 0)
+        ty = max(int(0.5 * (ymin + ymax) - 1) // tile, 0)
+        code = 0
+        for bit in range(32):
+            code |= ((tx >> bit) & 1) << (2 * bit)
+            code |= ((ty >> bit) & 1) << (2 * bit + 1)
+        return code
+
+    return sorted(range(len(boxes)), key=key)
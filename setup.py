@@ -21,6 +21,11 @@ include_dirs.extend(wcs_includes)
 # Setup C module macros
 define_macros = []
 
+# The C core drizzles and blots with POSIX threads
+libraries = []
+if sys.platform != 'win32':
+    libraries.append('pthread')
+
 # Handle MSVC `wcsset` redefinition
 if sys.platform == 'win32':
     define_macros += [
@@ -67,6 +72,7 @@ setup(
         Extension('drizzlepac.cdriz',
                   glob('src/*.c'),
                   include_dirs=include_dirs,
-                  define_macros=define_macros),
+                  define_macros=define_macros,
+                  libraries=libraries),
     ],
 )
@@ -18,6 +18,7 @@
 #include "cdrizzlemap.h"
 #include "cdrizzleutil.h"
 #include "cdrizzlewcs.h"
+#include "cdrizzlewcsmap.h"
 
 static PyObject *gl_Error;
 
@@ -322,8 +323,447 @@ static PyTypeObject WCSMapType = {
   PyWCSMap_new,                                    /* tp_new */
 };
 
+/**
+Build the dictionary returned by tdriz and tblot when asked for their
+statistics.
+*/
+static PyObject *
+stats_to_dict(const struct driz_stats_t* stats)
+{
+  return Py_BuildValue("{s:d,s:d,s:d,s:d,s:d,s:d,s:i,s:i,s:i,s:i}",
+                       "total_time", stats->total_time,
+                       "map_time", stats->map_time,
+                       "kernel_time", stats->kernel_time,
+                       "wcs_pix2sky_time", stats->wcs_pix2sky_time,
+                       "wcs_sky2pix_time", stats->wcs_sky2pix_time,
+                       "wcs_table_time", stats->wcs_table_time,
+                       "nmap", stats->nmap,
+                       "nhit", stats->nhit,
+                       "nmiss", stats->nmiss,
+                       "nskip", stats->nskip);
+}
+
+/**
+Whether the drizzle core can read \a obj where it lies, converting its
+pixels as it goes: a 2D, C-contiguous and aligned float32, int16 or
+uint16 array in either byte order, such as a FITS extension read
+straight from disk.  Fills in \a format if so.
+*/
+static int
+input_in_place(PyObject *obj, const double bscale, const double bzero,
+               struct driz_pixel_format_t *format)
+{
+  PyArrayObject *arr;
+  int type;
+
+  if (!PyArray_Check(obj)) {
+    return 0;
+  }
+  arr = (PyArrayObject *)obj;
+  type = PyArray_TYPE(arr);
+  if (PyArray_NDIM(arr) != 2 ||
+      !PyArray_IS_C_CONTIGUOUS(arr) || !PyArray_ISALIGNED(arr) ||
+      (type != NPY_FLOAT32 && type != NPY_INT16 && type != NPY_UINT16)) {
+    return 0;
+  }
+
+  driz_pixel_format_init(format);
+  format->type = type == NPY_FLOAT32 ? pixel_float32 :
+    type == NPY_INT16 ? pixel_int16 : pixel_uint16;
+  format->swapped = (bool_t)PyArray_ISBYTESWAPPED(arr);
+  format->bscale = bscale;
+  format->bzero = bzero;
+
+  return 1;
+}
+
+/**
+Convert a fill value string, where INDEF (or nothing) means not to fill.
+*/
+static int
+fill_str2value(const char* fillstr, bool_t* do_fill, float* fill_value,
+               struct driz_error_t* error)
+{
+#ifndef _WIN32
+  char *fillstr_end;
+#endif
+
+  if (fillstr == NULL ||
+      *fillstr == 0 ||
+      strncmp(fillstr, "INDEF", 6) == 0 ||
+      strncmp(fillstr, "indef", 6) == 0)
+  {
+    *do_fill = 0;
+    *fill_value = 0.0;
+  } else {
+    *do_fill = 1;
+#ifdef _WIN32
+    *fill_value = atof(fillstr);
+#else
+    *fill_value = strtof(fillstr, &fillstr_end);
+    if (fillstr == fillstr_end || *fillstr_end != '\0') {
+      driz_error_format_message(error, "Could not convert fill value '%s'",
+                                fillstr);
+      return 1;
+    }
+#endif
+  }
+
+  return 0;
+}
+
+/**
+Get a data quality array of 16-bit flags, held as it is when it is
+int16 or uint16 in either byte order, and converted to uint16
+otherwise.  Returns a new reference, or NULL with a Python exception
+set.
+*/
+static PyArrayObject *
+dq_array(PyObject *obj, bool_t *swapped)
+{
+  PyArrayObject *arr;
+  int type;
+
+  *swapped = FALSE;
+  if (PyArray_Check(obj)) {
+    arr = (PyArrayObject *)obj;
+    type = PyArray_TYPE(arr);
+    if (PyArray_NDIM(arr) == 2 &&
+        PyArray_IS_C_CONTIGUOUS(arr) && PyArray_ISALIGNED(arr) &&
+        (type == NPY_INT16 || type == NPY_UINT16)) {
+      *swapped = (bool_t)PyArray_ISBYTESWAPPED(arr);
+      Py_INCREF(obj);
+      return arr;
+    }
+  }
+
+  arr = (PyArrayObject *)PyArray_FROM_OTF(obj, NPY_UINT16,
+                                          NPY_ARRAY_CARRAY |
+                                          NPY_ARRAY_FORCECAST);
+  if (arr && PyArray_NDIM(arr) != 2) {
+    Py_DECREF(arr);
+    return NULL;
+  }
+
+  return arr;
+}
+
+/**
+Get an input array of the drizzle core, whose pixels are bscale * v +
+bzero for the values v in \a obj.  An array that input_in_place()
+accepts is used as it is, and anything else converted to float32.
+*raw is set to the data of the array when the core must convert it as
+it reads it, and to NULL for a native float32 array read directly.
+Returns a new reference, or NULL with a Python exception set.
+*/
+static PyArrayObject *
+input_array(PyObject *obj, const double bscale, const double bzero,
+            struct driz_pixel_format_t *format, const void **raw)
+{
+  PyArrayObject *arr;
+
+  *raw = NULL;
+  if (input_in_place(obj, bscale, bzero, format)) {
+    Py_INCREF(obj);
+    arr = (PyArrayObject *)obj;
+  } else {
+    arr = (PyArrayObject *)PyArray_ContiguousFromAny(obj, NPY_FLOAT32, 2, 2);
+    if (!arr) {
+      return NULL;
+    }
+    driz_pixel_format_init(format);
+    format->bscale = bscale;
+    format->bzero = bzero;
+  }
+
+  if (format->type != pixel_float32 || format->swapped ||
+      format->bscale != 1.0 || format->bzero != 0.0) {
+    *raw = PyArray_DATA(arr);
+  }
+
+  return arr;
+}
+
+/**
+
+A sparse output for tdriz, whose tiles are allocated only as they are
+drizzled onto, for outputs much larger than the area the inputs cover.
+
+*/
+typedef struct {
+  PyObject_HEAD
+  struct driz_tiles_t tiles;
+} PySparseOutput;
+
+static void
+PySparseOutput_dealloc(PySparseOutput* self)
+{
+  driz_tiles_free(&self->tiles);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+PySparseOutput_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  PySparseOutput *self;
+
+  self = (PySparseOutput *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    memset(&self->tiles, 0, sizeof(struct driz_tiles_t));
+    self->tiles.fd = -1;
+    self->tiles.last = -1;
+  }
+
+  return (PyObject *)self;
+}
+
+static int
+PySparseOutput_init(PySparseOutput *self, PyObject *args, PyObject *kwds)
+{
+  /* Arguments in the order they appear */
+  int ny, nx;
+  int nplanes = 1;
+  int tile = 256;
+  char *filename = NULL;
+  int max_tiles = 64;
+
+  /* Other miscellaneous local variables */
+  struct driz_error_t error;
+  integer_t shift;
+
+  static char *kwlist[] = {"shape", "nplanes", "tile", "filename",
+                           "max_tiles", NULL};
+
+  driz_error_init(&error);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "(ii)|iizi:SparseOutput",
+                                   kwlist, &ny, &nx, &nplanes, &tile,
+                                   &filename, &max_tiles)) {
+    return -1;
+  }
+
+  for (shift = 0; ((integer_t)1 << shift) < tile; ++shift)
+    ;
+  if (((integer_t)1 << shift) != tile) {
+    PyErr_SetString(PyExc_ValueError, "tile must be a power of two");
+    return -1;
+  }
+
+  driz_tiles_free(&self->tiles);
+  if (driz_tiles_init(&self->tiles, nx, ny, shift, nplanes, filename,
+                      max_tiles, &error)) {
+    PyErr_SetString(PyExc_ValueError, driz_error_get_message(&error));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+Copy rows y0 to y0 + ny - 1 of a sparse output into new dense arrays,
+with the fill value where the weight is 0.
+*/
+static PyObject *
+sparse_output_rows(PySparseOutput *self, const integer_t y0,
+                   const integer_t ny, const char *fillstr)
+{
+  PyArrayObject *data = NULL, *counts = NULL, *context = NULL;
+  npy_intp dims[3];
+  bool_t do_fill;
+  float fill_value;
+  struct driz_error_t error;
+  struct driz_param_t p;
+
+  driz_error_init(&error);
+
+  if (self->tiles.tiles == NULL) {
+    PyErr_SetString(PyExc_ValueError, "SparseOutput is not initialized");
+    return NULL;
+  }
+
+  if (y0 < 0 || ny < 0 || y0 + ny > self->tiles.ony) {
+    PyErr_SetString(PyExc_IndexError, "Rows out of range");
+    return NULL;
+  }
+
+  if (fill_str2value(fillstr, &do_fill, &fill_value, &error)) {
+    PyErr_SetString(PyExc_ValueError, driz_error_get_message(&error));
+    return NULL;
+  }
+
+  dims[0] = self->tiles.nplanes;
+  dims[1] = ny;
+  dims[2] = self->tiles.onx;
+  data = (PyArrayObject *)PyArray_SimpleNew(2, dims + 1, NPY_FLOAT32);
+  counts = (PyArrayObject *)PyArray_SimpleNew(2, dims + 1, NPY_FLOAT32);
+  context = (PyArrayObject *)PyArray_SimpleNew(3, dims, NPY_INT32);
+  if (data == NULL || counts == NULL || context == NULL) {
+    goto sparse_output_rows_error_;
+  }
+
+  if (driz_tiles_read_rows(&self->tiles, y0, ny, PyArray_DATA(data),
+                           PyArray_DATA(counts), PyArray_DATA(context))) {
+    PyErr_SetString(PyExc_MemoryError, "Could not map an output tile");
+    goto sparse_output_rows_error_;
+  }
+
+  if (do_fill) {
+    driz_param_init(&p);
+    p.output_data = PyArray_DATA(data);
+    p.output_counts = PyArray_DATA(counts);
+    p.xmin = p.ymin = 1;
+    p.onx = p.xmax = self->tiles.onx;
+    p.ony = p.ymax = ny;
+    put_fill(&p, fill_value);
+  }
+
+  return Py_BuildValue("NNN", data, counts, context);
+
+ sparse_output_rows_error_:
+  Py_XDECREF(data);
+  Py_XDECREF(counts);
+  Py_XDECREF(context);
+  return NULL;
+}
+
+static PyObject *
+PySparseOutput_to_dense(PySparseOutput *self, PyObject *args)
+{
+  /* Arguments in the order they appear */
+  char *fillstr = NULL;
+
+  if (!PyArg_ParseTuple(args, "|s:to_dense", &fillstr)) {
+    return NULL;
+  }
+
+  return sparse_output_rows(self, 0, self->tiles.ony, fillstr);
+}
+
 static PyObject *
-tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
+PySparseOutput_read_rows(PySparseOutput *self, PyObject *args)
+{
+  /* Arguments in the order they appear */
+  int y0, ny;
+  char *fillstr = NULL;
+
+  if (!PyArg_ParseTuple(args, "ii|s:read_rows", &y0, &ny, &fillstr)) {
+    return NULL;
+  }
+
+  return sparse_output_rows(self, y0, ny, fillstr);
+}
+
+static PyObject *
+PySparseOutput_get_shape(PySparseOutput *self, void *closure)
+{
+  return Py_BuildValue("(ii)", self->tiles.ony, self->tiles.onx);
+}
+
+static PyObject *
+PySparseOutput_get_ntiles(PySparseOutput *self, void *closure)
+{
+  return Py_BuildValue("i", self->tiles.ntouched);
+}
+
+static PyObject *
+PySparseOutput_get_nbytes(PySparseOutput *self, void *closure)
+{
+  const size_t n = (size_t)1 << (2 * self->tiles.shift);
+
+  if (self->tiles.fd >= 0) {
+    return PyLong_FromSize_t((size_t)self->tiles.nresident *
+                             self->tiles.slot_bytes);
+  }
+
+  return PyLong_FromSize_t((size_t)self->tiles.ntouched * n *
+                           (2 * sizeof(float) +
+                            (size_t)self->tiles.nplanes * sizeof(integer_t)));
+}
+
+static PyObject *
+PySparseOutput_get_nevict(PySparseOutput *self, void *closure)
+{
+  return Py_BuildValue("i", self->tiles.nevict);
+}
+
+static PyMethodDef PySparseOutput_methods[] = {
+  {"to_dense", (PyCFunction)PySparseOutput_to_dense, METH_VARARGS,
+   "to_dense(fill='INDEF')\n\nReturn the data, weight and context (nplanes x ny x nx) as dense arrays, with fill where the weight is 0."},
+  {"read_rows", (PyCFunction)PySparseOutput_read_rows, METH_VARARGS,
+   "read_rows(y0, ny, fill='INDEF')\n\nAs to_dense, for rows y0 to y0 + ny - 1 alone, to write out an output too large to hold."},
+  {NULL, NULL, 0, NULL}                      /* sentinel */
+};
+
+static PyGetSetDef PySparseOutput_getset[] = {
+  {"shape", (getter)PySparseOutput_get_shape, NULL,
+   "The (ny, nx) shape of the output", NULL},
+  {"ntiles", (getter)PySparseOutput_get_ntiles, NULL,
+   "The number of tiles drizzled onto so far", NULL},
+  {"nbytes", (getter)PySparseOutput_get_nbytes, NULL,
+   "The memory held by tiles", NULL},
+  {"nevict", (getter)PySparseOutput_get_nevict, NULL,
+   "The number of times a tile was unmapped to make room for another", NULL},
+  {NULL, NULL, NULL, NULL, NULL}             /* sentinel */
+};
+
+static PyTypeObject SparseOutputType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  (char *) "cdriz.SparseOutput",                   /*tp_name*/
+  sizeof(PySparseOutput),                          /*tp_basicsize*/
+  0,                                               /*tp_itemsize*/
+  (destructor) PySparseOutput_dealloc,             /*tp_dealloc*/
+  0,                                               /*tp_print*/
+  0,                                               /*tp_getattr*/
+  0,                                               /*tp_setattr*/
+  0,                                               /*tp_compare*/
+  0,                                               /*tp_repr*/
+  0,                                               /*tp_as_number*/
+  0,                                               /*tp_as_sequence*/
+  0,                                               /*tp_as_mapping*/
+  0,                                               /*tp_hash */
+  0,                                               /*tp_call*/
+  0,                                               /*tp_str*/
+  0,                                               /*tp_getattro*/
+  0,                                               /*tp_setattro*/
+  0,                                               /*tp_as_buffer*/
+  (long) Py_TPFLAGS_DEFAULT,                       /*tp_flags*/
+  (char *) "SparseOutput(shape, nplanes=1, tile=256, filename=None, max_tiles=64)\n\nAn output for tdriz held in tiles of tile x tile pixels (a power of two), allocated as they are first drizzled onto, with nplanes planes of context.  Pass it to tdriz as output, with outweight and context None.\n\nWith a filename, the tiles are kept in that file (created afresh), with no more than max_tiles of them mapped into memory at once.", /* tp_doc */
+  0,                                               /* tp_traverse */
+  0,                                               /* tp_clear */
+  0,                                               /* tp_richcompare */
+  0,                                               /* tp_weaklistoffset */
+  0,                                               /* tp_iter */
+  0,                                               /* tp_iternext */
+  PySparseOutput_methods,                          /* tp_methods */
+  0,                                               /* tp_members */
+  PySparseOutput_getset,                           /* tp_getset */
+  0,                                               /* tp_base */
+  0,                                               /* tp_dict */
+  0,                                               /* tp_descr_get */
+  0,                                               /* tp_descr_set */
+  0,                                               /* tp_dictoffset */
+  (initproc)PySparseOutput_init,                   /* tp_init */
+  0,                                               /* tp_alloc */
+  PySparseOutput_new,                              /* tp_new */
+};
+
+/* The threads a drizzle or blot may use: as many as asked for when
+   the mapping is a DefaultWCSMapping with a positive factor, which is
+   affine or interpolated in its table and so only read, and one
+   otherwise, since neither WCSLIB nor a mapping in Python may be
+   called from several threads */
+static integer_t
+mapping_threads(const int threads, const struct wcsmap_param_t* m)
+{
+  if (m == NULL || m->factor <= 0) {
+    return 1;
+  }
+  return (integer_t)MAX(threads, 1);
+}
+
+static PyObject *
+tdriz(PyObject *obj UNUSED_PARAM, PyObject *args, PyObject *keywds)
 {
   /* Arguments in the order they appear */
   PyObject *oimg, *owei, *oout, *owht, *ocon;
@@ -336,34 +776,63 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
   char *fillstr;
   integer_t nmiss, nskip, vflag;
   PyObject *callback_obj;
+  int want_stats = 0;
+  int batch = 0;
+  double bscale = 1.0, bzero = 0.0;
+  PyObject *odq = Py_None;
+  long bits = 0;
+  int errors = 0;
+  int sum = 0;
+  int remove = 0;
+  long xmax = 0, ymax = 0;
+  int threads = 1;
+  char *parallel_str = "bands";
+
+  static char *kwlist[] = {"image", "weight", "output", "outweight", "context",
+                           "uniqid", "ystart", "xmin", "ymin", "dny", "scale",
+                           "xscale", "yscale", "align", "pfract", "kernel",
+                           "inun", "expin", "wtscl", "fill", "nmiss", "nskip",
+                           "vflag", "callback", "stats", "batch", "bscale",
+                           "bzero", "dq", "bits", "errors", "sum", "remove",
+                           "xmax", "ymax", "threads", "parallel", NULL};
 
   /* Derived values */
   PyArrayObject *img = NULL, *wei = NULL, *out = NULL, *wht = NULL, *con = NULL;
+  PyArrayObject *dq = NULL;
+  bool_t dq_swapped = FALSE;
+  struct driz_tiles_t *tiles = NULL;
   enum e_align_t align;
   enum e_kernel_t kernel;
   enum e_unit_t inun;
+  enum e_parallel_t parallel;
   integer_t nx, ny, onx, ony;
-  char *fillstr_end;
+  size_t offset;
   bool_t do_fill;
   float fill_value;
   mapping_callback_t callback = NULL;
   void* callback_state = NULL;
+  struct wcsmap_param_t* m = NULL;
+  struct driz_pixel_format_t data_format, weights_format;
+  const void *data_raw, *weights_raw;
   int istat = 0;
   struct driz_error_t error;
   struct driz_param_t p;
-
-  /* struct wcsmap_param_t* m = NULL; */
-  /* clock_t start_t, end_t; */
-  /* double delta_time; */
+  struct driz_stats_t stats;
 
   driz_error_init(&error);
-
-  if (!PyArg_ParseTuple(args,"OOOOOllllldddsdssffsiiiO:tdriz",
-                        &oimg, &owei, &oout, &owht, &ocon, &uniqid, &ystart,
-                        &xmin, &ymin, &dny, &scale, &xscale, &yscale,
-                        &align_str, &pfract, &kernel_str, &inun_str,
-                        &expin, &wtscl, &fillstr, &nmiss,&nskip, &vflag,
-                        &callback_obj)) {
+  driz_stats_init(&stats);
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds,
+                                   "OOOOOllllldddsdssffsiiiO|iiddOliiillis:tdriz", kwlist,
+                                   &oimg, &owei, &oout, &owht, &ocon, &uniqid,
+                                   &ystart, &xmin, &ymin, &dny, &scale,
+                                   &xscale, &yscale, &align_str, &pfract,
+                                   &kernel_str, &inun_str, &expin, &wtscl,
+                                   &fillstr, &nmiss, &nskip, &vflag,
+                                   &callback_obj, &want_stats, &batch,
+                                   &bscale, &bzero, &odq, &bits, &errors,
+                                   &sum, &remove, &xmax, &ymax,
+                                   &threads, &parallel_str)) {
     return PyErr_Format(gl_Error, "cdriz.tdriz: Invalid Parameters.");
   }
 
@@ -387,7 +856,8 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
     /* If we're using the default mapping, we can set things up to avoid
        the Python/C bridge */
     callback = default_wcsmap;
-    callback_state = (void *)&(((PyWCSMap *)callback_obj)->m);
+    m = &(((PyWCSMap *)callback_obj)->m);
+    callback_state = (void *)m;
     /*scale = ((PyWCSMap *)callback_obj)->m.scale; */
   } else {
     callback = py_mapping_callback;
@@ -395,40 +865,71 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
   }
 
   /* Get raw C-array data */
-  img = (PyArrayObject *)PyArray_ContiguousFromAny(oimg, NPY_FLOAT32, 2, 2);
+  /* Input arrays, such as big-endian FITS data, that the core can
+     read where they lie are not copied */
+  img = input_array(oimg, bscale, bzero, &data_format, &data_raw);
   if (!img) {
     driz_error_set_message(&error, "Invalid input array");
     goto _exit;
   }
 
-  wei = (PyArrayObject *)PyArray_ContiguousFromAny(owei, NPY_FLOAT32, 2, 2);
-  if (!wei) {
-    driz_error_set_message(&error, "Invalid weights array");
-    goto _exit;
+  /* The weights may be left out, to weigh by data quality alone */
+  weights_raw = NULL;
+  if (owei != Py_None) {
+    wei = input_array(owei, 1.0, 0.0, &weights_format, &weights_raw);
+    if (!wei) {
+      driz_error_set_message(&error, "Invalid weights array");
+      goto _exit;
+    }
   }
 
-  out = (PyArrayObject *)PyArray_ContiguousFromAny(oout, NPY_FLOAT32, 2, 2);
-  if (!out) {
-    driz_error_set_message(&error, "Invalid output array");
-    goto _exit;
+  if (odq != Py_None) {
+    dq = dq_array(odq, &dq_swapped);
+    if (!dq ||
+        PyArray_DIMS(dq)[0] != PyArray_DIMS(img)[0] ||
+        PyArray_DIMS(dq)[1] != PyArray_DIMS(img)[1]) {
+      driz_error_set_message(&error, "Invalid data quality array");
+      goto _exit;
+    }
   }
 
-  wht = (PyArrayObject *)PyArray_ContiguousFromAny(owht, NPY_FLOAT32, 2, 2);
-  if (!wht) {
-    driz_error_set_message(&error, "Invalid array");
-    goto _exit;
-  }
+  if (PyObject_TypeCheck(oout, &SparseOutputType)) {
+    tiles = &((PySparseOutput *)oout)->tiles;
+    if (tiles->tiles == NULL || owht != Py_None || ocon != Py_None) {
+      driz_error_set_message(&error,
+                             "A sparse output needs outweight and context None");
+      goto _exit;
+    }
+    if ((uniqid - 1) / 32 >= tiles->nplanes) {
+      driz_error_set_message(&error,
+                             "Not enough context planes in the sparse output");
+      goto _exit;
+    }
+  } else {
+    out = (PyArrayObject *)PyArray_ContiguousFromAny(oout, NPY_FLOAT32, 2, 2);
+    if (!out) {
+      driz_error_set_message(&error, "Invalid output array");
+      goto _exit;
+    }
 
-  con = (PyArrayObject *)PyArray_ContiguousFromAny(ocon, NPY_INT32, 2, 2);
-  if (!con) {
-    driz_error_set_message(&error, "Invalid context array");
-    goto _exit;
+    wht = (PyArrayObject *)PyArray_ContiguousFromAny(owht, NPY_FLOAT32, 2, 2);
+    if (!wht) {
+      driz_error_set_message(&error, "Invalid array");
+      goto _exit;
+    }
+
+    con = (PyArrayObject *)PyArray_ContiguousFromAny(ocon, NPY_INT32, 2, 2);
+    if (!con) {
+      driz_error_set_message(&error, "Invalid context array");
+      goto _exit;
+    }
   }
 
   /* Convert strings to enumerations */
   if (align_str2enum(align_str, &align, &error) ||
       kernel_str2enum(kernel_str, &kernel, &error) ||
-      unit_str2enum(inun_str, &inun, &error)) {
+      unit_str2enum(inun_str, &inun, &error) ||
+      parallel_str2enum(parallel_str, &parallel, &error)) {
     goto _exit;
   }
   if (pfract <= 0.001){
@@ -436,51 +937,89 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
     kernel_str2enum("point", &kernel, &error);
   }
 
-  /* Convert the fill value string */
-  if (fillstr == NULL ||
-      *fillstr == 0 ||
-      strncmp(fillstr, "INDEF", 6) == 0 ||
-      strncmp(fillstr, "indef", 6) == 0)
-  {
-    do_fill = 0;
-    fill_value = 0.0;
-  } else {
-    do_fill = 1;
-#ifdef _WIN32
-    fill_value = atof(fillstr);
-#else
-    fill_value = strtof(fillstr, &fillstr_end);
-    if (fillstr == fillstr_end || *fillstr_end != '\0') {
-      driz_error_format_message(&error, "Could not convert fill value '%s'",
-                                fillstr);
-      goto _exit;
-    }
-#endif
+  if (fill_str2value(fillstr, &do_fill, &fill_value, &error)) {
+    goto _exit;
+  }
+
+  if (remove && !sum) {
+    driz_error_set_message(&error, "Removing an image needs sum=True");
+    goto _exit;
   }
 
   nx = PyArray_DIMS(img)[1];
   ny = PyArray_DIMS(img)[0];
-  onx = PyArray_DIMS(out)[1];
-  ony = PyArray_DIMS(out)[0];
+  if (dny < 0 || dny > ny) {
+    driz_error_format_message(&error, "Invalid dny %ld (the image holds %ld rows)",
+                              dny, (long)ny);
+    goto _exit;
+  }
+  if (tiles) {
+    onx = tiles->onx;
+    ony = tiles->ony;
+  } else {
+    onx = PyArray_DIMS(out)[1];
+    ony = PyArray_DIMS(out)[0];
+  }
+
+  /* The window of the output drizzled onto, by default all of it */
+  if (xmax <= 0) xmax = onx;
+  if (ymax <= 0) ymax = ony;
+  if (xmin < 1 || xmin > xmax || xmax > onx ||
+      ymin < 1 || ymin > ymax || ymax > ony) {
+    driz_error_format_message(&error, "Invalid output window [%ld:%ld,%ld:%ld]",
+                              xmin, xmax, ymin, ymax);
+    goto _exit;
+  }
+  if (tiles && (xmin != 1 || ymin != 1 || xmax != onx || ymax != ony)) {
+    driz_error_set_message(&error, "A sparse output is drizzled onto whole");
+    goto _exit;
+  }
 
   nmiss = 0;
   nskip = 0;
 
   driz_param_init(&p);
 
-  p.data = PyArray_DATA(img);
-  p.weights = PyArray_DATA(wei);
-  p.output_data = PyArray_DATA(out);
-  p.output_counts = PyArray_DATA(wht);
-  p.output_context = PyArray_DATA(con);
+  if (data_raw) {
+    p.data_raw = data_raw;
+    p.data_format = data_format;
+  } else {
+    p.data = PyArray_DATA(img);
+  }
+  if (weights_raw) {
+    p.weights_raw = weights_raw;
+    p.weights_format = weights_format;
+  } else if (wei) {
+    p.weights = PyArray_DATA(wei);
+  }
+  if (dq) {
+    p.dq = PyArray_DATA(dq);
+    p.dq_swapped = dq_swapped;
+    p.dq_ignore = (integer_t)bits;
+  }
+  p.weights_error = (bool_t)(errors != 0);
+  if (tiles) {
+    tiles->plane = (uniqid - 1) / 32;
+    tiles->failed = FALSE;
+    p.output_tiles = tiles;
+  } else {
+    /* The core indexes the output from the corner of the window */
+    offset = (size_t)(ymin - 1) * (size_t)onx + (size_t)(xmin - 1);
+    p.output_data = (float *)PyArray_DATA(out) + offset;
+    p.output_counts = (float *)PyArray_DATA(wht) + offset;
+    p.output_context = (integer_t *)PyArray_DATA(con) + offset;
+  }
+  p.output_sum = (bool_t)(sum != 0);
   p.uuid = uniqid;
   p.xmin = xmin;
   p.ymin = ymin;
   p.dnx = nx;
   p.dny = ny;
   p.ny = dny;
-  p.onx = p.xmax = onx;
-  p.ony = p.ymax = ony;
+  p.xmax = xmax;
+  p.ymax = ymax;
+  p.onx = onx;
+  p.ony = ony;
   p.scale = scale;
   p.x_scale = xscale;
   p.y_scale = yscale;
@@ -489,42 +1028,57 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
   p.kernel = kernel;
   p.in_units = inun;
   p.exposure_time = expin;
-  p.weight_scale = wtscl;
+  /* Negative weights take the image back off the output */
+  p.weight_scale = remove ? -wtscl : wtscl;
   p.mapping_callback = callback;
   p.mapping_callback_state = callback_state;
+  p.map_batch = (bool_t)(batch != 0);
+  p.nthreads = mapping_threads(threads, m);
+  p.parallel = parallel;
 
   /* Setup reasonable defaults for drizzling */
   p.no_over = FALSE;
 
-  /*
-  start_t = clock();
-  */
-  /* Do the drizzling */
-  if (dobox(&p, ystart, &nmiss, &nskip, &error)) {
+  /* The time in WCSLIB is only recorded from a single thread */
+  if (want_stats) {
+    p.stats = &stats;
+    if (m && p.nthreads == 1) {
+      m->stats = &stats;
+    }
+  }
+
+  /* Do the drizzling.  Unless the mapping calls back into Python, let
+     other threads run meanwhile, such as one reading the next strip of
+     the image */
+  if (callback == default_wcsmap) {
+    Py_BEGIN_ALLOW_THREADS
+    istat = dobox(&p, ystart, &nmiss, &nskip, &error);
+    Py_END_ALLOW_THREADS
+  } else {
+    istat = dobox(&p, ystart, &nmiss, &nskip, &error);
+  }
+  if (m) {
+    m->stats = NULL;
+  }
+  if (istat) {
     goto _exit;
   }
-  /*
-  end_t = clock();
-  delta_time = difftime(end_t, start_t)/1e+6;
-  printf("==> Finished dobox() in %0.3f seconds\n",delta_time);
 
-  start_t = clock();
-  */
-  /* Put in the fill values (if defined) */
-  if (do_fill) {
+  /* Put in the fill values (if defined), unless the output holds sums
+     and is left for normalize() to fill */
+  if (do_fill && !p.output_sum) {
     put_fill(&p, fill_value);
   }
-  /*
-  if (callback == default_wcsmap){
-    m = (struct wcsmap_param_t *)p.mapping_callback_state;
-    printf("==> Coordinate transformation times: total=%0.3f sec, d2im= %0.3f, sip= %0.3f.\n",m->dtime_coord,m->dtime_d2im,m->dtime_dgeosip);
+  if (tiles && tiles->failed) {
+    driz_error_set_message(&error, "Could not allocate or map an output tile");
+    goto _exit;
   }
-  */
 
  _exit:
   Py_XDECREF(con);
   Py_XDECREF(img);
   Py_XDECREF(wei);
+  Py_XDECREF(dq);
   Py_XDECREF(out);
   Py_XDECREF(wht);
 
@@ -532,6 +1086,9 @@ tdriz(PyObject *obj UNUSED_PARAM, PyObject *args)
     if (strcmp(driz_error_get_message(&error), "<PYTHON>") != 0)
       PyErr_SetString(PyExc_Exception, driz_error_get_message(&error));
     return NULL;
+  } else if (want_stats) {
+    return Py_BuildValue("siiN", "Callable C-based DRIZZLE Version 0.8 (20th May 2009)", nmiss, nskip,
+                         stats_to_dict(&stats));
   } else {
     return Py_BuildValue("sii", "Callable C-based DRIZZLE Version 0.8 (20th May 2009)", nmiss, nskip);
   }
@@ -622,8 +1179,38 @@ twdriz(PyObject *obj, PyObject *args)
 }*/
 
 
+/**
+Return a view of the rows y1..y2 and columns x1..x2 (inclusive) of a
+2D array, by slicing it as a[y1:y2+1, x1:x2+1] would.
+*/
+static PyObject *
+array_window(PyObject *array, long x1, long x2, long y1, long y2)
+{
+  PyObject *bounds, *key, *window;
+
+  bounds = Py_BuildValue("(llll)", y1, y2 + 1, x1, x2 + 1);
+  if (!bounds) {
+    return NULL;
+  }
+
+  key = Py_BuildValue("(NN)",
+                      PySlice_New(PyTuple_GET_ITEM(bounds, 0),
+                                  PyTuple_GET_ITEM(bounds, 1), NULL),
+                      PySlice_New(PyTuple_GET_ITEM(bounds, 2),
+                                  PyTuple_GET_ITEM(bounds, 3), NULL));
+  Py_DECREF(bounds);
+  if (!key) {
+    return NULL;
+  }
+
+  window = PyObject_GetItem(array, key);
+  Py_DECREF(key);
+
+  return window;
+}
+
 static PyObject *
-tblot(PyObject *obj, PyObject *args)
+tblot(PyObject *obj, PyObject *args, PyObject *keywds)
 {
   /* Arguments in the order they appear */
   PyObject *oimg, *oout;
@@ -635,23 +1222,49 @@ tblot(PyObject *obj, PyObject *args)
   float ef, misval, sinscl;
   long vflag;
   PyObject *callback_obj = NULL;
+  long tile = 0, block = 0;
+  integer_t block_shift = 0;
+  int want_stats = 0;
+  int batch = 0;
+  double bscale = 1.0, bzero = 0.0;
+  int threads = 1;
+
+  static char *kwlist[] = {"image", "output", "xmin", "xmax", "ymin", "ymax",
+                           "scale", "kscale", "xscale", "yscale", "align",
+                           "interp", "ef", "misval", "sinscl", "vflag",
+                           "callback", "tile", "block", "stats", "batch",
+                           "bscale", "bzero", "threads", NULL};
 
   PyArrayObject *img = NULL, *out = NULL;
+  PyObject *window = NULL;
   enum e_align_t align;
   enum e_interp_t interp;
   mapping_callback_t callback = NULL;
   void *callback_state = NULL;
+  struct wcsmap_param_t *m = NULL;
   long nx,ny,onx,ony;
+  integer_t x1, x2, y1, y2;
+  struct driz_pixel_format_t format;
+  const void *raw = NULL;
+  float *data;
+  npy_intp i;
+  bool_t whole;
   int istat = 0;
   struct driz_error_t error;
   struct driz_param_t p;
+  struct driz_stats_t stats;
 
   driz_error_init(&error);
-
-  if (!PyArg_ParseTuple(args,"OOlllldfddssffflO:tblot", &oimg, &oout, &xmin,
-                        &xmax, &ymin, &ymax, &scale, &kscale, &xscale,
-                        &yscale, &align_str, &interp_str, &ef, &misval,
-                        &sinscl, &vflag, &callback_obj)){
+  driz_stats_init(&stats);
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds,
+                                   "OOlllldfddssffflO|lliiddi:tblot", kwlist,
+                                   &oimg, &oout, &xmin, &xmax, &ymin, &ymax,
+                                   &scale, &kscale, &xscale, &yscale,
+                                   &align_str, &interp_str, &ef, &misval,
+                                   &sinscl, &vflag, &callback_obj,
+                                   &tile, &block, &want_stats, &batch,
+                                   &bscale, &bzero, &threads)){
     return PyErr_Format(gl_Error, "cdriz.tblot: Invalid Parameters.");
   }
 
@@ -666,14 +1279,49 @@ tblot(PyObject *obj, PyObject *args)
     goto _exit;
   }
 
-  callback = py_mapping_callback;
-  callback_state = (void *)callback_obj;
+  if (tile < 0) {
+    driz_error_format_message(&error, "Invalid tile %ld (must be non-negative)", tile);
+    goto _exit;
+  }
 
-  img = (PyArrayObject *)PyArray_ContiguousFromAny(oimg, NPY_FLOAT32, 2, 2);
-  if (!img) {
-    driz_error_set_message(&error, "Invalid input array");
+  /* The source block edge must be a power of two */
+  if (block < 0 || (block & (block - 1)) != 0 || block > 4096) {
+    driz_error_format_message(&error, "Invalid block %ld (must be 0 or a power of two up to 4096)", block);
     goto _exit;
   }
+  while (block > 1) {
+    block >>= 1;
+    ++block_shift;
+  }
+
+  if (PyObject_TypeCheck(callback_obj, &WCSMapType)) {
+    /* As in tdriz, call the C-based mapping directly rather than
+       through its Python interface */
+    callback = default_wcsmap;
+    m = &(((PyWCSMap *)callback_obj)->m);
+    callback_state = (void *)m;
+  } else {
+    callback = py_mapping_callback;
+    callback_state = (void *)callback_obj;
+  }
+
+  /* Only the part of the source that the output samples is converted
+     below, when its shape can be had without converting it */
+  if (PyArray_Check(oimg) && PyArray_NDIM((PyArrayObject *)oimg) == 2) {
+    nx = PyArray_DIMS((PyArrayObject *)oimg)[1];
+    ny = PyArray_DIMS((PyArrayObject *)oimg)[0];
+  } else {
+    img = (PyArrayObject *)PyArray_FROM_OTF(oimg, NPY_FLOAT32,
+                                            NPY_ARRAY_CARRAY |
+                                            NPY_ARRAY_ENSURECOPY);
+    if (!img || PyArray_NDIM(img) != 2) {
+      driz_error_set_message(&error, "Invalid input array");
+      goto _exit;
+    }
+    nx = PyArray_DIMS(img)[1];
+    ny = PyArray_DIMS(img)[0];
+  }
+
   out = (PyArrayObject *)PyArray_ContiguousFromAny(oout, NPY_FLOAT32, 2, 2);
   if (!out) {
     driz_error_set_message(&error, "Invalid output array");
@@ -685,14 +1333,11 @@ tblot(PyObject *obj, PyObject *args)
     goto _exit;
   }
 
-  nx = PyArray_DIMS(img)[1];
-  ny = PyArray_DIMS(img)[0];
   onx = PyArray_DIMS(out)[1];
   ony = PyArray_DIMS(out)[0];
 
   driz_param_init(&p);
 
-  p.data = PyArray_DATA(img);
   p.output_data = PyArray_DATA(out);
   p.xmin = xmin;
   p.xmax = xmax;
@@ -712,43 +1357,153 @@ tblot(PyObject *obj, PyObject *args)
   p.ef = ef;
   p.misval = misval;
   p.sinscl = sinscl;
+  p.blot_tile = tile;
+  p.blot_block_shift = block_shift;
   p.mapping_callback = callback;
   p.mapping_callback_state = callback_state;
+  p.map_batch = (bool_t)(batch != 0);
+  p.nthreads = mapping_threads(threads, m);
+
+  if (want_stats) {
+    p.stats = &stats;
+    if (m && p.nthreads == 1) {
+      m->stats = &stats;
+    }
+  }
+
+  /* The source is windowed to what the output samples, unless a
+     folded mapping turns out to take the output beyond the window,
+     when the blot is done again from the whole source */
+  whole = FALSE;
+  for (;;) {
+    /* A source that can be read where it lies, such as big-endian FITS
+       data, is neither windowed nor copied, except for the sinc
+       interpolations, which read float32 rows directly */
+    if (img == NULL && interp != interp_sinc && interp != interp_lsinc &&
+        input_in_place(oimg, bscale, bzero, &format)) {
+      img = input_array(oimg, bscale, bzero, &format, &raw);
+      if (!img) {
+        driz_error_set_message(&error, "Invalid input array");
+        goto _exit;
+      }
+    }
+
+    if (img == NULL) {
+      if (!whole) {
+        if (blot_source_window(&p, &x1, &x2, &y1, &y2, &error)) {
+          goto _exit;
+        }
+
+        /* When nothing is sampled, hold a single pixel */
+        if (x2 < x1 || y2 < y1) {
+          x2 = x1 = y2 = y1 = 0;
+        }
+
+        if (nx > 0 && ny > 0 &&
+            (x1 > 0 || y1 > 0 || x2 < nx - 1 || y2 < ny - 1)) {
+          window = array_window(oimg, x1, x2, y1, y2);
+          if (!window) {
+            driz_error_set_message(&error, "<PYTHON>");
+            goto _exit;
+          }
+          p.blot_x1 = x1;
+          p.blot_y1 = y1;
+          p.blot_wnx = x2 - x1 + 1;
+          p.blot_wny = y2 - y1 + 1;
+        }
+      }
+
+      if (interp == interp_sinc || interp == interp_lsinc) {
+        img = (PyArrayObject *)PyArray_FROM_OTF(window ? window : oimg,
+                                                NPY_FLOAT32,
+                                                NPY_ARRAY_CARRAY |
+                                                NPY_ARRAY_ENSURECOPY);
+      } else {
+        img = input_array(window ? window : oimg, bscale, bzero, &format, &raw);
+      }
+      if (!img || PyArray_NDIM(img) != 2) {
+        driz_error_set_message(&error, "Invalid input array");
+        goto _exit;
+      }
+    }
+
+    /* Otherwise the image is a float32 copy of the source, which is
+       scaled in place */
+    if (!raw && (bscale != 1.0 || bzero != 0.0)) {
+      data = (float *)PyArray_DATA(img);
+      for (i = 0; i < PyArray_SIZE(img); ++i) {
+        data[i] = (float)(bscale * data[i] + bzero);
+      }
+    }
+
+    if (raw) {
+      p.data_raw = raw;
+      p.data_format = format;
+    } else {
+      p.data = PyArray_DATA(img);
+    }
+
+    /* As in tdriz, let other threads run unless the mapping calls back
+       into Python */
+    if (callback == default_wcsmap) {
+      Py_BEGIN_ALLOW_THREADS
+      istat = doblot(&p, &error);
+      Py_END_ALLOW_THREADS
+    } else {
+      istat = doblot(&p, &error);
+    }
 
-  istat = doblot(&p, &error);
+    if (istat && p.blot_outside && window != NULL) {
+      Py_CLEAR(window);
+      Py_CLEAR(img);
+      raw = NULL;
+      p.data = NULL;
+      p.data_raw = NULL;
+      p.blot_x1 = p.blot_y1 = 0;
+      p.blot_wnx = p.blot_wny = 0;
+      driz_error_init(&error);
+      driz_stats_init(&stats);
+      whole = TRUE;
+      istat = 0;
+      continue;
+    }
+    break;
+  }
 
  _exit:
-  Py_DECREF(img);
-  Py_DECREF(out);
+  if (m) {
+    m->stats = NULL;
+  }
+  Py_XDECREF(window);
+  Py_XDECREF(img);
+  Py_XDECREF(out);
 
   if (istat || driz_error_is_set(&error)) {
     if (strcmp(driz_error_get_message(&error), "<PYTHON>") != 0)
       PyErr_SetString(PyExc_Exception, driz_error_get_message(&error));
     return NULL;
+  } else if (want_stats) {
+    return Py_BuildValue("iN", istat, stats_to_dict(&stats));
   } else {
     return Py_BuildValue("i",istat);
   }
 }
 
 
-/* To replace the default prinf log; instead log to a pythonic log */
+/* To replace the default prinf log; instead log to a pythonic log.
+   The core may log while drizzling with the GIL released, so it is
+   taken here */
 void cdriz_log_func(const char *format, ...) {
   static PyObject *logging = NULL;
   va_list args;
   PyObject *logger;
   PyObject *string;
+  PyGILState_STATE gil;
   char msg[256];
   int n;
 
   va_start(args, format);
-
-  if (logging == NULL) {
-    logging = PyImport_ImportModuleNoBlock("logging");
-    if (logging == NULL) return;
-  }
-
   n = PyOS_vsnprintf(msg, sizeof(msg), format, args);
-
   va_end(args);
 
   if (n < 0) {
@@ -756,25 +1511,115 @@ void cdriz_log_func(const char *format, ...) {
     return;
   }
 
+  gil = PyGILState_Ensure();
+
+  if (logging == NULL) {
+    logging = PyImport_ImportModuleNoBlock("logging");
+    if (logging == NULL) goto cdriz_log_func_exit_;
+  }
+
   /* XXX: Provide a way to specify the log level to use */
   string = Py_BuildValue("s", msg);
-  if (string == NULL) return;
+  if (string == NULL) goto cdriz_log_func_exit_;
 
   logger = PyObject_CallMethod(logging, "getLogger", "s",
                                "drizzlepac.cdriz");
   if (logger == NULL) {
       Py_XDECREF(string);
-      return;
+      goto cdriz_log_func_exit_;
   }
 
   PyObject_CallMethod(logger, "info", "O", string);
 
   Py_XDECREF(logger);
   Py_XDECREF(string);
+
+ cdriz_log_func_exit_:
+  PyGILState_Release(gil);
   return;
 }
 
 
+static PyObject *
+normalize(PyObject *obj, PyObject *args)
+{
+  /* Arguments in the order they appear */
+  PyObject *oout, *owht;
+  char *fillstr = NULL;
+
+  /* Derived values */
+  PyArrayObject *out = NULL, *wht = NULL;
+  bool_t do_fill;
+  float fill_value;
+  struct driz_error_t error;
+  struct driz_param_t p;
+
+  driz_error_init(&error);
+
+  if (!PyArg_ParseTuple(args,"OO|s:normalize", &oout, &owht, &fillstr)){
+    return PyErr_Format(gl_Error, "cdriz.normalize: Invalid Parameters.");
+  }
+
+  if (fill_str2value(fillstr, &do_fill, &fill_value, &error)) {
+    goto _exit;
+  }
+
+  driz_param_init(&p);
+  p.xmin = p.ymin = 1;
+
+  if (PyObject_TypeCheck(oout, &SparseOutputType)) {
+    p.output_tiles = &((PySparseOutput *)oout)->tiles;
+    if (p.output_tiles->tiles == NULL || owht != Py_None) {
+      driz_error_set_message(&error,
+                             "A sparse output needs outweight None");
+      goto _exit;
+    }
+    p.output_tiles->failed = FALSE;
+    p.onx = p.xmax = p.output_tiles->onx;
+    p.ony = p.ymax = p.output_tiles->ony;
+  } else {
+    out = (PyArrayObject *)PyArray_ContiguousFromAny(oout, NPY_FLOAT32, 2, 2);
+    if (!out) {
+      driz_error_set_message(&error, "Invalid output array");
+      goto _exit;
+    }
+
+    wht = (PyArrayObject *)PyArray_ContiguousFromAny(owht, NPY_FLOAT32, 2, 2);
+    if (!wht) {
+      driz_error_set_message(&error, "Invalid array");
+      goto _exit;
+    }
+
+    if (PyArray_DIMS(out)[0] != PyArray_DIMS(wht)[0] ||
+        PyArray_DIMS(out)[1] != PyArray_DIMS(wht)[1]) {
+      driz_error_set_message(&error,
+                             "Output and weight arrays differ in shape");
+      goto _exit;
+    }
+
+    p.output_data = PyArray_DATA(out);
+    p.output_counts = PyArray_DATA(wht);
+    p.onx = p.xmax = PyArray_DIMS(out)[1];
+    p.ony = p.ymax = PyArray_DIMS(out)[0];
+  }
+
+  normalize_output(&p, do_fill, fill_value);
+  if (p.output_tiles && p.output_tiles->failed) {
+    driz_error_set_message(&error, "Could not allocate or map an output tile");
+  }
+
+ _exit:
+  Py_XDECREF(out);
+  Py_XDECREF(wht);
+
+  if (driz_error_is_set(&error)) {
+    PyErr_SetString(PyExc_Exception, driz_error_get_message(&error));
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
 static PyObject *
 arrmoments(PyObject *obj, PyObject *args)
 {
@@ -1164,9 +2009,10 @@ arrxyzero(PyObject *obj, PyObject *args)
 
 static PyMethodDef cdriz_methods[] =
   {
-    {"tdriz",  tdriz, METH_VARARGS, "tdriz(image, weight, output, outweight, context, uniqid, ystart, xmin, ymin, dny, scale, xscale, yscale, align, pfrace, kernel, inun, expin, wtscl, fill, nmiss, nskip, vflag, callback)"},
+    {"tdriz",  (PyCFunction)tdriz, METH_VARARGS|METH_KEYWORDS, "tdriz(image, weight, output, outweight, context, uniqid, ystart, xmin, ymin, dny, scale, xscale, yscale, align, pfract, kernel, inun, expin, wtscl, fill, nmiss, nskip, vflag, callback, stats=False, batch=False, bscale=1.0, bzero=0.0, dq=None, bits=0, errors=False, sum=False, remove=False, xmax=0, ymax=0, threads=1, parallel='bands')\n\nimage: the first dny rows of image, weight and dq are rows ystart + 1 to ystart + dny of the input, so that it can be drizzled a strip at a time; with a DefaultWCSMapping, other threads run while it is drizzled.\nxmin, xmax, ymin, ymax: drizzle onto only columns xmin to xmax and rows ymin to ymax of the output, counting from 1; xmax and ymax of 0 are the last column and row.  Windows of the output that do not overlap may be drizzled onto at once from different threads, each with a mapping of its own, and the result is that of drizzling onto the whole output.\nthreads: drizzle with this many threads, sharing out bands of output rows, when the callback is a DefaultWCSMapping that is affine or interpolated in its table (one thread otherwise); the output is the same, but nmiss and nskip leave out the pixels found to miss at the edges of the window, and the time in WCSLIB is not recorded.\nparallel: 'bands', or 'gather' to have each output pixel gather the input that lands on it with the point and turbo kernels, which needs no bands and gives the same output, nmiss included, with any number of threads; or 'atomic' to have the threads share out the input rows and add what they drizzle to the output as they go, the same output to rounding, with exact nmiss and nskip, which suits an input small beside the output.\nimage, weight: C-contiguous float32, int16 or uint16 arrays in either byte order, such as FITS data, are read where they lie; anything else is converted to float32.\nweight: may be None, to weigh every pixel by wtscl.\ndq, bits: weigh pixels with data quality flags other than bits as 0.\nerrors: the weights are errors, and weigh as their inverse squares.\noutput: may be a SparseOutput, with outweight and context None.\nsum: output holds the sum of the weighted data rather than its weighted mean, on entry and on return, to be turned into the mean with normalize(); fill is left to normalize().\nremove: take back an image drizzled onto the output with sum=True, given the same arguments, and clear its bit of the context; pixels only it covered are left with the rounding error of the sums, which DrizzleState.remove() clears.\nstats: also return a dict of the time spent mapping and in the kernel, context updates included, and of the pixels hit, missed and skipped.\nbatch: call a Python callback once with the coordinates of every input pixel (four times as many for the square kernel) instead of row by row.\nbscale, bzero: the image holds (value - bzero) / bscale, as in FITS."},
     /*{"twdriz",  tdriz, METH_VARARGS, "triz(image, weight, output, outweight, ystart, xmin, ymin, dny, wcsin, wcsout,pxg,pyg,pfract, kernel, coeffs, fillstr,nmiss,nskip,vflag)"},*/
-    {"tblot",  tblot, METH_VARARGS, "tblot(image, output, xmin, xmax, ymin, ymax, scale, kscale, xscale, yscale, align, interp, ef, misval, sinscl, vflag, callback)"},
+    {"tblot",  (PyCFunction)tblot, METH_VARARGS|METH_KEYWORDS, "tblot(image, output, xmin, xmax, ymin, ymax, scale, kscale, xscale, yscale, align, interp, ef, misval, sinscl, vflag, callback, tile=0, block=0, stats=False, batch=False, bscale=1.0, bzero=0.0, threads=1)\n\nimage: a C-contiguous float32, int16 or uint16 array in either byte order, such as FITS data, is read where it lies, except by the sinc interpolations; anything else is converted to float32.\n\ntile: blot the output in square tiles of this size, visited in an order that follows the source (0 blots row by row).\nthreads: blot with this many threads, sharing out the bands of rows or the tiles, when the callback is a DefaultWCSMapping that is affine or interpolated in its table (one thread otherwise).\nblock: re-lay the source out in square blocks of this many pixels on a side (a power of two, 0 keeps the rows).\nstats: also return a dict of the time spent mapping and interpolating, and of the pixels hit and missed, after the status.\nbatch: call a Python callback once with the coordinates of every output pixel instead of row by row.\nbscale, bzero: the image holds (value - bzero) / bscale, as in FITS."},
+    {"normalize", normalize, METH_VARARGS, "normalize(output, outweight, fill='INDEF')\n\nTurn output drizzled onto with sum=True from the sum of the weighted data into its weighted mean, in place, and put in the fill value where outweight is 0.  output may be a SparseOutput, with outweight None.  Returns None."},
     {"arrmoments", arrmoments, METH_VARARGS, "arrmoments(image, p, q)"},
     {"arrxyround", arrxyround, METH_VARARGS, "arrxyround(data,x0,y0,skymode,ker2d,xsigsq,ysigsq,datamin,datamax)"},
     {"arrxyzero", arrxyzero, METH_VARARGS, "arrxyzero(imgxy,refxy,searchrad,zpmat)"},
@@ -1190,7 +2036,8 @@ PyObject *PyInit_cdriz(void)
   PyObject* m;
   driz_log_func = &cdriz_log_func;
 
-  if (PyType_Ready(&WCSMapType) < 0) {
+  if (PyType_Ready(&WCSMapType) < 0 ||
+      PyType_Ready(&SparseOutputType) < 0) {
     return NULL;
   }
   m = PyModule_Create(&moduledef);
@@ -1203,6 +2050,8 @@ PyObject *PyInit_cdriz(void)
 
   Py_INCREF(&WCSMapType);
   PyModule_AddObject(m, "DefaultWCSMapping", (PyObject *)&WCSMapType);
+  Py_INCREF(&SparseOutputType);
+  PyModule_AddObject(m, "SparseOutput", (PyObject *)&SparseOutputType);
 
   return m;
 }
@@ -0,0 +1,204 @@
+/*
+Benchmark of blot access order on a large source.
+
+Blots a synthetic source onto an output grid that is rotated with
+respect to it, so that a row of the output walks the source diagonally
+and touches a different memory page for nearly every pixel.  Each run
+reports the wall time and, on Linux, the number of data-TLB load
+misses (page walks) counted by the kernel for the blot alone:
+
+    ./blotbench [source_size [output_size [rotation_deg [interp]]]]
+
+Runs compare row order against tiled output (doblot's blot_tile) and
+against a blocked source (blot_block_shift).
+*/
+
+#include "driz_portability.h"
+#include "cdrizzleblot.h"
+#include "cdrizzlemap.h"
+#include "cdrizzleutil.h"
+
+#define _USE_MATH_DEFINES       /* needed for MS Windows to define M_PI */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/** A rotation and scale about the centers of the two images */
+struct affine_t {
+  double a, b, c, d;
+  double xc, yc, sxc, syc;
+};
+
+static int
+affine_mapping(void* state,
+               const double xd UNUSED_PARAM, const double yd UNUSED_PARAM,
+               const integer_t n,
+               double* xin, double* yin,
+               /* Output parameters */
+               double* xout, double* yout,
+               struct driz_error_t* error UNUSED_PARAM) {
+  const struct affine_t* m = (const struct affine_t*)state;
+  integer_t i;
+
+  for (i = 0; i < n; ++i) {
+    xout[i] = m->a * (xin[i] - m->xc) + m->b * (yin[i] - m->yc) + m->sxc;
+    yout[i] = m->c * (xin[i] - m->xc) + m->d * (yin[i] - m->yc) + m->syc;
+  }
+
+  return 0;
+}
+
+static double
+wall_time(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/** Open a counter of data-TLB read misses, or return -1 */
+static int
+open_dtlb_counter(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void
+start_counter(int fd) {
+#ifdef __linux__
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static long long
+stop_counter(int fd) {
+#ifdef __linux__
+  long long count;
+
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+      return count;
+    }
+  }
+#endif
+  return -1;
+}
+
+int
+main(int argc, char** argv) {
+  const integer_t tiles[] = {0, 64, 0, 64};
+  const integer_t shifts[] = {0, 0, 5, 5};
+  integer_t nx = argc > 1 ? atoi(argv[1]) : 6144;
+  integer_t onx = argc > 2 ? atoi(argv[2]) : 4096;
+  double rotation = argc > 3 ? atof(argv[3]) : 30.0;
+  const char* interp = argc > 4 ? argv[4] : "poly5";
+  struct affine_t m;
+  struct driz_param_t p;
+  struct driz_error_t error;
+  enum e_interp_t interpolation;
+  float* data = NULL;
+  float* output = NULL;
+  double start, elapsed;
+  long long misses;
+  integer_t i, run;
+  int fd;
+  int status = 1;
+
+  driz_error_init(&error);
+  if (interp_str2enum(interp, &interpolation, &error)) {
+    fprintf(stderr, "%s\n", driz_error_get_message(&error));
+    return 1;
+  }
+
+  data = malloc((size_t)nx * (size_t)nx * sizeof(float));
+  output = malloc((size_t)onx * (size_t)onx * sizeof(float));
+  if (data == NULL || output == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    goto exit;
+  }
+  for (i = 0; i < nx * nx; ++i) {
+    data[i] = (float)((i * 2654435761u) >> 16) / 65536.0f;
+  }
+
+  m.a = m.d = cos(rotation * M_PI / 180.0);
+  m.c = sin(rotation * M_PI / 180.0);
+  m.b = -m.c;
+  m.xc = m.yc = 0.5 * (double)(onx + 1);
+  m.sxc = m.syc = 0.5 * (double)(nx + 1);
+
+  fd = open_dtlb_counter();
+
+  printf("# source %dx%d, output %dx%d, rotation %.1f deg, interp %s\n",
+         nx, nx, onx, onx, rotation, interp);
+  printf("# %6s %6s %10s %14s\n", "tile", "block", "seconds", "dtlb_misses");
+
+  for (run = 0; run < (integer_t)(sizeof(tiles) / sizeof(tiles[0])); ++run) {
+    driz_param_init(&p);
+    p.data = data;
+    p.dnx = p.dny = nx;
+    p.output_data = output;
+    p.onx = p.ony = onx;
+    p.xmin = p.ymin = 1;
+    p.xmax = p.ymax = nx;
+    p.kscale = 1.0;
+    p.interpolation = interpolation;
+    p.ef = 1.0;
+    p.misval = 0.0;
+    p.blot_tile = tiles[run];
+    p.blot_block_shift = shifts[run];
+    p.mapping_callback = &affine_mapping;
+    p.mapping_callback_state = &m;
+
+    start_counter(fd);
+    start = wall_time();
+    if (doblot(&p, &error)) {
+      fprintf(stderr, "%s\n", driz_error_get_message(&error));
+      goto exit;
+    }
+    elapsed = wall_time() - start;
+    misses = stop_counter(fd);
+
+    printf("  %6d %6d %10.3f %14lld\n", tiles[run],
+           shifts[run] ? 1 << shifts[run] : 0, elapsed, misses);
+  }
+
+  status = 0;
+
+ exit:
+  free(data);
+  free(output);
+
+  return status;
+}
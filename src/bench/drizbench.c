@@ -0,0 +1,735 @@
+/*
+Benchmark of the drizzle kernels and blot interpolants.
+
+Drizzles a synthetic image and weight map through every kernel, and
+blots the result back through every interpolant, using the pixel-based
+DefaultMapping with a cubic distortion polynomial, a rotation and a
+change of scale, so that no Python or WCS is involved:
+
+    ./drizbench [-r repeats] [-d interval] [-g step] [-s] [-t threads]
+                [-p mode[,mode...]] [size ...]
+    ./drizbench -c
+
+Each case is run over a matrix of square input sizes (256 and 1024 by
+default), pixfrac and scale values, and the fastest of the repeats is
+reported.  With -d, the polynomial is evaluated along rows by forward
+differencing, re-anchored every interval points (see
+default_mapping_row()), and with -g the distortion is looked up in a
+merged displacement grid with nodes every step pixels, shared by the
+drizzle and blot runs of each size and scale.  With -s, the output
+holds the sum of the weighted data while drizzling, and is normalized
+in one pass afterwards (timed with the drizzle).  With -t, drizzle
+and blot with that many threads (see driz_parallel_for()), when the
+map and kernel seconds are summed over the threads.  With -p, each
+drizzle is run with the threads sharing it out in each of the modes
+given: bands, gather and atomic (see e_parallel_t; gather applies to
+the point and turbo kernels only), or tiles, in which the bench itself
+hands each thread whole tiles of the output, BENCH_TILE pixels on a
+side, to drizzle onto as windows, as adrizzle.do_driz_tiled() does.
+Results go to stdout as CSV, one line per case:
+
+    op,method,parallel,size,pixfrac,scale,seconds,mpix_per_s,
+    map_seconds,kernel_seconds,nmiss
+
+where mpix_per_s counts input pixels for drizzle and output pixels for
+blot, map_seconds and kernel_seconds split the time as recorded by
+driz_stats_t, and pixfrac and parallel are empty for blot, as is
+nmiss for tiles.  Cases that the core
+rejects, such as unimplemented interpolants, have empty timings.
+
+With -c, nothing is timed: the mapping is instead checked against the
+linear and secondary transformations as the original applied them
+point by point (see check_mapping()), and the exit status is 1 if they
+differ.
+*/
+
+#include "driz_portability.h"
+#include "cdrizzleblot.h"
+#include "cdrizzlebox.h"
+#include "cdrizzlemap.h"
+#include "cdrizzlesched.h"
+#include "cdrizzleutil.h"
+
+#define _USE_MATH_DEFINES       /* needed for MS Windows to define M_PI */
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIZES 16
+#define MAX_MODES 8
+
+/* The output tiles of -p tiles, and the mode that stands for it */
+#define BENCH_TILE 512
+#define BENCH_TILES ((integer_t)parallel_LAST)
+
+static const double pixfracs[] = {0.5, 1.0};
+static const double scales[] = {0.5, 1.0, 2.0};
+
+/** The images of one case: input and weights, and the drizzled output */
+struct bench_images_t {
+  integer_t nx;
+  integer_t onx;
+  float* data;
+  float* weights;
+  float* output;
+  float* counts;
+  integer_t* context;
+  float* blotted;
+};
+
+/** Fill in a DefaultMapping from a nx x nx input to a onx x onx output */
+static void
+init_mapping(struct mapping_param_t* m, const integer_t nx,
+             const integer_t onx, const double scale) {
+  const double h = 0.5 * (double)nx;
+
+  memset(m, 0, sizeof(struct mapping_param_t));
+
+  /* A cubic distortion of about a pixel at the corners */
+  m->coeff_type = 3;
+  m->num_coeffs = 10;
+  m->x_coeffs[1] = 1.0;
+  m->x_coeffs[3] = 0.5 / h;
+  m->x_coeffs[5] = -0.3 / h;
+  m->x_coeffs[6] = 0.2 / (h * h);
+  m->y_coeffs[2] = 1.0;
+  m->y_coeffs[4] = 0.4 / h;
+  m->y_coeffs[9] = -0.2 / (h * h);
+
+  m->scale = scale;
+  m->rotation = 10.0 * M_PI / 180.0;
+  m->do_shift_first = shift_output;
+  m->shift_units = shift_output;
+  m->align = align_center;
+  m->x_scale = 1.0;
+  m->y_scale = 1.0;
+  m->xcen = h + 1.0;
+  m->ycen = h + 1.0;
+  m->xp = 0.5 * (double)onx;
+  m->yp = 0.5 * (double)onx;
+  m->dnx = nx;
+  m->dny = nx;
+}
+
+/** Keep the core's log messages out of the CSV on stdout */
+static void
+log_to_stderr(const char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+static void
+free_images(struct bench_images_t* im) {
+  free(im->data);
+  free(im->weights);
+  free(im->output);
+  free(im->counts);
+  free(im->context);
+  free(im->blotted);
+  memset(im, 0, sizeof(struct bench_images_t));
+}
+
+static int
+alloc_images(struct bench_images_t* im, const integer_t nx,
+             const integer_t onx) {
+  const size_t n = (size_t)nx * (size_t)nx;
+  const size_t on = (size_t)onx * (size_t)onx;
+  size_t i;
+
+  memset(im, 0, sizeof(struct bench_images_t));
+  im->nx = nx;
+  im->onx = onx;
+  im->data = malloc(n * sizeof(float));
+  im->weights = malloc(n * sizeof(float));
+  im->output = malloc(on * sizeof(float));
+  im->counts = malloc(on * sizeof(float));
+  im->context = malloc(on * sizeof(integer_t));
+  im->blotted = malloc(n * sizeof(float));
+  if (im->data == NULL || im->weights == NULL || im->output == NULL ||
+      im->counts == NULL || im->context == NULL || im->blotted == NULL) {
+    free_images(im);
+    return 1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    im->data[i] = 1.0f + (float)((i * 2654435761u) >> 16) / 65536.0f;
+    im->weights[i] = (i % 97 == 0) ? 0.0f : 1.0f;
+  }
+
+  return 0;
+}
+
+static void
+print_result(const char* op, const char* method, const char* parallel,
+             const integer_t size, const double pixfrac, const double scale,
+             const double seconds, const double npix,
+             const struct driz_stats_t* stats) {
+  printf("%s,%s,%s,%d,", op, method, parallel, size);
+  if (pixfrac > 0.0) {
+    printf("%g", pixfrac);
+  }
+  printf(",%g,", scale);
+  if (stats == NULL) {
+    printf(",,,,\n");
+  } else {
+    printf("%.6f,%.3f,%.6f,%.6f,", seconds, 1e-6 * npix / seconds,
+           stats->map_time, stats->kernel_time);
+    if (stats->nmiss >= 0) {
+      printf("%d", stats->nmiss);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+/** The output drizzled a tile at a time by the threads of -p tiles */
+struct bench_tiles_t {
+  const struct driz_param_t* p;
+  integer_t ntx;
+  /* A copy of p for each thread, and where it records its time */
+  struct driz_param_t* params;
+  struct driz_stats_t* stats;
+};
+
+/** Drizzle onto tiles begin to end - 1, each as a window of the output */
+static int
+bench_tiles(void* state, const integer_t worker,
+            const integer_t begin, const integer_t end,
+            /* Output parameters */
+            struct driz_error_t* error) {
+  struct bench_tiles_t* b = (struct bench_tiles_t*)state;
+  const struct driz_param_t* p = b->p;
+  struct driz_param_t* q = &b->params[worker];
+  integer_t t, nmiss, nskip;
+  size_t offset;
+
+  for (t = begin; t < end; ++t) {
+    q->xmin = p->xmin + (t % b->ntx) * BENCH_TILE;
+    q->ymin = p->ymin + (t / b->ntx) * BENCH_TILE;
+    q->xmax = MIN(p->xmax, q->xmin + BENCH_TILE - 1);
+    q->ymax = MIN(p->ymax, q->ymin + BENCH_TILE - 1);
+    offset = (size_t)(q->ymin - p->ymin) * (size_t)p->onx +
+      (size_t)(q->xmin - p->xmin);
+    q->output_data = p->output_data + offset;
+    q->output_counts = p->output_counts + offset;
+    q->output_context = p->output_context + offset;
+    q->no_over = FALSE;
+    nmiss = nskip = 0;
+    if (dobox(q, 0, &nmiss, &nskip, error)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+Drizzle with the threads each taking whole tiles of the output, and
+sum their times
+*/
+static int
+drizzle_tiles(struct driz_param_t* p, const integer_t nthreads,
+              /* Output parameters */
+              struct driz_error_t* error) {
+  struct bench_tiles_t b;
+  const integer_t nty = (p->ymax - p->ymin) / BENCH_TILE + 1;
+  integer_t k;
+  int status = 1;
+
+  b.p = p;
+  b.ntx = (p->xmax - p->xmin) / BENCH_TILE + 1;
+  b.params = (struct driz_param_t*)malloc((size_t)nthreads *
+                                          sizeof(struct driz_param_t));
+  b.stats = (struct driz_stats_t*)malloc((size_t)nthreads *
+                                         sizeof(struct driz_stats_t));
+  if (b.params == NULL || b.stats == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto exit;
+  }
+  for (k = 0; k < nthreads; ++k) {
+    b.params[k] = *p;
+    b.params[k].nthreads = 1;
+    driz_stats_init(&b.stats[k]);
+    b.params[k].stats = &b.stats[k];
+  }
+
+  if (driz_parallel_for(nthreads, b.ntx * nty, 1, &bench_tiles, &b, error)) {
+    goto exit;
+  }
+  for (k = 0; k < nthreads; ++k) {
+    driz_stats_add_times(p->stats, &b.stats[k]);
+  }
+  p->stats->nmiss = -1;
+  status = 0;
+
+ exit:
+  free(b.params);
+  free(b.stats);
+
+  return status;
+}
+
+/**
+Drizzle the input of \a im onto its output with \a kernel, the
+threads sharing it out in \a mode, an e_parallel_t or BENCH_TILES
+*/
+static int
+bench_drizzle(struct bench_images_t* im, struct mapping_param_t* m,
+              const enum e_kernel_t kernel, const double pixfrac,
+              const double scale, const bool_t sum, const integer_t repeats,
+              const integer_t nthreads, const integer_t mode,
+              /* Output parameters */
+              double* seconds, struct driz_stats_t* best,
+              struct driz_error_t* error) {
+  const size_t on = (size_t)im->onx * (size_t)im->onx;
+  struct driz_param_t p;
+  struct driz_stats_t stats;
+  integer_t nmiss, nskip, rep;
+  double start, elapsed;
+
+  *seconds = MAX_DOUBLE;
+  for (rep = 0; rep < repeats; ++rep) {
+    memset(im->output, 0, on * sizeof(float));
+    memset(im->counts, 0, on * sizeof(float));
+    memset(im->context, 0, on * sizeof(integer_t));
+
+    driz_param_init(&p);
+    driz_stats_init(&stats);
+    p.data = im->data;
+    p.weights = im->weights;
+    p.output_data = im->output;
+    p.output_counts = im->counts;
+    p.output_sum = sum;
+    p.output_context = im->context;
+    p.uuid = 1;
+    p.xmin = p.ymin = 1;
+    p.dnx = p.dny = p.ny = im->nx;
+    p.onx = p.xmax = im->onx;
+    p.ony = p.ymax = im->onx;
+    p.scale = scale;
+    p.align = align_center;
+    p.pixel_fraction = pixfrac;
+    p.kernel = kernel;
+    p.in_units = unit_cps;
+    p.no_over = FALSE;
+    p.mapping_callback = &default_mapping;
+    p.mapping_callback_state = m;
+    p.nthreads = nthreads;
+    p.parallel = mode == BENCH_TILES ? parallel_bands : (enum e_parallel_t)mode;
+    p.stats = &stats;
+
+    nmiss = nskip = 0;
+    start = driz_timer();
+    if (mode == BENCH_TILES ? drizzle_tiles(&p, nthreads, error) :
+        dobox(&p, 0, &nmiss, &nskip, error)) {
+      return 1;
+    }
+    if (sum) {
+      normalize_output(&p, FALSE, 0.0f);
+    }
+    elapsed = driz_timer() - start;
+
+    if (elapsed < *seconds) {
+      *seconds = elapsed;
+      *best = stats;
+    }
+  }
+
+  return 0;
+}
+
+/** Blot the output of \a im back onto the input grid with \a interp */
+static int
+bench_blot(struct bench_images_t* im, struct mapping_param_t* m,
+           const enum e_interp_t interp, const double scale,
+           const integer_t repeats, const integer_t nthreads,
+           /* Output parameters */
+           double* seconds, struct driz_stats_t* best,
+           struct driz_error_t* error) {
+  struct driz_param_t p;
+  struct driz_stats_t stats;
+  integer_t rep;
+  double start, elapsed;
+
+  *seconds = MAX_DOUBLE;
+  for (rep = 0; rep < repeats; ++rep) {
+    driz_param_init(&p);
+    driz_stats_init(&stats);
+    p.data = im->output;
+    p.dnx = p.dny = im->onx;
+    p.output_data = im->blotted;
+    p.onx = p.ony = im->nx;
+    p.xmin = p.ymin = 1;
+    p.xmax = p.ymax = im->onx;
+    p.scale = scale;
+    p.kscale = 1.0;
+    p.align = align_center;
+    p.interpolation = interp;
+    p.ef = 1.0;
+    p.misval = 0.0;
+    p.sinscl = 1.0;
+    p.mapping_callback = &default_mapping;
+    p.mapping_callback_state = m;
+    p.nthreads = nthreads;
+    p.stats = &stats;
+
+    start = driz_timer();
+    if (doblot(&p, error)) {
+      return 1;
+    }
+    elapsed = driz_timer() - start;
+
+    if (elapsed < *seconds) {
+      *seconds = elapsed;
+      *best = stats;
+    }
+  }
+
+  return 0;
+}
+
+/** The name of an e_parallel_t or BENCH_TILES */
+static const char*
+mode_name(const integer_t mode) {
+  return mode == BENCH_TILES ? "tiles" :
+    parallel_enum2str((enum e_parallel_t)mode);
+}
+
+/** Read the comma-separated modes of -p into \a modes */
+static int
+parse_modes(const char* s,
+            /* Output parameters */
+            integer_t* modes, integer_t* nmodes, struct driz_error_t* error) {
+  char name[32];
+  enum e_parallel_t parallel;
+  size_t n;
+
+  *nmodes = 0;
+  while (*s != '\0') {
+    n = strcspn(s, ",");
+    if (n >= sizeof(name) || *nmodes >= MAX_MODES) {
+      driz_error_set_message(error, "Invalid parallel modes");
+      return 1;
+    }
+    memcpy(name, s, n);
+    name[n] = '\0';
+    if (strcmp(name, "tiles") == 0) {
+      modes[(*nmodes)++] = BENCH_TILES;
+    } else if (parallel_str2enum(name, &parallel, error)) {
+      return 1;
+    } else {
+      modes[(*nmodes)++] = (integer_t)parallel;
+    }
+    s += n;
+    if (*s == ',') {
+      ++s;
+    }
+  }
+
+  return 0;
+}
+
+/* Points of the -c check, on a side */
+#define CHECK_SIZE 64
+
+/**
+The linear and secondary transformations of the point (x, y) as the
+original per-stage mapping applied them, in place when there are no
+secondary parameters.
+*/
+static void
+reference_linear(const struct mapping_param_t* m, const double x,
+                 const double y,
+                 /* Output parameters */
+                 double* xout, double* yout) {
+  const double xf = 1.0 / m->scale;
+  const double xs = xf * sin(m->rotation);
+  const double xc = xf * cos(m->rotation);
+  const double ys = xs;
+  const double yc = xc;
+  const double xt = m->x_shift / m->scale + m->xp;
+  const double yt = m->y_shift / m->scale + m->yp;
+  const double xs2 = sin(m->rotation2);
+  const double xc2 = cos(m->rotation2);
+  double xtmp, ytmp;
+
+  if (m->has_secondary_parameters) {
+    if (m->do_shift_first == shift_input) {
+      xtmp = xc * (x + 1.0) - ys * (y + 1.0) + xt - m->xp;
+      ytmp = xs * (x + 1.0) + yc * (y + 1.0) + yt - m->yp;
+    } else {
+      xtmp = xc * (x + 1.0 + m->x_shift) - ys * (y + 1.0 + m->y_shift);
+      ytmp = xs * (x + 1.0 + m->x_shift) + yc * (y + 1.0 + m->y_shift);
+    }
+
+    if (m->do_shift2_first == shift_output) {
+      *xout = xc2 * xtmp - xs2 * ytmp + m->xp + m->x_shift2 - 1.0;
+      *yout = xs2 * xtmp + xc2 * ytmp + m->yp + m->y_shift2 - 1.0;
+    } else {
+      *xout = xc2 * (xtmp + m->x_shift2) - xs2 * (ytmp + m->y_shift2) +
+        m->xp - 1.0;
+      *yout = xs2 * (xtmp + m->x_shift2) + xc2 * (ytmp + m->y_shift2) +
+        m->yp - 1.0;
+    }
+  } else {
+    *xout = x;
+    *yout = y;
+    if (m->do_shift_first == shift_output) {
+      *xout = xc * (*xout + 1.0) - ys * (*yout + 1.0) + xt - 1.0;
+      *yout = xs * (*xout + 1.0) + yc * (*yout + 1.0) + yt - 1.0;
+    } else {
+      *xout = xc * (*xout + 1.0 + m->x_shift) -
+        ys * (*yout + 1.0 + m->y_shift) + m->xp - 1.0;
+      *yout = xs * (*xout + 1.0 + m->x_shift) +
+        yc * (*yout + 1.0 + m->y_shift) + m->yp - 1.0;
+    }
+  }
+}
+
+/**
+Check default_mapping(), point by point and a row at a time, against
+reference_linear() of the distortion polynomial alone, with and
+without secondary parameters and for both orders of the shifts.
+Prints the largest difference of each case, and returns 1 if any is
+above 1e-9 pixels.
+*/
+static int
+check_mapping(struct driz_error_t* error) {
+  struct mapping_param_t m, m0;
+  double x, y, px, py, xref, yref, xo, yo;
+  double xrow[CHECK_SIZE], yrow[CHECK_SIZE];
+  double diff, maxdiff;
+  integer_t secondary, order, i, j;
+  int status = 1;
+
+  memset(&m, 0, sizeof(m));
+  memset(&m0, 0, sizeof(m0));
+
+  /* The distortion polynomial alone, with an identity linear
+     transformation */
+  init_mapping(&m0, CHECK_SIZE, CHECK_SIZE, 1.0);
+  m0.rotation = 0.0;
+  m0.xp = m0.yp = 0.0;
+
+  printf("check,secondary,shift_first,max_difference\n");
+
+  for (secondary = 0; secondary < 2; ++secondary) {
+    for (order = 0; order < 2; ++order) {
+      init_mapping(&m, CHECK_SIZE, CHECK_SIZE, 1.3);
+      m.x_shift = 3.2;
+      m.y_shift = -1.7;
+      m.do_shift_first = order ? shift_input : shift_output;
+      if (secondary) {
+        m.has_secondary_parameters = TRUE;
+        m.rotation2 = -4.0 * M_PI / 180.0;
+        m.x_shift2 = 0.6;
+        m.y_shift2 = -2.1;
+        m.do_shift2_first = order ? shift_output : shift_input;
+      }
+
+      maxdiff = 0.0;
+      for (j = 0; j < CHECK_SIZE; ++j) {
+        if (default_mapping_row(&m, 0.0, 0.0, CHECK_SIZE, 1.0, 1.0,
+                                (double)(j + 1), xrow, yrow, error))
+          goto exit;
+
+        for (i = 0; i < CHECK_SIZE; ++i) {
+          x = (double)(i + 1);
+          y = (double)(j + 1);
+          if (default_mapping(&m0, 0.0, 0.0, 1, &x, &y, &px, &py, error))
+            goto exit;
+          reference_linear(&m, px, py, &xref, &yref);
+
+          x = (double)(i + 1);
+          y = (double)(j + 1);
+          if (default_mapping(&m, 0.0, 0.0, 1, &x, &y, &xo, &yo, error))
+            goto exit;
+
+          diff = fabs(xo - xref) + fabs(yo - yref) +
+            fabs(xrow[i] - xref) + fabs(yrow[i] - yref);
+          if (diff > maxdiff)
+            maxdiff = diff;
+        }
+      }
+
+      printf("mapping,%s,%s,%.3g\n", secondary ? "yes" : "no",
+             order ? "input" : "output", maxdiff);
+      mapping_param_free(&m);
+      if (maxdiff > 1e-9) {
+        driz_error_set_message(error, "default_mapping differs from the "
+                               "reference");
+        goto exit;
+      }
+    }
+  }
+
+  status = 0;
+
+ exit:
+  mapping_param_free(&m);
+  mapping_param_free(&m0);
+
+  return status;
+}
+
+int
+main(int argc, char** argv) {
+  integer_t sizes[MAX_SIZES] = {256, 1024};
+  integer_t nsizes = 2;
+  integer_t repeats = 3;
+  integer_t nthreads = 1;
+  integer_t modes[MAX_MODES] = {parallel_bands};
+  integer_t nmodes = 1;
+  integer_t interval = 0;
+  double grid_step = 0.0;
+  bool_t got_sizes = FALSE;
+  bool_t sum = FALSE;
+  bool_t check = FALSE;
+  struct bench_images_t im;
+  struct mapping_param_t m;
+  struct driz_stats_t stats;
+  struct driz_error_t error;
+  double seconds;
+  integer_t i, is, ip, ic, k, imode, onx;
+  int status = 1;
+
+  memset(&im, 0, sizeof(im));
+  memset(&m, 0, sizeof(m));
+  driz_log_func = &log_to_stderr;
+  driz_error_init(&error);
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeats = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      grid_step = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      sum = TRUE;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      check = TRUE;
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      if (parse_modes(argv[++i], modes, &nmodes, &error)) {
+        fprintf(stderr, "%s\n", driz_error_get_message(&error));
+        return 1;
+      }
+    } else {
+      /* Sizes given on the command line replace the defaults */
+      if (!got_sizes) {
+        nsizes = 0;
+        got_sizes = TRUE;
+      }
+      if (nsizes >= MAX_SIZES) {
+        fprintf(stderr, "Too many sizes (at most %d)\n", MAX_SIZES);
+        return 1;
+      }
+      sizes[nsizes++] = atoi(argv[i]);
+    }
+  }
+
+  if (check) {
+    if (check_mapping(&error)) {
+      fprintf(stderr, "%s\n", driz_error_get_message(&error));
+      return 1;
+    }
+    return 0;
+  }
+
+  if (repeats < 1) {
+    fprintf(stderr, "Invalid number of repeats %d\n", repeats);
+    return 1;
+  }
+  if (nthreads < 1) {
+    fprintf(stderr, "Invalid number of threads %d\n", nthreads);
+    return 1;
+  }
+  for (is = 0; is < nsizes; ++is) {
+    if (sizes[is] < 16) {
+      fprintf(stderr, "Invalid size %d (must be at least 16)\n", sizes[is]);
+      return 1;
+    }
+  }
+
+  printf("op,method,parallel,size,pixfrac,scale,seconds,mpix_per_s,"
+         "map_seconds,kernel_seconds,nmiss\n");
+
+  for (is = 0; is < nsizes; ++is) {
+    for (ic = 0; ic < (integer_t)(sizeof(scales) / sizeof(scales[0])); ++ic) {
+      /* Room for the rotated and rescaled input */
+      onx = (integer_t)(1.25 * (double)sizes[is] / scales[ic]) + 1;
+      if (alloc_images(&im, sizes[is], onx)) {
+        fprintf(stderr, "Out of memory\n");
+        goto exit;
+      }
+      init_mapping(&m, sizes[is], onx, scales[ic]);
+      m.difference_interval = interval;
+      m.grid_step = grid_step;
+
+      for (ip = 0; ip < (integer_t)(sizeof(pixfracs) / sizeof(pixfracs[0])); ++ip) {
+        for (k = 0; k < kernel_LAST; ++k) {
+          for (imode = 0; imode < nmodes; ++imode) {
+            driz_error_init(&error);
+            if (bench_drizzle(&im, &m, (enum e_kernel_t)k, pixfracs[ip],
+                              scales[ic], sum, repeats, nthreads,
+                              modes[imode], &seconds, &stats, &error)) {
+              fprintf(stderr, "drizzle %s: %s\n",
+                      kernel_enum2str((enum e_kernel_t)k),
+                      driz_error_get_message(&error));
+              print_result("drizzle", kernel_enum2str((enum e_kernel_t)k),
+                           mode_name(modes[imode]), sizes[is], pixfracs[ip],
+                           scales[ic], 0.0, 0.0, NULL);
+            } else {
+              print_result("drizzle", kernel_enum2str((enum e_kernel_t)k),
+                           mode_name(modes[imode]), sizes[is], pixfracs[ip],
+                           scales[ic], seconds,
+                           (double)sizes[is] * (double)sizes[is], &stats);
+            }
+          }
+        }
+      }
+
+      /* Blot the last (square kernel, full pixfrac) product back */
+      driz_error_init(&error);
+      if (bench_drizzle(&im, &m, kernel_square, 1.0, scales[ic], sum, 1,
+                        nthreads, modes[0], &seconds, &stats, &error)) {
+        fprintf(stderr, "drizzle square: %s\n", driz_error_get_message(&error));
+        goto exit;
+      }
+
+      for (k = 0; k < interp_LAST; ++k) {
+        driz_error_init(&error);
+        if (bench_blot(&im, &m, (enum e_interp_t)k, scales[ic], repeats,
+                       nthreads, &seconds, &stats, &error)) {
+          fprintf(stderr, "blot %s: %s\n",
+                  interp_enum2str((enum e_interp_t)k),
+                  driz_error_get_message(&error));
+          print_result("blot", interp_enum2str((enum e_interp_t)k), "",
+                       sizes[is], 0.0, scales[ic], 0.0, 0.0, NULL);
+        } else {
+          print_result("blot", interp_enum2str((enum e_interp_t)k), "",
+                       sizes[is], 0.0, scales[ic], seconds,
+                       (double)sizes[is] * (double)sizes[is], &stats);
+        }
+      }
+
+      free_images(&im);
+      mapping_param_free(&m);
+    }
+  }
+
+  status = 0;
+
+ exit:
+  free_images(&im);
+  mapping_param_free(&m);
+
+  return status;
+}
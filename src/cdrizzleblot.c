@@ -1,15 +1,15 @@
-#define NO_IMPORT_ARRAY
-#define NO_IMPORT_ASTROPY_WCS_API
 
 #include "driz_portability.h"
 #include "cdrizzlemap.h"
 #include "cdrizzleblot.h"
+#include "cdrizzlesched.h"
 
 #include <assert.h>
 #define _USE_MATH_DEFINES       /* needed for MS Windows to define M_PI */
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
 Procedure to evaluate the bicubic polynomial interpolant.  The array
@@ -245,26 +245,73 @@ ii_bipoly5(const float* coeff /* [len_coeff][len_coeff] */,
   }
 }
 
+/**
+The image being blotted from.  The pixels are either stored row by row
+(\a block_shift == 0) or in square blocks of (1 << block_shift) pixels
+on a side, themselves stored row by row, so that the footprint of an
+interpolant falls within one or a few memory pages.
+
+Only the window of \a nx by \a ny pixels starting at (\a x1, \a y1)
+of the \a dnx by \a dny source need be held in \a data, but pixels
+are addressed in the coordinates of the whole source.
+
+A source stored other than as native float32 is held in \a raw instead,
+row by row, and converted pixel by pixel as it is read.
+*/
+struct blot_image_t {
+  const float* data;
+  const void* raw;
+  const struct driz_pixel_format_t* format;
+  integer_t dnx;
+  integer_t dny;
+  integer_t x1; /* Origin of the window */
+  integer_t y1;
+  integer_t nx; /* Size of the window */
+  integer_t ny;
+  /* The source coordinates that interpolate from within the window */
+  double sx1, sx2;
+  double sy1, sy2;
+  integer_t block_shift;
+  integer_t nbx; /* Number of blocks along x */
+};
+
 /** Helper function to look up pixels in a 2D array */
 static inline_macro float
-data_value(const float* data, const integer_t dnx, const integer_t dny UNUSED_PARAM,
+data_value(const struct blot_image_t* image,
            const integer_t x, const integer_t y) {
-  assert(data);
-  assert(x >= 0 && x < dnx);
-  assert(y >= 0 && y < dny);
+  const integer_t wx = x - image->x1;
+  const integer_t wy = y - image->y1;
+  integer_t shift;
+
+  assert(image);
+  assert(wx >= 0 && wx < image->nx);
+  assert(wy >= 0 && wy < image->ny);
+
+  if (image->raw != NULL) {
+    return raw_pixel_value(image->format, image->raw,
+                           (size_t)wy*image->nx + wx);
+  }
 
-  return data[y*dnx + x];
+  assert(image->data);
+  shift = image->block_shift;
+  if (shift == 0) {
+    return image->data[(size_t)wy*image->nx + wx];
+  }
+
+  return image->data[(((size_t)(wy >> shift) * image->nbx + (wx >> shift))
+                      << (2 * shift)) +
+                     ((size_t)(wy & ((1 << shift) - 1)) << shift) +
+                     (wx & ((1 << shift) - 1))];
 }
 
-/** Macro to pass pointer and dimensions to the data_value function */
-#define DATA_VALUE(x, y) (data_value(data, dnx, dny, x, y))
+/** Macro to pass the image to the data_value function */
+#define DATA_VALUE(x, y) (data_value(image, x, y))
 
 /**
 Signature for functions that perform blotting interpolation.
  */
 typedef int (interp_function)(const void*,
-                              const float*,
-                              const integer_t, const integer_t,
+                              const struct blot_image_t*,
                               const float, const float,
                               /* Output parameters */
                               float*,
@@ -274,11 +321,11 @@ typedef int (interp_function)(const void*,
 A standard set of asserts for all of the interpolation functions
 */
 #define INTERPOLATION_ASSERTS \
-  assert(data); \
-  assert(dnx > 0); \
-  assert(dny > 0); \
-  assert(x >= 0.0f && x < (float)dnx);      \
-  assert(y >= 0.0f && y < (float)dny);      \
+  assert(image); \
+  assert(image->dnx > 0); \
+  assert(image->dny > 0); \
+  assert(x >= 0.0f && x < (float)image->dnx);      \
+  assert(y >= 0.0f && y < (float)image->dny);      \
   assert(value); \
   assert(error); \
 
@@ -289,11 +336,7 @@ Perform nearest neighbor interpolation.
 interpolation type.  (For \a interpolate_nearest_neighbor, it should be
 NULL).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -307,8 +350,7 @@ NULL).
  */
 static int
 interpolate_nearest_neighbor(const void* state UNUSED_PARAM,
-                             const float* data,
-                             const integer_t dnx, const integer_t dny,
+                             const struct blot_image_t* image,
                              const float x, const float y,
                              /* Output parameters */
                              float* value,
@@ -316,7 +358,10 @@ interpolate_nearest_neighbor(const void* state UNUSED_PARAM,
   assert(state == NULL);
   INTERPOLATION_ASSERTS;
 
-  *value = DATA_VALUE((integer_t)(x + 0.5), (integer_t)(y + 0.5));
+  /* Points in the last half pixel round onto the edge rather than
+     past it */
+  *value = DATA_VALUE(MIN((integer_t)(x + 0.5), image->dnx - 1),
+                      MIN((integer_t)(y + 0.5), image->dny - 1));
   return 0;
 }
 
@@ -327,11 +372,7 @@ Perform basic bilinear interpolation.
 interpolation type.  (For \a interpolate_bilinear, it should be
 NULL).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -345,14 +386,15 @@ NULL).
  */
 static int
 interpolate_bilinear(const void* state UNUSED_PARAM,
-                     const float* data,
-                     const integer_t dnx, const integer_t dny,
+                     const struct blot_image_t* image,
                      const float x, const float y,
                      /* Output parameters */
                      float* value,
                      struct driz_error_t* error UNUSED_PARAM) {
   integer_t nx, ny;
   float sx, tx, sy, ty, f00;
+  const integer_t dnx = image->dnx;
+  const integer_t dny = image->dny;
 
   assert(state == NULL);
   INTERPOLATION_ASSERTS;
@@ -404,11 +446,7 @@ Perform cubic polynomial interpolation.
 interpolation type.  (For \a interpolate_poly3, it should be
 NULL).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -422,8 +460,7 @@ NULL).
  */
 static int
 interpolate_poly3(const void* state UNUSED_PARAM,
-                  const float* data,
-                  const integer_t dnx, const integer_t dny,
+                  const struct blot_image_t* image,
                   const float x, const float y,
                   /* Output parameters */
                   float* value,
@@ -431,6 +468,8 @@ interpolate_poly3(const void* state UNUSED_PARAM,
   integer_t nx, ny;
   const integer_t rowleh = 4;
   const integer_t nterms = 4;
+  const integer_t dnx = image->dnx;
+  const integer_t dny = image->dny;
   float coeff[4][4];
   integer_t i, j;
   integer_t firstw, lastrw;
@@ -529,11 +568,7 @@ Perform quintic polynomial interpolation.
 interpolation type.  (For \a interpolate_poly5, it should be
 NULL).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -547,8 +582,7 @@ NULL).
  */
 static int
 interpolate_poly5(const void* state UNUSED_PARAM,
-                  const float* data,
-                  const integer_t dnx, const integer_t dny,
+                  const struct blot_image_t* image,
                   const float x, const float y,
                   /* Output parameters */
                   float* value,
@@ -556,6 +590,8 @@ interpolate_poly5(const void* state UNUSED_PARAM,
   integer_t nx, ny;
   const integer_t rowleh = 6;
   const integer_t nterms = 6;
+  const integer_t dnx = image->dnx;
+  const integer_t dny = image->dny;
   float coeff[6][6];
   integer_t i, j;
   integer_t firstw, lastrw;
@@ -840,11 +876,7 @@ Perform sinc interpolation.
 interpolation type.  (For \a interpolate_sinc, it must be a pointer
 to a \a sinc_param_t object).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -858,8 +890,7 @@ to a \a sinc_param_t object).
 */
 static int
 interpolate_sinc(const void* state,
-                 const float* data,
-                 const integer_t dnx, const integer_t dny,
+                 const struct blot_image_t* image,
                  const float x, const float y,
                  /* Output parameters */
                  float* value,
@@ -869,7 +900,11 @@ interpolate_sinc(const void* state,
   assert(state);
   INTERPOLATION_ASSERTS;
 
-  return interpolate_sinc_(data, 0, 1, &x, &y, dnx, dny,
+  /* The sinc convolution walks the rows of the whole source directly */
+  assert(image->block_shift == 0);
+  assert(image->nx == image->dnx && image->ny == image->dny);
+
+  return interpolate_sinc_(image->data, 0, 1, &x, &y, image->dnx, image->dny,
                            0.001f, 0.001f, param->sinscl, value, error);
 }
 
@@ -880,11 +915,7 @@ Perform Lanczos interpolation.
 interpolation type.  (For \a interpolate_lanczos, it must be a pointer
 to a \a lanczos_param_t object, already fully filled-in).
 
-@param[in] data A 2D data array of shape [dny][dnx]
-
-@param[in] dnx The x dimension of data
-
-@param[in] dny The y dimension of data
+@param[in] image The source image
 
 @param[in] x The fractional x coordinate
 
@@ -898,8 +929,7 @@ to a \a lanczos_param_t object, already fully filled-in).
 */
 static int
 interpolate_lanczos(const void* state,
-                    const float* data,
-                    const integer_t dnx, const integer_t dny,
+                    const struct blot_image_t* image,
                     const float x, const float y,
                     /* Output parameters */
                     float* value,
@@ -910,6 +940,8 @@ interpolate_lanczos(const void* state,
   integer_t nbox;
   integer_t i, j;
   const struct lanczos_param_t* p = (const struct lanczos_param_t*)state;
+  const integer_t dnx = image->dnx;
+  const integer_t dny = image->dny;
 
   assert(state);
   INTERPOLATION_ASSERTS;
@@ -966,35 +998,554 @@ interp_function* interp_function_map[interp_LAST] = {
   &interpolate_lanczos
 };
 
+/**
+Copy a row-major image into the blocked layout of \a blot_image_t.
+Blocks along the right and top edges are padded with zeros.
+
+@param[in] image The window of the source held row by row, as float32
+or, converting it, in any other format
+
+@param[in] shift log2 of the block edge
+
+@param[out] nbx The number of blocks along x
+
+@return The blocked copy, to be freed by the caller, or NULL if out of
+memory
+*/
+static float*
+make_blocked_image(const struct blot_image_t* image,
+                   const integer_t shift,
+                   /* Output parameters */
+                   integer_t* nbx) {
+  const integer_t edge = 1 << shift;
+  const integer_t dnx = image->nx;
+  const integer_t dny = image->ny;
+  integer_t nby, bx, by, i, j, w, h;
+  size_t row;
+  float* blocked;
+  float* block;
+
+  assert(image->data || image->raw);
+  assert(image->block_shift == 0);
+  assert(shift > 0);
+  assert(nbx);
+
+  *nbx = (dnx + edge - 1) >> shift;
+  nby = (dny + edge - 1) >> shift;
+
+  blocked = calloc(((size_t)*nbx * (size_t)nby) << (2 * shift), sizeof(float));
+  if (blocked == NULL) {
+    return NULL;
+  }
+
+  for (by = 0; by < nby; ++by) {
+    h = MIN(edge, dny - (by << shift));
+    for (bx = 0; bx < *nbx; ++bx) {
+      w = MIN(edge, dnx - (bx << shift));
+      block = blocked + (((size_t)by * (size_t)*nbx + (size_t)bx) << (2 * shift));
+      for (j = 0; j < h; ++j) {
+        row = (size_t)((by << shift) + j) * dnx + (bx << shift);
+        if (image->raw != NULL) {
+          for (i = 0; i < w; ++i) {
+            block[((size_t)j << shift) + i] =
+              raw_pixel_value(image->format, image->raw, row + i);
+          }
+        } else {
+          memcpy(block + ((size_t)j << shift), image->data + row,
+                 (size_t)w * sizeof(float));
+        }
+      }
+    }
+  }
+
+  return blocked;
+}
+
+/**
+An output tile and its position along the source-locality curve.
+*/
+struct blot_tile_t {
+  unsigned long key;
+  integer_t index;
+};
+
+static int
+compare_blot_tiles(const void* a, const void* b) {
+  const struct blot_tile_t* ta = (const struct blot_tile_t*)a;
+  const struct blot_tile_t* tb = (const struct blot_tile_t*)b;
+
+  if (ta->key != tb->key) {
+    return (ta->key < tb->key) ? -1 : 1;
+  }
+  return (ta->index < tb->index) ? -1 : (ta->index > tb->index);
+}
+
+/** Interleave the bits of two 16-bit cell indices (Z-order) */
+static inline_macro unsigned long
+morton_key(const unsigned long cx, const unsigned long cy) {
+  unsigned long key = 0;
+  integer_t b;
+
+  for (b = 0; b < 16; ++b) {
+    key |= ((cx >> b) & 1UL) << (2 * b);
+    key |= ((cy >> b) & 1UL) << (2 * b + 1);
+  }
+
+  return key;
+}
+
+/** Source cell index of a coordinate, clamped to 16 bits */
+static inline_macro unsigned long
+source_cell(const double pos, const double cell) {
+  if (!(pos > 0.0)) {
+    return 0;
+  } else if (pos >= 65535.0 * cell) {
+    return 65535;
+  }
+  return (unsigned long)(pos / cell);
+}
+
+/**
+Order the output tiles so that consecutive tiles sample neighbouring
+parts of the source.  The center of every tile is mapped onto the
+source in a single call and the tiles are sorted along a Z-order curve
+of the source cells, of edge \a cell pixels, that those centers fall
+in.
+
+@param[in] p The blotting parameters
+
+@param[in] tile The edge of the output tiles
+
+@param[in] ntx, nty The number of tiles along x and y
+
+@param[in] cell The edge of the source cells in pixels
+
+@param xin, yin, xtmp, ytmp, xout, yout Work arrays of at least \a
+ntx * \a nty elements
+
+@param[out] tiles The tiles in blotting order
+
+@param[out] error
+
+@return Non-zero if an error occurred
+*/
+static int
+order_blot_tiles(struct driz_param_t* p, const integer_t tile,
+                 const integer_t ntx, const integer_t nty,
+                 const double cell,
+                 double* xin, double* yin, double* xtmp, double* ytmp,
+                 double* xout, double* yout,
+                 /* Output parameters */
+                 struct blot_tile_t* tiles,
+                 struct driz_error_t* error) {
+  const integer_t ntiles = ntx * nty;
+  integer_t tx, ty, t;
+
+  for (ty = 0, t = 0; ty < nty; ++ty) {
+    for (tx = 0; tx < ntx; ++tx, ++t) {
+      xin[t] = (double)(tx * tile) +
+        0.5 * (double)MIN(tile, p->onx - tx * tile) + 0.5;
+      yin[t] = (double)(ty * tile) +
+        0.5 * (double)MIN(tile, p->ony - ty * tile) + 0.5;
+    }
+  }
+
+  if (map_value(p, FALSE, ntiles, xin, yin, xtmp, ytmp, xout, yout, error)) {
+    return 1;
+  }
+
+  for (t = 0; t < ntiles; ++t) {
+    tiles[t].key = morton_key(
+        source_cell(xout[t] - (double)p->xmin, cell),
+        source_cell(yout[t] - (double)p->ymin, cell));
+    tiles[t].index = t;
+  }
+
+  qsort(tiles, (size_t)ntiles, sizeof(struct blot_tile_t), &compare_blot_tiles);
+
+  return 0;
+}
+
+/**
+Blot a run of \a n output pixels of row \a j starting at column \a
+i0.
+
+@return Non-zero if an error occurred
+*/
+static int
+blot_segment(struct driz_param_t* p, interp_function* interpolate,
+             const void* state, const struct blot_image_t* image,
+             const integer_t i0, const integer_t n, const integer_t j,
+             double* xin, double* yin, double* xtmp, double* ytmp,
+             double* xout, double* yout,
+             /* Output parameters */
+             integer_t* nmiss, struct driz_error_t* error) {
+  const double dx = (double)(p->xmin);
+  const double dy = (double)(p->ymin);
+  float xo, yo, v;
+  integer_t i;
+
+  /* Set the X and Y start positions */
+  xin[0] = 1.0 + (double)i0 * p->x_scale;
+  xin[1] = 0.0;
+  yin[0] = (double)j + 1.0;
+  yin[1] = 0.0;
+
+  /* Transform this vector */
+  if (map_value(p, TRUE, n, xin, yin, xtmp, ytmp, xout, yout, error)) {
+    return 1;
+  }
+
+  /* Loop through the output positions and do the interpolation */
+  v = 1.0;
+  for (i = 0; i < n; ++i) {
+    xo = (float)(xout[i] - dx);
+    yo = (float)(yout[i] - dy);
+
+    /* Check it is on the input image */
+    if (xo >= 0.0 && xo <= p->dnx &&
+        yo >= 0.0 && yo <= p->dny) {
+
+      /* Points that a folded mapping takes beyond the window of the
+         source need the whole of it */
+      if (xo < image->sx1 || xo > image->sx2 ||
+          yo < image->sy1 || yo > image->sy2) {
+        p->blot_outside = TRUE;
+        driz_error_set_message(error, "Blot mapping leaves the window of the source");
+        return 1;
+      }
+
+      /* Check for look-up-table interpolation */
+      if (interpolate(state, image, xo, yo, &v, error)) {
+        return 1;
+      }
+
+      /* TODO: This float cast makes it match Fortran, but technically
+         loses more precision */
+      *output_data_ptr(p, i0 + i, j) = v * p->ef / (float)p->scale2;
+    } else {
+      /* If there is nothing for us then set the output to missing C
+         value flag */
+      *output_data_ptr(p, i0 + i, j) = p->misval;
+
+      ++(*nmiss);
+    }
+  }
+
+  return 0;
+}
+
+/** Spacing, in output pixels, of the samples along a block boundary */
+#define BLOT_EDGE_STEP 8
+
+/** Height of the bands of rows tested for misses in row order */
+#define BLOT_BAND 32
+
+/**
+How far, in source pixels, the window of the source is grown past
+where the output lands for the interpolant of \a p: its reach, plus a
+pixel.  Negative for the sinc interpolants, which need the whole
+source.
+*/
+static double
+blot_window_pad(const struct driz_param_t* p) {
+  switch (p->interpolation) {
+  case interp_nearest:
+  case interp_bilinear:
+    return 2.0;
+  case interp_poly3:
+    return 3.0;
+  case interp_poly5:
+    return 4.0;
+  case interp_lanczos3:
+  case interp_lanczos5:
+    assert(p->kscale != 0.0);
+    return floor(3.0 / p->kscale) + 2.0;
+  default:
+    return -1.0;
+  }
+}
+
+/** The number of samples taken along the boundary of a w x h block */
+static inline_macro integer_t
+boundary_points(const integer_t w, const integer_t h) {
+  return 2 * ((w + BLOT_EDGE_STEP - 1) / BLOT_EDGE_STEP +
+              (h + BLOT_EDGE_STEP - 1) / BLOT_EDGE_STEP) + 4;
+}
+
+/**
+Map the boundary of a block of output pixels onto the source.
+
+The centers of the pixels along the edge of the block starting at
+(x0, y0), of w x h pixels, are sampled every BLOT_EDGE_STEP pixels,
+walking around the block so that neighbouring samples are adjacent on
+the boundary.  For a mapping that is continuous and one-to-one, the
+block maps inside the region enclosed by the mapped boundary, so
+within the bounding box of the samples grown by the largest step
+between neighbouring samples.
+
+@param[in] p The blotting parameters
+
+@param[in] x0, y0 The 0-based corner of the block
+
+@param[in] w, h The size of the block
+
+@param xin, yin, xtmp, ytmp, xout, yout Work arrays of at least
+boundary_points(w, h) elements
+
+@param[out] bbox The bounding box [xmin, xmax, ymin, ymax] of the
+mapped boundary in 0-based source pixels, grown by the largest step
+
+@param[out] valid FALSE if the mapping returned non-finite values, in
+which case \a bbox is meaningless
+
+@param[out] error
+
+@return Non-zero if an error occurred
+*/
+static int
+map_block_boundary(struct driz_param_t* p,
+                   const integer_t x0, const integer_t y0,
+                   const integer_t w, const integer_t h,
+                   double* xin, double* yin, double* xtmp, double* ytmp,
+                   double* xout, double* yout,
+                   /* Output parameters */
+                   double bbox[4], bool_t* valid,
+                   struct driz_error_t* error) {
+  const double xl = (double)x0 + 1.0;
+  const double xr = (double)(x0 + w);
+  const double yb = (double)y0 + 1.0;
+  const double yt = (double)(y0 + h);
+  double step, dx, dy, d;
+  integer_t n, i, k;
+
+  /* Bottom edge left to right, right edge upwards, top edge right to
+     left and left edge downwards */
+  n = 0;
+  for (i = 0; i < w; i += BLOT_EDGE_STEP) {
+    xin[n] = xl + (double)i; yin[n++] = yb;
+  }
+  for (i = 0; i < h; i += BLOT_EDGE_STEP) {
+    xin[n] = xr; yin[n++] = yb + (double)i;
+  }
+  for (i = 0; i < w; i += BLOT_EDGE_STEP) {
+    xin[n] = xr - (double)i; yin[n++] = yt;
+  }
+  for (i = 0; i < h; i += BLOT_EDGE_STEP) {
+    xin[n] = xl; yin[n++] = yt - (double)i;
+  }
+  assert(n <= boundary_points(w, h));
+
+  if (map_value(p, FALSE, n, xin, yin, xtmp, ytmp, xout, yout, error)) {
+    return 1;
+  }
+
+  *valid = TRUE;
+  bbox[0] = bbox[2] = MAX_DOUBLE;
+  bbox[1] = bbox[3] = -MAX_DOUBLE;
+  step = 0.0;
+  for (i = 0; i < n; ++i) {
+    if (!(fabs(xout[i]) < MAX_DOUBLE && fabs(yout[i]) < MAX_DOUBLE)) {
+      *valid = FALSE;
+      return 0;
+    }
+
+    bbox[0] = MIN(bbox[0], xout[i]);
+    bbox[1] = MAX(bbox[1], xout[i]);
+    bbox[2] = MIN(bbox[2], yout[i]);
+    bbox[3] = MAX(bbox[3], yout[i]);
+
+    k = (i + 1) % n;
+    dx = xout[k] - xout[i];
+    dy = yout[k] - yout[i];
+    d = sqrt(dx*dx + dy*dy);
+    step = MAX(step, d);
+  }
+
+  bbox[0] -= step + (double)p->xmin;
+  bbox[1] += step - (double)p->xmin;
+  bbox[2] -= step + (double)p->ymin;
+  bbox[3] += step - (double)p->ymin;
+
+  return 0;
+}
+
+/**
+Check whether every pixel of a block of output pixels certainly falls
+off the source, in which case the block is filled with the missing
+value.
+
+@param[out] filled TRUE if the block was filled
+
+@return Non-zero if an error occurred
+*/
+static int
+fill_missed_block(struct driz_param_t* p,
+                  const integer_t x0, const integer_t y0,
+                  const integer_t w, const integer_t h,
+                  double* xin, double* yin, double* xtmp, double* ytmp,
+                  double* xout, double* yout,
+                  /* Output parameters */
+                  bool_t* filled, integer_t* nmiss,
+                  struct driz_error_t* error) {
+  double bbox[4];
+  bool_t valid;
+  integer_t i, j;
+
+  *filled = FALSE;
+
+  if (map_block_boundary(p, x0, y0, w, h, xin, yin, xtmp, ytmp, xout, yout,
+                         bbox, &valid, error)) {
+    return 1;
+  }
+
+  /* Allow one pixel for rounding */
+  if (!valid ||
+      (bbox[1] >= -1.0 && bbox[0] <= (double)p->dnx + 1.0 &&
+       bbox[3] >= -1.0 && bbox[2] <= (double)p->dny + 1.0)) {
+    return 0;
+  }
+
+  for (j = y0; j < y0 + h; ++j) {
+    for (i = x0; i < x0 + w; ++i) {
+      *output_data_ptr(p, i, j) = p->misval;
+    }
+  }
+  *nmiss += w * h;
+  *filled = TRUE;
+
+  return 0;
+}
+
+/** The scratch space of one thread of a blot, and what it counted */
+struct blot_worker_t {
+  struct driz_param_t* p;
+  double* xin;
+  double* yin;
+  double* xtmp;
+  double* ytmp;
+  double* xout;
+  double* yout;
+  integer_t nmiss;
+  integer_t nskip;
+};
+
+/**
+A blot shared out among threads: bands of BLOT_BAND rows, or with
+tiles, the tiles in the order of \a tiles
+*/
+struct blot_work_t {
+  interp_function* interpolate;
+  const void* state;
+  const struct blot_image_t* image;
+  integer_t tile;
+  integer_t ntx;
+  const struct blot_tile_t* tiles;
+  struct blot_worker_t* workers;
+};
+
+/**
+Blot bands or tiles begin to end - 1, filling those that fall off the
+source in one go.
+*/
+static int
+blot_blocks(void* state, const integer_t worker,
+            const integer_t begin, const integer_t end,
+            /* Output parameters */
+            struct driz_error_t* error) {
+  struct blot_work_t* work = (struct blot_work_t*)state;
+  struct blot_worker_t* w = &work->workers[worker];
+  struct driz_param_t* p = w->p;
+  const integer_t tile = work->tile;
+  integer_t x0, y0, nx, ny, j, k;
+  bool_t filled;
+  double t0 = 0.0, map0 = 0.0;
+
+  /* The interpolation is timed as the whole task less the mapping
+     within it */
+  DRIZ_STATS_TIC(p->stats, t0);
+  if (p->stats) {
+    map0 = p->stats->map_time;
+  }
+
+  for (k = begin; k < end; ++k) {
+    if (tile == 0) {
+      x0 = 0;
+      y0 = k * BLOT_BAND;
+      nx = p->onx;
+      ny = MIN(BLOT_BAND, p->ony - y0);
+    } else {
+      x0 = (work->tiles[k].index % work->ntx) * tile;
+      y0 = (work->tiles[k].index / work->ntx) * tile;
+      nx = MIN(tile, p->onx - x0);
+      ny = MIN(tile, p->ony - y0);
+    }
+
+    if (fill_missed_block(p, x0, y0, nx, ny,
+                          w->xin, w->yin, w->xtmp, w->ytmp, w->xout, w->yout,
+                          &filled, &w->nmiss, error)) {
+      return 1;
+    }
+    if (filled) {
+      ++w->nskip;
+      continue;
+    }
+
+    for (j = y0; j < y0 + ny; ++j) {
+      if (blot_segment(p, work->interpolate, work->state, work->image,
+                       x0, nx, j, w->xin, w->yin, w->xtmp, w->ytmp,
+                       w->xout, w->yout, &w->nmiss, error)) {
+        return 1;
+      }
+    }
+  }
+
+  if (p->stats) {
+    DRIZ_STATS_TOC(p->stats, kernel_time, t0);
+    DRIZ_STATS_ADD(p->stats, kernel_time, map0 - p->stats->map_time);
+  }
+
+  return 0;
+}
+
 /* See header file for documentation */
 int
 doblot(struct driz_param_t* p,
        struct driz_error_t* error) {
   const size_t nlut = 2048;
   const float space = 0.01;
-  double *xin = NULL;
-  double *xtmp = NULL;
-  double *xout = NULL;
-  double *yin = NULL;
-  double *ytmp = NULL;
-  double *yout = NULL;
-  integer_t nmiss;
-  double dx, dy;
-  double yv;
-  float xo, yo, v;
-  /*float nx, ny;*/
-  integer_t i, j;
+  double *work = NULL;
+  float *blocked = NULL;
+  struct blot_tile_t *tiles = NULL;
+  struct driz_param_t *params = NULL;
+  struct driz_stats_t *stats = NULL;
+  struct blot_worker_t *workers = NULL;
+  struct blot_worker_t *w;
+  struct blot_work_t blocks;
+  struct blot_image_t image;
+  integer_t nmiss, nskip;
+  integer_t tile, ntx, nty, nwork, nblocks, nthreads;
+  integer_t k;
   interp_function* interpolate;
   struct sinc_param_t sinc;
   void* state = NULL;
+  double t0 = 0.0, pad;
+  const double zero = 0.0;
+  struct driz_map_table_t map_table;
 
   assert(p);
   assert(error);
   assert(space != 0.0);
 
+  memset(&map_table, 0, sizeof(map_table));
+
+  DRIZ_STATS_TIC(p->stats, t0);
+
   /* Some initial settings */
   nmiss = 0;
-
+  nskip = 0;
+  p->blot_outside = FALSE;
+  nthreads = MAX(p->nthreads, 1);
   /* Select interpolation function */
   assert(p->interpolation >= 0 && p->interpolation < interp_LAST);
   interpolate = interp_function_map[p->interpolation];
@@ -1003,6 +1554,17 @@ doblot(struct driz_param_t* p,
     goto doblot_exit_;
   }
 
+  if (p->blot_tile < 0) {
+    driz_error_format_message(error, "Invalid blot tile size %d", p->blot_tile);
+    goto doblot_exit_;
+  }
+
+  if (p->blot_block_shift < 0 || p->blot_block_shift > 12) {
+    driz_error_format_message(error, "Invalid blot block shift %d (must be 0 to 12)",
+                              p->blot_block_shift);
+    goto doblot_exit_;
+  }
+
   /* Some interpolation functions need some pre-calculated state */
   if (p->interpolation == interp_lanczos3 || p->interpolation == interp_lanczos5) {
     assert(p->kscale != 0.0);
@@ -1024,45 +1586,102 @@ doblot(struct driz_param_t* p,
     state = &sinc;
   } /* Otherwise state is NULL */
 
-  /* Allocate some memory */
-  assert(p->onx >= 0);
-  assert(p->ony >= 0);
-
-  xin = malloc((size_t)p->onx * sizeof(double));
-  if (xin == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto doblot_exit_;
+  /* The source, or the window of it held in p->data, re-laid out in
+     blocks if asked to.  The sinc convolution addresses the rows
+     directly, so it always reads the original layout. */
+  image.data = p->data;
+  image.raw = p->data_raw;
+  image.format = &p->data_format;
+  image.dnx = p->dnx;
+  image.dny = p->dny;
+  image.x1 = p->blot_x1;
+  image.y1 = p->blot_y1;
+  image.nx = p->blot_wnx > 0 ? p->blot_wnx : p->dnx;
+  image.ny = p->blot_wny > 0 ? p->blot_wny : p->dny;
+  image.block_shift = 0;
+  image.nbx = 0;
+  if (image.x1 < 0 || image.y1 < 0 ||
+      image.x1 + image.nx > p->dnx || image.y1 + image.ny > p->dny ||
+      (interpolate == &interpolate_sinc &&
+       (image.nx != p->dnx || image.ny != p->dny))) {
+    driz_error_set_message(error, "Invalid window of the blot source");
+    goto doblot_exit_;
   }
 
-  xtmp = malloc((size_t)p->onx * sizeof(double));
-  if (xtmp == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto doblot_exit_;
+  /* A point within the pad of a side of the window that is not the
+     edge of the source may interpolate from beyond the window */
+  pad = blot_window_pad(p) - 1.0;
+  image.sx1 = image.x1 > 0 ? (double)image.x1 + pad : -MAX_DOUBLE;
+  image.sx2 = image.x1 + image.nx < p->dnx ?
+    (double)(image.x1 + image.nx - 1) - pad : MAX_DOUBLE;
+  image.sy1 = image.y1 > 0 ? (double)image.y1 + pad : -MAX_DOUBLE;
+  image.sy2 = image.y1 + image.ny < p->dny ?
+    (double)(image.y1 + image.ny - 1) - pad : MAX_DOUBLE;
+
+  if (interpolate == &interpolate_sinc && image.raw != NULL) {
+    driz_error_set_message(error, "Sinc interpolation needs a native float32 source");
+    goto doblot_exit_;
   }
-
-  xout = malloc((size_t)p->onx * sizeof(double));
-  if (xout == NULL) {
+  if (p->blot_block_shift > 0 && interpolate != &interpolate_sinc) {
+    blocked = make_blocked_image(&image, p->blot_block_shift, &image.nbx);
+    if (blocked == NULL) {
       driz_error_set_message(error, "Out of memory");
       goto doblot_exit_;
+    }
+    image.data = blocked;
+    image.raw = NULL;
+    image.block_shift = p->blot_block_shift;
   }
 
-  yin = malloc((size_t)p->onx * sizeof(double));
-  if (yin == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto doblot_exit_;
-  }
+  /* Allocate some memory */
+  assert(p->onx >= 0);
+  assert(p->ony >= 0);
 
-  ytmp = malloc((size_t)p->onx * sizeof(double));
-  if (ytmp == NULL) {
+  tile = p->blot_tile;
+  if (tile > 0) {
+    ntx = (p->onx + tile - 1) / tile;
+    nty = (p->ony + tile - 1) / tile;
+    nwork = MAX(p->onx, ntx * nty);
+
+    tiles = malloc((size_t)(ntx * nty) * sizeof(struct blot_tile_t));
+    if (tiles == NULL) {
       driz_error_set_message(error, "Out of memory");
       goto doblot_exit_;
+    }
+    nwork = MAX(nwork, boundary_points(tile, tile));
+  } else {
+    ntx = nty = 0;
+    nwork = MAX(p->onx, boundary_points(p->onx, BLOT_BAND));
   }
-
-  yout = malloc((size_t)p->onx * sizeof(double));
-  if (yout == NULL) {
+  nblocks = tile > 0 ? ntx * nty : (p->ony + BLOT_BAND - 1) / BLOT_BAND;
+
+  /* The scratch space of each thread, and with several threads a copy
+     of the parameters for each, where map_value() records its time */
+  workers = calloc((size_t)nthreads, sizeof(struct blot_worker_t));
+  work = malloc((size_t)nthreads * 6 * (size_t)nwork * sizeof(double));
+  if (workers == NULL || work == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto doblot_exit_;
+  }
+  if (nthreads > 1) {
+    params = malloc((size_t)nthreads * sizeof(struct driz_param_t));
+    stats = malloc((size_t)nthreads * sizeof(struct driz_stats_t));
+    if (params == NULL || stats == NULL) {
       driz_error_set_message(error, "Out of memory");
       goto doblot_exit_;
+    }
   }
+  for (k = 0; k < nthreads; ++k) {
+    w = &workers[k];
+    w->p = nthreads > 1 ? &params[k] : p;
+    w->xin = work + (size_t)(6 * k) * (size_t)nwork;
+    w->yin = w->xin + nwork;
+    w->xtmp = w->yin + nwork;
+    w->ytmp = w->xtmp + nwork;
+    w->xout = w->ytmp + nwork;
+    w->yout = w->xout + nwork;
+  }
+  w = &workers[0];
 
   /* In the WCS case, we can't use the scale to calculate the Jacobian,
      so we need to do it.
@@ -1076,62 +1695,69 @@ doblot(struct driz_param_t* p,
      correction to separate the distortion-induced scale change.
   */
 
-  /* Image subset size
-  nx = (float)(p->xmax - p->xmin + 1);
-  ny = (float)(p->ymax - p->ymin + 1);
-  */
-
-  /* Offsets */
-  dx = (double)(p->xmin);
-  dy = (double)(p->ymin);
-
   /* Recalculate the area scaling factor */
   assert(p->scale != 0.0);
   p->scale2 = p->scale*p->scale;
 
-  /* Set the X and Y start positions -- most of these don't change
-     between iterations. */
-  xin[0] = 1.0;
-  xin[1] = 0.0;
-  yin[1] = 0.0;
-  v = 1.0;
-
-  /* Outer look over output image pixels (X, Y) */
-  for (j = 0; j < p->ony; ++j) {
-    yv = (double)j+1;
-
-    yin[0] = yv;
-
-    /* Transform this vector */
-    if (map_value(p, TRUE, p->onx,
-                  xin, yin, xtmp, ytmp, xout, yout, error)) {
+  /* Map every output pixel at once when asked to, unless the mapping
+     generates its rows itself */
+  if (p->map_batch && p->mapping_callback != &default_mapping) {
+    if (map_table_fill(p, p->onx, p->ony, 1.0, p->x_scale, 1.0,
+                       1, &zero, &zero, &map_table, error)) {
       goto doblot_exit_;
     }
+    p->map_table = &map_table;
+  }
 
-    /* Loop through the output positions and do the interpolation */
-    for (i = 0; i < p->onx; ++i) {
-      xo = (float)(xout[i] - dx);
-      yo = (float)(yout[i] - dy);
+  /* Visit the output a band of rows at a time, so that bands that
+     fall off the source are filled in one go, or in tiles, in an
+     order that follows the source, so that neighbouring tiles reuse
+     the same source pages */
+  if (tile > 0 &&
+      order_blot_tiles(p, tile, ntx, nty,
+                       (double)(image.block_shift > 0 ?
+                                1 << image.block_shift : tile),
+                       w->xin, w->yin, w->xtmp, w->ytmp, w->xout, w->yout,
+                       tiles, error)) {
+    goto doblot_exit_;
+  }
 
-      /* Check it is on the input image */
-      if (xo >= 0.0 && xo <= p->dnx &&
-          yo >= 0.0 && yo <= p->dny) {
+  if (nthreads > 1) {
+    /* A mapping that sets itself up on its first call does so before
+       the threads share it */
+    w->xin[0] = 0.5 * (double)p->onx;
+    w->yin[0] = 0.5 * (double)p->ony;
+    if (map_value(p, FALSE, 1, w->xin, w->yin, w->xtmp, w->ytmp,
+                  w->xout, w->yout, error)) {
+      goto doblot_exit_;
+    }
 
-        /* Check for look-up-table interpolation */
-        if (interpolate(state, p->data, p->dnx, p->dny, xo, yo, &v, error)) {
-          goto doblot_exit_;
-        }
+    for (k = 0; k < nthreads; ++k) {
+      params[k] = *p;
+      driz_stats_init(&stats[k]);
+      params[k].stats = p->stats ? &stats[k] : NULL;
+    }
+  }
 
-        /* TODO: This float cast makes it match Fortran, but technically
-           loses more precision */
-        *output_data_ptr(p, i, j) = v * p->ef / (float)p->scale2;
-      } else {
-        /* If there is nothing for us then set the output to missing C
-           value flag */
-        *output_data_ptr(p, i, j) = p->misval;
+  blocks.interpolate = interpolate;
+  blocks.state = state;
+  blocks.image = &image;
+  blocks.tile = tile;
+  blocks.ntx = ntx;
+  blocks.tiles = tiles;
+  blocks.workers = workers;
+  if (driz_parallel_for(nthreads, nblocks, 1, &blot_blocks, &blocks, error)) {
+    for (k = 0; k < nthreads; ++k) {
+      p->blot_outside |= workers[k].p->blot_outside;
+    }
+    goto doblot_exit_;
+  }
 
-        nmiss++;
-      }
+  for (k = 0; k < nthreads; ++k) {
+    nmiss += workers[k].nmiss;
+    nskip += workers[k].nskip;
+    if (nthreads > 1 && p->stats) {
+      driz_stats_add_times(p->stats, &stats[k]);
     }
   }
 
@@ -1140,14 +1766,94 @@ doblot(struct driz_param_t* p,
   /*     return 1; */
   /* } */
 
+  if (p->stats) {
+    DRIZ_STATS_ADD(p->stats, nhit, p->onx * p->ony - nmiss);
+    DRIZ_STATS_ADD(p->stats, nmiss, nmiss);
+    DRIZ_STATS_ADD(p->stats, nskip, nskip);
+    DRIZ_STATS_TOC(p->stats, total_time, t0);
+  }
+
  doblot_exit_:
+  p->map_table = NULL;
+  map_table_free(&map_table);
   free(p->lanczos.lut); p->lanczos.lut = NULL;
-  free(xin); xin = NULL;
-  free(xtmp); xtmp = NULL;
-  free(xout); xout = NULL;
-  free(yin); yin = NULL;
-  free(ytmp); ytmp = NULL;
-  free(yout); yout = NULL;
+  free(blocked); blocked = NULL;
+  free(tiles); tiles = NULL;
+  free(work); work = NULL;
+  free(workers); workers = NULL;
+  free(params); params = NULL;
+  free(stats); stats = NULL;
+
+  return driz_error_is_set(error);
+}
+
+/* See header file for documentation */
+int
+blot_source_window(struct driz_param_t* p,
+                   /* Output parameters */
+                   integer_t* x1, integer_t* x2,
+                   integer_t* y1, integer_t* y2,
+                   struct driz_error_t* error) {
+  double *work = NULL;
+  double bbox[4];
+  double pad;
+  bool_t valid;
+  integer_t n;
+
+  assert(p);
+  assert(x1 && x2 && y1 && y2);
+  assert(error);
+
+  /* The whole source unless the pre-pass can do better */
+  *x1 = 0;
+  *x2 = p->dnx - 1;
+  *y1 = 0;
+  *y2 = p->dny - 1;
+
+  n = boundary_points(p->onx, p->ony);
+  work = malloc((size_t)n * 6 * sizeof(double));
+  if (work == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto blot_source_window_exit_;
+  }
+
+  if (map_block_boundary(p, 0, 0, p->onx, p->ony,
+                         work, work + n, work + 2*n, work + 3*n,
+                         work + 4*n, work + 5*n,
+                         bbox, &valid, error)) {
+    goto blot_source_window_exit_;
+  }
+
+  if (!valid) {
+    goto blot_source_window_exit_;
+  }
+
+  /* Grow the box by the reach of the interpolant, plus a pixel */
+  pad = blot_window_pad(p);
+  if (pad < 0.0) {
+    /* The sinc convolution needs the whole source */
+    goto blot_source_window_exit_;
+  }
+
+  bbox[0] = floor(bbox[0] - pad);
+  bbox[1] = ceil(bbox[1] + pad);
+  bbox[2] = floor(bbox[2] - pad);
+  bbox[3] = ceil(bbox[3] + pad);
+
+  if (bbox[1] < 0.0 || bbox[0] > (double)(p->dnx - 1) ||
+      bbox[3] < 0.0 || bbox[2] > (double)(p->dny - 1)) {
+    /* Nothing is sampled */
+    *x1 = *y1 = 0;
+    *x2 = *y2 = -1;
+  } else {
+    *x1 = (integer_t)MAX(bbox[0], 0.0);
+    *x2 = (integer_t)MIN(bbox[1], (double)(p->dnx - 1));
+    *y1 = (integer_t)MAX(bbox[2], 0.0);
+    *y2 = (integer_t)MIN(bbox[3], (double)(p->dny - 1));
+  }
+
+ blot_source_window_exit_:
+  free(work);
 
   return driz_error_is_set(error);
 }
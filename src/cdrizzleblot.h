@@ -3,6 +3,10 @@
 
 #include "cdrizzleutil.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
 This routine does the interpolation of the input array.
 
@@ -17,4 +21,39 @@ int
 doblot(struct driz_param_t* p,
        struct driz_error_t* error);
 
+/**
+Find the part of the source that blotting the output can sample.
+
+The boundary of the output is mapped onto the source and the bounding
+box of the result, grown by the reach of the interpolant, is clipped to
+the source.  Only this window of the source needs to be held in memory:
+blotting with p->data holding the window, p->blot_x1 and p->blot_y1
+set to (x1, y1) and p->blot_wnx and p->blot_wny to its size gives the
+same result as blotting from the whole source, provided the mapping
+is one-to-one.  Should any pixel of the output map inside the source
+but too near the edge of the window, as a folded mapping may, doblot()
+fails with p->blot_outside set, and the blot must be done again from
+the whole source.  The sinc interpolants always need the whole source.
+
+@param[in] p A set of blotting parameters, with p->dnx and p->dny
+giving the size of the whole source.  p->data is not used.
+
+@param[out] x1, x2, y1, y2 The 0-based inclusive bounds of the window.
+When no output pixel can land on the source, x2 < x1 and y2 < y1.
+
+@param[out] error
+
+@return Non-zero if an error occurred.
+*/
+int
+blot_source_window(struct driz_param_t* p,
+                   /* Output parameters */
+                   integer_t* x1, integer_t* x2,
+                   integer_t* y1, integer_t* y2,
+                   struct driz_error_t* error);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* CDRIZZLEBLOT_H */
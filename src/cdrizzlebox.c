@@ -1,9 +1,8 @@
-#define NO_IMPORT_ARRAY
-#define NO_IMPORT_ASTROPY_WCS_API
 
 #include "driz_portability.h"
 #include "cdrizzlemap.h"
 #include "cdrizzlebox.h"
+#include "cdrizzlesched.h"
 #include "cdrizzlewcs.h"
 #include "cdrizzleutil.h"
 
@@ -12,6 +11,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static inline_macro double*
 mapping_4_ptr(struct driz_param_t* p, double* arr, integer_t i0, integer_t i1) {
@@ -30,120 +30,399 @@ mapping_ptr(struct driz_param_t* p, double* arr, integer_t i0) {
   return (arr + i0);
 }
 
-/**
-Check how much of a line will overlap an output image, if any,
-after applying the standard drizzle transformation.
+/* Largest distance, in output pixels, between the mapped midpoint of
+   a segment of the edge of the input and the midpoint of its chord
+   beyond which the segment is split */
+#define FOOTPRINT_TOLERANCE 0.1
+
+/* Segments each edge of the input starts with, and the most points
+   along the whole boundary */
+#define FOOTPRINT_EDGE_NPOINT 8
+#define FOOTPRINT_MAX_NPOINT 2048
 
-This is intended to allow the number of points which are needlessly
-drizzled outside the output image to be minimized.
+/* Points along each side of the grid sampled inside the input */
+#define FOOTPRINT_INTERIOR_NPOINT 5
 
-was: CHOVER
+/* Pixels in each run of a row bounded by dobox_spans() */
+#define FOOTPRINT_SPAN 64
+
+/**
+Where the input lands on the output, worked out once for each call of
+dobox() rather than for each row.
 */
-#define CHECK_OVER_NPOINT 21
+struct footprint_t {
+  /* Every row is to be drizzled in full */
+  bool_t full;
+  /* An affine approximation of the mapping, output x = a[0] x + a[1] y
+     + a[2] and output y = a[3] x + a[4] y + a[5], and the largest
+     distance of the mapping from it at the points sampled */
+  double a[6];
+  double error;
+  /* Or, when set, the bounds xlo, xhi, ylo, yhi of where the centres
+     of each run of FOOTPRINT_SPAN pixels of each row land, nspan runs
+     to a row of rows ystart + 1 on, found by dobox_spans() */
+  const double* spans;
+  integer_t nspan;
+  integer_t ystart;
+};
 
+/**
+Map the boundary of rows y1 to y2 of the input onto the output,
+sampling each edge adaptively until the mapped edge is followed to
+within FOOTPRINT_TOLERANCE.
+
+If the footprint, the polygon through the mapped boundary, lies within
+the output window, p->xmin to p->xmax and p->ymin to p->ymax, grown by
+margin pixels, every row is drizzled in full.  If
+it lies clear of it, p->no_over is set.  Otherwise an affine
+approximation of the mapping is fitted to the boundary and a grid of
+points inside, from which footprint_row() finds the columns of each
+row that may land on the output.
+
+was: CHOVER, for each row
+*/
 static int
-check_over(struct driz_param_t* p, const integer_t y, const integer_t margin,
-           /* Output parameters */
-           double* ofrac, integer_t* x1, integer_t* x2,
-           struct driz_error_t* error) {
-  const integer_t npoint = CHECK_OVER_NPOINT;
-  double xval[CHECK_OVER_NPOINT], yval[CHECK_OVER_NPOINT];
-  double xtmp[CHECK_OVER_NPOINT], ytmp[CHECK_OVER_NPOINT];
-  double xout[CHECK_OVER_NPOINT], yout[CHECK_OVER_NPOINT];
-  integer_t logo[CHECK_OVER_NPOINT];
-  integer_t step, first, last;
-  integer_t nhit, nmiss;
-  integer_t i, np;
+chip_footprint(struct driz_param_t* p, const integer_t y1, const integer_t y2,
+               const integer_t margin,
+               /* Output parameters */
+               struct footprint_t* fp,
+               struct driz_error_t* error) {
+  const integer_t nmax = FOOTPRINT_MAX_NPOINT;
+  const integer_t nedge = FOOTPRINT_EDGE_NPOINT;
+  const integer_t ngrid = FOOTPRINT_INTERIOR_NPOINT;
+  const double tol = FOOTPRINT_TOLERANCE;
+  double* memory = NULL;
+  char* flags = NULL;
+  double *xin, *yin, *xout, *yout;
+  double *xmid, *ymid, *xmout, *ymout, *xtmp, *ytmp;
+  char *done, *ok;
+  double xc[4], yc[4];
+  double xlo, xhi, ylo, yhi;
+  double bx0, bx1, by0, by1;
+  double mx, my, mu, mv;
+  double sxx, sxy, syy, sux, suy, svx, svy;
+  double dx, dy, du, dv, det, err2;
+  double* a = fp->a;
+  integer_t n, nb, nmid, nadd, pos;
+  integer_t i, k, e;
+  int status = 1;
 
   assert(p);
-  assert(ofrac);
-  assert(x1);
-  assert(x2);
+  assert(fp);
   assert(error);
+  assert(y1 <= y2);
 
-  if (p->dnx < npoint)
-    step = 1;
-  else
-    step = p->dnx / (npoint / 2);
+  fp->full = TRUE;
+  fp->error = 0.0;
 
-  for (i = 1, np = 0; i <= p->dnx; i += step, ++np) {
-    assert(np < npoint);
-    xval[np] = (double)i;
-    yval[np] = (double)y;
+  memory = (double*)malloc(10 * (size_t)nmax * sizeof(double));
+  flags = (char*)malloc(2 * (size_t)nmax);
+  if (memory == NULL || flags == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto chip_footprint_exit_;
+  }
+  xin = memory;
+  yin = xin + nmax;
+  xout = yin + nmax;
+  yout = xout + nmax;
+  xmid = yout + nmax;
+  ymid = xmid + nmax;
+  xmout = ymid + nmax;
+  ymout = xmout + nmax;
+  xtmp = ymout + nmax;
+  ytmp = xtmp + nmax;
+  done = flags;
+  ok = flags + nmax;
+
+  /* The corners, in order around the boundary, and a few points along
+     each edge */
+  xc[0] = 1.0;             yc[0] = (double)y1;
+  xc[1] = (double)p->dnx;  yc[1] = (double)y1;
+  xc[2] = (double)p->dnx;  yc[2] = (double)y2;
+  xc[3] = 1.0;             yc[3] = (double)y2;
+  n = 0;
+  for (e = 0; e < 4; ++e) {
+    for (i = 0; i < nedge; ++i) {
+      xin[n] = xc[e] + (xc[(e + 1) % 4] - xc[e]) * (double)i / (double)nedge;
+      yin[n] = yc[e] + (yc[(e + 1) % 4] - yc[e]) * (double)i / (double)nedge;
+      ++n;
+    }
+  }
+  if (map_value(p, FALSE, n, xin, yin, xtmp, ytmp, xout, yout, error))
+    goto chip_footprint_exit_;
+
+  /* The segment from each point to the next around the boundary is
+     done once it is no longer than a pixel or its mapped midpoint
+     lies close enough to its chord */
+  for (k = 0; k < n; ++k) {
+    i = (k + 1) % n;
+    done[k] = (fabs(xin[i] - xin[k]) + fabs(yin[i] - yin[k]) <= 1.0);
   }
-  assert(np < npoint);
 
-  /* Check end point */
-  if (xval[np - 1] < (double)p->dnx) {
-    xval[np] = (double)p->dnx;
-    yval[np] = (double)y;
-    ++np;
+  for (;;) {
+    nmid = 0;
+    for (k = 0; k < n; ++k) {
+      if (!done[k]) {
+        i = (k + 1) % n;
+        xmid[nmid] = 0.5 * (xin[k] + xin[i]);
+        ymid[nmid] = 0.5 * (yin[k] + yin[i]);
+        ++nmid;
+      }
+    }
+    if (nmid == 0 || n + nmid > nmax)
+      break;
+
+    if (map_value(p, FALSE, nmid, xmid, ymid, xtmp, ytmp, xmout, ymout,
+                  error))
+      goto chip_footprint_exit_;
+
+    nmid = 0;
+    for (k = 0; k < n; ++k) {
+      if (!done[k]) {
+        i = (k + 1) % n;
+        du = xmout[nmid] - 0.5 * (xout[k] + xout[i]);
+        dv = ymout[nmid] - 0.5 * (yout[k] + yout[i]);
+        ok[nmid] = (du * du + dv * dv <= tol * tol ||
+                    fabs(xin[i] - xin[k]) + fabs(yin[i] - yin[k]) <= 2.0);
+        ++nmid;
+      }
+    }
+
+    /* Merge the midpoints in, working back from the end so that no
+       point is overwritten before it has been moved */
+    nadd = nmid;
+    pos = n + nadd;
+    for (k = n - 1; k >= 0; --k) {
+      if (!done[k]) {
+        --nmid;
+        --pos;
+        xin[pos] = xmid[nmid];
+        yin[pos] = ymid[nmid];
+        xout[pos] = xmout[nmid];
+        yout[pos] = ymout[nmid];
+        done[pos] = ok[nmid];
+        done[k] = ok[nmid];
+      }
+      --pos;
+      xin[pos] = xin[k];
+      yin[pos] = yin[k];
+      xout[pos] = xout[k];
+      yout[pos] = yout[k];
+      done[pos] = done[k];
+    }
+    assert(pos == 0 && nmid == 0);
+    n += nadd;
+  }
+  nb = n;
+
+  /* Compare the boundary with the output window grown by the margin,
+     and shrunk by the tolerance when asking whether it lies inside */
+  xlo = (double)(p->xmin - margin);
+  xhi = (double)(p->xmax + margin);
+  ylo = (double)(p->ymin - margin);
+  yhi = (double)(p->ymax + margin);
+  bx0 = bx1 = xout[0];
+  by0 = by1 = yout[0];
+  for (k = 1; k < nb; ++k) {
+    bx0 = MIN(bx0, xout[k]);
+    bx1 = MAX(bx1, xout[k]);
+    by0 = MIN(by0, yout[k]);
+    by1 = MAX(by1, yout[k]);
   }
 
-  /* Transform */
-  if (map_value(p, FALSE, np, xval, yval, xtmp, ytmp, xout, yout, error))
-    return 1;
+  if (bx0 >= xlo + tol && bx1 < xhi - tol &&
+      by0 >= ylo + tol && by1 < yhi - tol) {
+    status = 0;
+    goto chip_footprint_exit_;
+  }
 
-  /* Check where the overlap starts and ends */
-  for (i = 0; i < np; ++i) {
-    logo[i] = 0;
+  if (bx1 + tol < xlo || bx0 - tol >= xhi ||
+      by1 + tol < ylo || by0 - tol >= yhi) {
+    p->no_over = TRUE;
+    status = 0;
+    goto chip_footprint_exit_;
   }
 
-  for (i = 0; i < np - 1; ++i) {
-    if (MAX(xout[i], xout[i+1]) >= 1.0 - (double)margin &&
-        MIN(xout[i], xout[i+1]) < (double)(p->onx + margin) &&
-        MAX(yout[i], yout[i+1]) >= 1.0 - (double)margin &&
-        MIN(yout[i], yout[i+1]) < (double)(p->ony + margin)) {
-      logo[i] = 1;
-      logo[i+1] = 1;
+  /* A grid of points inside, so that the fit does not follow the
+     boundary alone */
+  n = 0;
+  for (k = 1; k <= ngrid; ++k) {
+    for (i = 1; i <= ngrid; ++i) {
+      xmid[n] = 1.0 + (double)(p->dnx - 1) * (double)i / (double)(ngrid + 1);
+      ymid[n] = (double)y1 +
+        (double)(y2 - y1) * (double)k / (double)(ngrid + 1);
+      ++n;
     }
   }
+  if (map_value(p, FALSE, n, xmid, ymid, xtmp, ytmp, xmout, ymout, error))
+    goto chip_footprint_exit_;
+  for (k = 0; k < n; ++k) {
+    xin[nb + k] = xmid[k];
+    yin[nb + k] = ymid[k];
+    xout[nb + k] = xmout[k];
+    yout[nb + k] = ymout[k];
+  }
+  n += nb;
+
+  /* A least-squares fit about the means */
+  mx = my = mu = mv = 0.0;
+  for (k = 0; k < n; ++k) {
+    mx += xin[k];
+    my += yin[k];
+    mu += xout[k];
+    mv += yout[k];
+  }
+  mx /= (double)n;
+  my /= (double)n;
+  mu /= (double)n;
+  mv /= (double)n;
+
+  sxx = sxy = syy = sux = suy = svx = svy = 0.0;
+  for (k = 0; k < n; ++k) {
+    dx = xin[k] - mx;
+    dy = yin[k] - my;
+    du = xout[k] - mu;
+    dv = yout[k] - mv;
+    sxx += dx * dx;
+    sxy += dx * dy;
+    syy += dy * dy;
+    sux += du * dx;
+    suy += du * dy;
+    svx += dv * dx;
+    svy += dv * dy;
+  }
 
-  nhit = 0;
-  for (i = 0; i < np; ++i) {
-    if (logo[i]) {
-      ++nhit;
-    }
+  /* A chip one pixel wide or one row high has no fit to make; drizzle
+     all of it */
+  det = sxx * syy - sxy * sxy;
+  if (!(det > 0.0)) {
+    status = 0;
+    goto chip_footprint_exit_;
   }
 
-  nmiss = np - nhit;
+  a[0] = (sux * syy - suy * sxy) / det;
+  a[1] = (suy * sxx - sux * sxy) / det;
+  a[2] = mu - a[0] * mx - a[1] * my;
+  a[3] = (svx * syy - svy * sxy) / det;
+  a[4] = (svy * sxx - svx * sxy) / det;
+  a[5] = mv - a[3] * mx - a[4] * my;
+
+  err2 = 0.0;
+  for (k = 0; k < n; ++k) {
+    du = a[0] * xin[k] + a[1] * yin[k] + a[2] - xout[k];
+    dv = a[3] * xin[k] + a[4] * yin[k] + a[5] - yout[k];
+    err2 = MAX(err2, du * du + dv * dv);
+  }
 
-  if (nhit == 0) {
-    *ofrac = 0.0;
-    *x1 = 0;
-    *x2 = 0;
-    return 0;
+  /* Only a finite fit is of use; x - x is 0 for finite x alone */
+  det = a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + err2;
+  if (det - det == 0.0) {
+    fp->full = FALSE;
+    fp->error = sqrt(err2);
   }
 
-  first = 0;
-  last = 0;
+  status = 0;
 
-  for (i = 0; i < np; ++i) {
-    if (logo[i]) {
-      first = i;
-      break;
+ chip_footprint_exit_:
+  free(memory);
+  free(flags);
+
+  return status;
+}
+
+/**
+Narrow [*x1, *x2] to the x for which a * x + c lies within [lo, hi].
+*/
+static inline_macro void
+clip_columns(const double a, const double c, const double lo, const double hi,
+             /* Input/output parameters */
+             double* x1, double* x2) {
+  double t1, t2;
+
+  if (a == 0.0) {
+    if (c < lo || c > hi) {
+      *x2 = *x1 - 1.0;
     }
+    return;
   }
 
-  for (i = np - 1; i >= 0; --i) {
-    if (logo[i]) {
-      last = i;
-      break;
+  t1 = (lo - c) / a;
+  t2 = (hi - c) / a;
+  *x1 = MAX(*x1, MIN(t1, t2));
+  *x2 = MIN(*x2, MAX(t1, t2));
+}
+
+/**
+Find the columns x1 to x2 of row y of the input that may land on the
+output window grown by margin pixels, from a footprint found by
+chip_footprint().  Returns FALSE when none can.
+
+The affine approximation of the mapping is solved for where it meets
+the edges of the output, padded by twice the worst distance of the
+mapping from it and the tolerance to which the footprint was found.
+Where the footprint has the bounds of the runs of each row, the row
+is taken from the first run that meets the window to the last.
+*/
+static bool_t
+footprint_row(const struct driz_param_t* p, const struct footprint_t* fp,
+              const double y, const integer_t margin,
+              /* Output parameters */
+              integer_t* x1, integer_t* x2) {
+  const double* a = fp->a;
+  const double* s;
+  double pad, lo, hi;
+  integer_t k, first, last;
+
+  assert(p);
+  assert(fp);
+  assert(x1);
+  assert(x2);
+
+  if (fp->full) {
+    *x1 = 1;
+    *x2 = p->dnx;
+    return TRUE;
+  }
+
+  if (fp->spans) {
+    s = fp->spans + (size_t)((integer_t)y - fp->ystart - 1) *
+      (size_t)fp->nspan * 4;
+    first = -1;
+    last = -1;
+    for (k = 0; k < fp->nspan; ++k, s += 4) {
+      if (s[0] <= (double)(p->xmax + margin) &&
+          s[1] >= (double)(p->xmin - margin) &&
+          s[2] <= (double)(p->ymax + margin) &&
+          s[3] >= (double)(p->ymin - margin)) {
+        if (first < 0) {
+          first = k;
+        }
+        last = k;
+      }
     }
+    if (first < 0) {
+      return FALSE;
+    }
+    *x1 = first * FOOTPRINT_SPAN + 1;
+    *x2 = MIN(p->dnx, (last + 1) * FOOTPRINT_SPAN);
+    return TRUE;
   }
 
-  if (nhit == 0 && nmiss == 0) {
-    *ofrac = 0.0;
-  } else {
-    *ofrac = (double)nhit / (double)(nhit + nmiss);
+  pad = (double)margin + 2.0 * fp->error + FOOTPRINT_TOLERANCE;
+  lo = 1.0;
+  hi = (double)p->dnx;
+  clip_columns(a[0], a[1] * y + a[2], (double)p->xmin - pad,
+               (double)p->xmax + pad, &lo, &hi);
+  clip_columns(a[3], a[4] * y + a[5], (double)p->ymin - pad,
+               (double)p->ymax + pad, &lo, &hi);
+  if (lo > hi) {
+    return FALSE;
   }
-  *x1 = (first > 0) ? (integer_t)xval[first - 1] : (integer_t)xval[0];
-  *x2 = (last < np - 1) ? (integer_t)xval[last + 1] : (integer_t)xval[np - 1];
 
-  assert(*x1 > 0 && *x1 <= p->dnx);
-  assert(*x2 > 0 && *x2 <= p->dnx);
+  *x1 = MAX((integer_t)1, (integer_t)floor(lo));
+  *x2 = MIN(p->dnx, (integer_t)ceil(hi));
 
-  return 0;
+  return *x1 <= *x2;
 }
 
 /**
@@ -304,7 +583,20 @@ update_context(struct driz_param_t* p, const integer_t ii, const integer_t jj,
                integer_t* oldcon,
                /* Output parameters */
                integer_t* newcon, struct driz_error_t* error) {
-  if (p->output_context && dow > 0.0) {
+  const bool_t context =
+    (bool_t)(p->output_context != NULL || p->output_tiles != NULL);
+
+  /* Removing the input, with its weights negated, takes it off the
+     context again wherever it lands.  Otherwise a negative weight,
+     from a side lobe of the lanczos kernels, leaves the context be */
+  if (context && p->weight_scale < 0.0f && dow != 0.0) {
+    if (p->output_done != NULL) {
+      driz_error_set_message(error,
+                             "Cannot remove an image from a context table");
+      return 1;
+    }
+    *output_context_ptr(p, ii, jj) &= ~p->bv;
+  } else if (context && dow > 0.0) {
     if (p->output_done == NULL) {
       *output_context_ptr(p, ii, jj) |= p->bv;
     } else {
@@ -328,8 +620,14 @@ update_data(struct driz_param_t* p, const integer_t ii, const integer_t jj,
 
   vc_plus_dow = vc + dow;
 
-  /* Just a simple calculation without logical tests */
-  if (vc == 0.0) {
+  /* Keeping the sum, normalized once at the end, saves a division */
+  if (p->output_sum) {
+    if (vc == 0.0) {
+      *output_data_ptr(p, ii, jj) = dow * d;
+    } else {
+      *output_data_ptr(p, ii, jj) += dow * d;
+    }
+  } else if (vc == 0.0) {
     *output_data_ptr(p, ii, jj) = d;
   } else {
     *output_data_ptr(p, ii, jj) =
@@ -549,15 +847,11 @@ do_kernel_point(struct driz_param_t* p, const integer_t j,
     yarr = j-1;
 
       /* Allow for stretching because of scale change */
-      d = *data_ptr(p, xarr, yarr) * (float)p->scale2;
+      d = input_value(p, xarr, yarr) * (float)p->scale2;
 
       /* Scale the weighting mask by the scale factor.  Note that we
          DON'T scale by the Jacobian as it hasn't been calculated */
-      if (p->weights) {
-        dow = *weights_ptr(p, xarr, yarr) * p->weight_scale;
-      } else {
-        dow = 1.0;
-      }
+      dow = input_weight(p, xarr, yarr);
 
       /* If we are creating of modifying the context image,
          we do so here. */
@@ -612,15 +906,11 @@ do_kernel_tophat(struct driz_param_t* p, const integer_t j,
     yarr = j-1;
 
     /* Allow for stretching because of scale change */
-    d = *data_ptr(p, xarr, yarr) * (float)p->scale2;
+    d = input_value(p, xarr, yarr) * (float)p->scale2;
 
     /* Scale the weighting mask by the scale factor and inversely by
        the Jacobian to ensure conservation of weight in the output */
-    if (p->weights) {
-      dow = *weights_ptr(p, xarr, yarr) * p->weight_scale;
-    } else {
-      dow = 1.0;
-    }
+    dow = input_weight(p, xarr, yarr);
 
     /* Loop over output pixels which could be affected */
     for (jj = nyi; jj <= nya; ++jj) {
@@ -695,15 +985,11 @@ do_kernel_gaussian(struct driz_param_t* p, const integer_t j,
 
 
     /* Allow for stretching because of scale change */
-    d = *data_ptr(p, xarr, yarr) * (float)p->scale2;
+    d = input_value(p, xarr, yarr) * (float)p->scale2;
 
     /* Scale the weighting mask by the scale factor and inversely by
        the Jacobian to ensure conservation of weight in the output */
-    if (p->weights) {
-      w = *weights_ptr(p, xarr, yarr) * p->weight_scale;
-    } else {
-      w = 1.0;
-    }
+    w = input_weight(p, xarr, yarr);
 
     /* Loop over output pixels which could be affected */
     for (jj = nyi; jj <= nya; ++jj) {
@@ -777,15 +1063,11 @@ do_kernel_lanczos(struct driz_param_t* p, const integer_t j,
 
 
     /* Allow for stretching because of scale change */
-    d = *data_ptr(p, xarr, yarr) * (float)p->scale2;
+    d = input_value(p, xarr, yarr) * (float)p->scale2;
 
     /* Scale the weighting mask by the scale factor and inversely by
        the Jacobian to ensure conservation of weight in the output */
-    if (p->weights) {
-      w = *weights_ptr(p, xarr, yarr) * p->weight_scale;
-    } else {
-      w = 1.0;
-    }
+    w = input_weight(p, xarr, yarr);
 
     /* Loop over output pixels which could be affected */
     for (jj = nyi; jj <= nya; ++jj) {
@@ -865,15 +1147,11 @@ do_kernel_turbo(struct driz_param_t* p, const integer_t j,
     yarr = j-1;
 
     /* Allow for stretching because of scale change */
-    d = *data_ptr(p, xarr, yarr) * (float)p->scale2;
+    d = input_value(p, xarr, yarr) * (float)p->scale2;
 
     /* Scale the weighting mask by the scale factor and inversely by
        the Jacobian to ensure conservation of weight in the output. */
-    if (p->weights) {
-      w = *weights_ptr(p, xarr, yarr) * p->weight_scale;
-    } else {
-      w = 1.0;
-    }
+    w = input_weight(p, xarr, yarr);
 
 
     /* Loop over the output pixels which could be affected */
@@ -915,7 +1193,8 @@ static int
 do_kernel_square(struct driz_param_t* p,
                  const integer_t j, double y,
                  const integer_t x1, const integer_t x2,
-                 const integer_t last_x1, const integer_t last_x2,
+                 const integer_t last_x1 UNUSED_PARAM,
+                 const integer_t last_x2 UNUSED_PARAM,
                  /* Input/output parameters */
                  double* xi, double* yi,
                  double* xtmp, double* ytmp,
@@ -988,15 +1267,11 @@ do_kernel_square(struct driz_param_t* p,
     nhit = 0;
 
     /* Allow for stretching because of scale change */
-    d = *data_ptr(p, i-1, j) * (float)p->scale2;
+    d = input_value(p, i-1, j) * (float)p->scale2;
 
     /* Scale the weighting mask by the scale factor and inversely by
        the Jacobian to ensure conservation of weight in the output */
-    if (p->weights) {
-      w = *weights_ptr(p, i-1, j) * p->weight_scale;
-    } else {
-      w = 1.0;
-    }
+    w = input_weight(p, i-1, j);
 
     /* Loop over output pixels which could be affected */
     min_jj = MAX(fortran_round(min_doubles(yout, 4)), 0);
@@ -1048,27 +1323,127 @@ kernel_handler_map[] = {
 };
 
 /**
-This module does the actual mapping of input flux to output images
-using "boxer", a code written by Bill Sparks for FOC geometric
-distortion correction, rather than the "drizzling" approximation.
+The margin, in output pixels, beyond the output window within which
+input pixels are still drizzled: enough for the kernel to reach into
+the window from where the centre of a pixel lands.
+*/
+static integer_t
+footprint_margin(const struct driz_param_t* p) {
+  const double scale = fabs(p->scale);
+  double reach;
 
-This works by calculating the positions of the four corners of a
-quadrilateral on the output grid corresponding to the corners of the
-input pixel and then working out exactly how much of each pixel in the
-output is covered, or not.
+  switch (p->kernel) {
+  case kernel_point:
+    reach = 0.0;
+    break;
+  case kernel_gaussian:
+    reach = MAX(2.5 * p->pixel_fraction / 2.3548, 1.2) / scale;
+    break;
+  case kernel_lanczos2:
+    reach = 2.0 * p->pixel_fraction / scale;
+    break;
+  case kernel_lanczos3:
+    reach = 3.0 * p->pixel_fraction / scale;
+    break;
+  default:
+    reach = p->pixel_fraction / scale;
+    break;
+  }
 
-In V1.6 this was simplified to use the DRIVAL routine and also to
-include some limited multi-kernel support.
+  return 5 + (integer_t)ceil(reach);
+}
+
+/**
+Map, into \a table, every point of the rows of the input that
+footprint_row() finds may land on the output window: the centres of
+the pixels, or the corners of the square kernel.
 */
-int
-dobox(struct driz_param_t* p, const integer_t ystart,
-      /* Output parameters */
-      integer_t* nmiss, integer_t* nskip, struct driz_error_t* error) {
+static int
+map_rows_ahead(struct driz_param_t* p, const struct footprint_t* fp,
+               const integer_t ystart, const integer_t margin,
+               /* Output parameters */
+               struct driz_map_table_t* table, struct driz_error_t* error) {
+  const double dh = 0.5 * p->pixel_fraction;
+  double xoff[4], yoff[4];
+  integer_t nlattice, j, jlo, jhi, xlo, xhi, x1, x2;
+
+  jlo = p->ny;
+  jhi = -1;
+  xlo = p->dnx;
+  xhi = 1;
+  for (j = 0; j < p->ny; ++j) {
+    if (footprint_row(p, fp, (double)(ystart + j + 1), margin, &x1, &x2)) {
+      jlo = MIN(jlo, j);
+      jhi = j;
+      xlo = MIN(xlo, x1);
+      xhi = MAX(xhi, x2);
+    }
+  }
+  if (p->kernel == kernel_square) {
+    xoff[0] = -dh; yoff[0] = dh;
+    xoff[1] = dh;  yoff[1] = dh;
+    xoff[2] = dh;  yoff[2] = -dh;
+    xoff[3] = -dh; yoff[3] = -dh;
+    nlattice = 4;
+  } else {
+    xoff[0] = yoff[0] = 0.0;
+    nlattice = 1;
+  }
+  if (jhi < jlo) {
+    return 0;
+  }
+
+  return map_table_fill(p, xhi - xlo + 1, jhi - jlo + 1, (double)xlo,
+                        p->x_scale, (double)(ystart + jlo + 1), nlattice,
+                        xoff, yoff, table, error);
+}
+
+/**
+If the input image is not in CPS, divide it by the exposure time as it
+is read.
+*/
+static int
+scale_input(struct driz_param_t* p, struct driz_error_t* error) {
+  float inv_exposure_time;
+
+  if (p->in_units != unit_cps) {
+    if (p->exposure_time == 0.0) {
+      driz_error_set_message(error, "Invalid exposure time");
+      return 1;
+    }
+    inv_exposure_time = 1.0f / p->exposure_time;
+    /* The data is scaled as it is read rather than in place, so that
+       the input is left as it was and may be drizzled again, onto
+       another window of the output */
+    if (p->data_raw == NULL) {
+      p->data_raw = p->data;
+      driz_pixel_format_init(&p->data_format);
+    }
+    p->data_format.bscale *= inv_exposure_time;
+    p->data_format.bzero *= inv_exposure_time;
+  }
+
+  return 0;
+}
+
+/**
+Drizzle rows j1 to j2 - 1 of the strip onto the window p->xmin to
+p->xmax, p->ymin to p->ymax of the output, with the calling thread
+alone, finding the footprint of the strip on it unless it is \a
+given; see dobox().
+*/
+static int
+dobox_window(struct driz_param_t* p, const integer_t ystart,
+             const integer_t j1, const integer_t j2,
+             const struct footprint_t* given,
+             /* Output parameters */
+             integer_t* nmiss, integer_t* nskip,
+             struct driz_error_t* error) {
   const double nsig = 2.5;
   const size_t nlut = 512;
   const float del = 0.01;
   integer_t j, x1, x2, last_x1, last_x2;
-  double y, dh, ofrac;
+  double y, dh;
   kernel_handler_t kernel_handler = NULL;
   integer_t oldcon, newcon;
   integer_t np;
@@ -1078,25 +1453,46 @@ dobox(struct driz_param_t* p, const integer_t ystart,
   double* ytmp = NULL;
   double* xo = NULL;
   double* yo = NULL;
-  float inv_exposure_time;
-  float* data_begin, *data_end;
   int kernel_order;
   size_t new_buffer_size;
   size_t bit_no;
+  integer_t nmiss0, nskip0;
+  struct footprint_t footprint;
+  struct driz_map_table_t map_table;
+  integer_t margin;
+  double t0 = 0.0, t1 = 0.0, map0 = 0.0;
 
   assert(p);
   assert(nmiss);
   assert(nskip);
   assert(error);
 
+  /* Where the input lands on the output, for all the rows at once */
+  memset(&footprint, 0, sizeof(footprint));
+  memset(&map_table, 0, sizeof(map_table));
+  margin = footprint_margin(p);
+  if (given) {
+    footprint = *given;
+  } else if (!p->no_over &&
+             chip_footprint(p, ystart + 1, ystart + p->ny, margin,
+                            &footprint, error)) {
+    return 1;
+  }
+
   /* We skip all this if there is no overlap */
   if (p->no_over) {
     /* If there is no overlap at all, set appropriate values */
     *nskip = p->dny;
     *nmiss = p->dnx * p->dny;
+    DRIZ_STATS_ADD(p->stats, nskip, p->dny);
+    DRIZ_STATS_ADD(p->stats, nmiss, p->dnx * p->dny);
     return 0;
   }
 
+  DRIZ_STATS_TIC(p->stats, t0);
+  nmiss0 = *nmiss;
+  nskip0 = *nskip;
+
   /* Some initial settings - note that the reference pixel position is
      determined by the value of ALIGN */
   oldcon = -1;
@@ -1224,40 +1620,36 @@ dobox(struct driz_param_t* p, const integer_t ystart,
     }
   }
 
-  /* If the input image is not in CPS we need to divide by the
-     exposure */
-  if (p->in_units != unit_cps) {
-    if (p->exposure_time == 0.0) {
-      driz_error_set_message(error, "Invalid exposure time");
+  /* Map all the rows that may land on the output at once when asked
+     to, unless the mapping generates its rows itself or the rows have
+     been mapped already */
+  if (p->map_batch && p->mapping_callback != &default_mapping &&
+      p->map_table == NULL) {
+    if (map_rows_ahead(p, &footprint, ystart, margin, &map_table, error)) {
       goto dobox_exit_;
     }
-    assert(p->exposure_time != 0.0);
-    inv_exposure_time = 1.0f / p->exposure_time;
-    /* TODO: Removing this printf causes the results to be
-       less accurate.  Frustrating Heisenbug */
-    /*printf("%f\n", inv_exposure_time); */
-    data_begin = p->data;
-    data_end = data_begin + (p->ny * p->dnx);
-    for (; data_begin != data_end; ++data_begin) {
-      *data_begin *= inv_exposure_time;
-    }
+    p->map_table = &map_table;
   }
 
-  DRIZLOG("-Drizzling using kernel = %s\n",kernel_enum2str(p->kernel));
+  if (scale_input(p, error)) {
+    goto dobox_exit_;
+  }
+
+  /* The kernels, with the context updates within them, are timed as
+     the whole loop less the mapping */
+  DRIZ_STATS_TIC(p->stats, t1);
+  if (p->stats) {
+    map0 = p->stats->map_time;
+  }
 
   /* This is the outer loop over all the lines in the input image */
   last_x1 = p->dnx;
   last_x2 = 0;
-  y = (double)ystart;
-  for (j = 0; j < p->ny; ++j) {
+  y = (double)(ystart + j1);
+  for (j = j1; j < j2; ++j) {
     y += 1.0;
-    /* Check the overlap with the output */
-    if (check_over(p, (integer_t)y, 5, &ofrac, &x1, &x2, error)) {
-      goto dobox_exit_;
-    }
-
     /* If the line falls completely off the output, then skip it */
-    if (ofrac != 0.0) {
+    if (footprint_row(p, &footprint, y, margin, &x1, &x2)) {
       assert(x1 > 0 && x1 <= p->dnx);
       assert(x2 > 0 && x2 <= p->dnx);
 
@@ -1287,7 +1679,8 @@ dobox(struct driz_param_t* p, const integer_t ystart,
           goto dobox_exit_;
         }
 
-        if (kernel_handler(p, y, x1, x2, xo, yo,
+        /* The kernels read the input by its row in the strip */
+        if (kernel_handler(p, j + 1, x1, x2, xo, yo,
                            &oldcon, &newcon, nmiss, error)) {
           goto dobox_exit_;
         }
@@ -1298,6 +1691,10 @@ dobox(struct driz_param_t* p, const integer_t ystart,
           goto dobox_exit_;
         }
       }
+      if (p->output_tiles && p->output_tiles->failed) {
+        driz_error_set_message(error, "Could not allocate or map an output tile");
+        goto dobox_exit_;
+      }
       last_x1 = x1;
       last_x2 = x2;
     } else {
@@ -1309,7 +1706,18 @@ dobox(struct driz_param_t* p, const integer_t ystart,
     }
   }
 
+  if (p->stats) {
+    DRIZ_STATS_TOC(p->stats, kernel_time, t1);
+    DRIZ_STATS_ADD(p->stats, kernel_time, map0 - p->stats->map_time);
+    DRIZ_STATS_ADD(p->stats, nhit, p->dnx * (j2 - j1) - (*nmiss - nmiss0));
+    DRIZ_STATS_ADD(p->stats, nmiss, *nmiss - nmiss0);
+    DRIZ_STATS_ADD(p->stats, nskip, *nskip - nskip0);
+    DRIZ_STATS_TOC(p->stats, total_time, t0);
+  }
+
  dobox_exit_:
+  p->map_table = NULL;
+  map_table_free(&map_table);
   free(p->lanczos.lut); p->lanczos.lut = NULL;
   free(p->output_done); p->output_done = NULL;
   free(xi); xi = NULL;
@@ -1321,3 +1729,940 @@ dobox(struct driz_param_t* p, const integer_t ystart,
 
   return driz_error_is_set(error);
 }
+
+/** Output rows in the smallest band drizzled by one thread */
+#define DOBOX_MIN_BAND 16
+
+/** A drizzle shared out among threads by bands of output rows */
+struct dobox_bands_t {
+  struct driz_param_t* p;
+  integer_t ystart;
+  integer_t margin;
+  /* A copy of p for each thread, and where it records its time */
+  struct driz_param_t* params;
+  struct driz_stats_t* stats;
+  /* Room to map a row in, and the pixels and rows off the window, for
+     each thread */
+  double* work;
+  integer_t* counts;
+  /* The footprint shared by the bands, and the bounds of its runs */
+  struct footprint_t footprint;
+  double* spans;
+};
+
+/**
+Map the centres of the pixels of input rows begin to end - 1 and
+bound, for each run of FOOTPRINT_SPAN of them, where they land, so
+that each band finds the rows and columns that may reach it however
+far the mapping is from affine.  Pixels that map to nothing are
+bounded by the whole plane.  The centres that land off the window,
+and the rows that may not reach it at all, are counted.
+*/
+static int
+dobox_spans(void* state, const integer_t worker,
+            const integer_t begin, const integer_t end,
+            /* Output parameters */
+            struct driz_error_t* error) {
+  struct dobox_bands_t* bands = (struct dobox_bands_t*)state;
+  const struct driz_param_t* p = bands->p;
+  struct driz_param_t* q = &bands->params[worker];
+  const integer_t n = p->dnx;
+  const integer_t nspan = bands->footprint.nspan;
+  const double margin = (double)bands->margin;
+  double* xi = bands->work + (size_t)worker * 6 * (size_t)n;
+  double* yi = xi + n;
+  double* xtmp = yi + n;
+  double* ytmp = xtmp + n;
+  double* xo = ytmp + n;
+  double* yo = xo + n;
+  integer_t* counts = bands->counts + 2 * worker;
+  double* s;
+  double x, y;
+  integer_t i, j, k, i2;
+  bool_t reach;
+
+  for (j = begin; j < end; ++j) {
+    xi[0] = 1.0;
+    yi[0] = (double)(bands->ystart + j + 1);
+    yi[1] = 0.0;
+    if (map_value(q, TRUE, n, xi, yi, xtmp, ytmp, xo, yo, error)) {
+      return 1;
+    }
+
+    reach = FALSE;
+    s = bands->spans + (size_t)j * (size_t)nspan * 4;
+    for (k = 0; k < nspan; ++k, s += 4) {
+      s[0] = s[2] = HUGE_VAL;
+      s[1] = s[3] = -HUGE_VAL;
+      i2 = MIN(n, (k + 1) * FOOTPRINT_SPAN);
+      for (i = k * FOOTPRINT_SPAN; i < i2; ++i) {
+        x = xo[i];
+        y = yo[i];
+        if (x != x || y != y) {
+          s[0] = s[2] = -HUGE_VAL;
+          s[1] = s[3] = HUGE_VAL;
+          ++counts[0];
+          continue;
+        }
+        s[0] = MIN(s[0], x);
+        s[1] = MAX(s[1], x);
+        s[2] = MIN(s[2], y);
+        s[3] = MAX(s[3], y);
+        if (x < (double)p->xmin - 0.5 || x >= (double)p->xmax + 0.5 ||
+            y < (double)p->ymin - 0.5 || y >= (double)p->ymax + 0.5) {
+          ++counts[0];
+        }
+      }
+      reach = reach ||
+        (s[0] <= (double)p->xmax + margin && s[1] >= (double)p->xmin - margin &&
+         s[2] <= (double)p->ymax + margin && s[3] >= (double)p->ymin - margin);
+    }
+    if (!reach) {
+      ++counts[1];
+    }
+  }
+
+  return 0;
+}
+
+/**
+Drizzle onto output rows begin to end - 1 of the window, as a window
+of their own.  The kernel set-up and the scaling of the input start
+afresh from the caller's parameters, and the footprint and the rows
+mapped ahead, if any, are shared.
+*/
+static int
+dobox_band(void* state, const integer_t worker,
+           const integer_t begin, const integer_t end,
+           /* Output parameters */
+           struct driz_error_t* error) {
+  struct dobox_bands_t* bands = (struct dobox_bands_t*)state;
+  const struct driz_param_t* p = bands->p;
+  struct driz_param_t* q = &bands->params[worker];
+  const size_t offset = (size_t)begin * (size_t)p->onx;
+  integer_t nmiss = 0, nskip = 0;
+
+  q->ymin = p->ymin + begin;
+  q->ymax = p->ymin + end - 1;
+  q->output_data = p->output_data + offset;
+  q->output_counts = p->output_counts + offset;
+  q->output_context =
+    p->output_context ? p->output_context + offset : NULL;
+  q->no_over = FALSE;
+  q->data_raw = p->data_raw;
+  q->data_format = p->data_format;
+  q->lanczos.lut = NULL;
+  q->map_table = p->map_table;
+
+  /* What each band misses is of no interest; see dobox() */
+  return dobox_window(q, bands->ystart, 0, q->ny, &bands->footprint,
+                      &nmiss, &nskip, error);
+}
+
+/** Input pixels mapped at once by each pass of a gather */
+#define DOBOX_GATHER_PIXELS (1 << 20)
+
+/**
+A drizzle in which each output row gathers the input that lands on it.
+The input is taken a pass of rows at a time: the centres of their
+pixels are mapped, and each pixel is listed, in input order, under
+every output row of the window that it may reach.
+*/
+struct dobox_gather_t {
+  struct driz_param_t* p;
+  integer_t ystart;
+  /* The rows of the input in this pass */
+  integer_t j0;
+  integer_t nrow;
+  /* A copy of p for each thread, and where it records its time */
+  struct driz_param_t* params;
+  struct driz_stats_t* stats;
+  /* Room to map a row in for each thread */
+  double* work;
+  /* Where the centres of the pixels of the pass land */
+  double* xo;
+  double* yo;
+  /* The pixels of the pass, as offsets into xo and yo, under each
+     output row: those of row jj are entries first[jj] to
+     first[jj + 1] - 1 */
+  integer_t* first;
+  integer_t* entries;
+  size_t nentries;
+};
+
+/**
+The output rows, *jjs to *jje, that input pixel k of the pass reaches
+with the point or turbo kernel.  Returns FALSE when it adds nothing to
+any pixel of the window, as the kernels count a miss.
+*/
+static bool_t
+gather_rows(const struct dobox_gather_t* g, const size_t k,
+            /* Output parameters */
+            integer_t* jjs, integer_t* jje) {
+  const struct driz_param_t* p = g->p;
+  const double dx = (double)p->xmin;
+  const double dy = (double)p->ymin;
+  double xxi, xxa, yyi, yya;
+  integer_t ii, jj, iis, iie;
+  bool_t hitx, hity;
+
+  if (p->kernel == kernel_point) {
+    ii = fortran_round(g->xo[k] - dx);
+    jj = fortran_round(g->yo[k] - dy);
+    *jjs = *jje = jj;
+    return (bool_t)(ii >= 0 && ii < p->nsx && jj >= 0 && jj < p->nsy);
+  }
+
+  /* As do_kernel_turbo(), in which the pixel hits when its box has
+     some overlap with a pixel of the window along both axes */
+  xxi = g->xo[k] - dx - p->pfo;
+  xxa = g->xo[k] - dx + p->pfo;
+  yyi = g->yo[k] - dy - p->pfo;
+  yya = g->yo[k] - dy + p->pfo;
+  iis = MAX(fortran_round(xxi), 0);
+  iie = MIN(fortran_round(xxa), p->nsx - 1);
+  *jjs = MAX(fortran_round(yyi), 0);
+  *jje = MIN(fortran_round(yya), p->nsy - 1);
+
+  hitx = FALSE;
+  for (ii = iis; ii <= iie && !hitx; ++ii) {
+    hitx = (bool_t)(MIN(xxa, (double)ii + 0.5) -
+                    MAX(xxi, (double)ii - 0.5) > 0.0);
+  }
+  hity = FALSE;
+  for (jj = *jjs; jj <= *jje && !hity; ++jj) {
+    hity = (bool_t)(MIN(yya, (double)jj + 0.5) -
+                    MAX(yyi, (double)jj - 0.5) > 0.0);
+  }
+
+  return (bool_t)(hitx && hity);
+}
+
+/** Map the centres of the pixels of rows begin to end - 1 of the pass */
+static int
+gather_map(void* state, const integer_t worker,
+           const integer_t begin, const integer_t end,
+           /* Output parameters */
+           struct driz_error_t* error) {
+  struct dobox_gather_t* g = (struct dobox_gather_t*)state;
+  struct driz_param_t* q = &g->params[worker];
+  const integer_t n = g->p->dnx;
+  double* xi = g->work + (size_t)worker * 4 * (size_t)n;
+  double* yi = xi + n;
+  double* xtmp = yi + n;
+  double* ytmp = xtmp + n;
+  size_t offset;
+  integer_t j;
+
+  for (j = begin; j < end; ++j) {
+    offset = (size_t)j * (size_t)n;
+    xi[0] = 1.0;
+    yi[0] = (double)(g->ystart + g->j0 + j + 1);
+    yi[1] = 0.0;
+    if (map_value(q, TRUE, n, xi, yi, xtmp, ytmp, g->xo + offset,
+                  g->yo + offset, error)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+Drizzle onto output rows begin to end - 1 of the window what lands on
+them from the pass, pixel by pixel in input order, so that each output
+pixel is added to exactly as by do_kernel_point() or
+do_kernel_turbo().
+*/
+static int
+gather_rows_add(void* state, const integer_t worker,
+                const integer_t begin, const integer_t end,
+                /* Output parameters */
+                struct driz_error_t* error) {
+  struct dobox_gather_t* g = (struct dobox_gather_t*)state;
+  struct driz_param_t* q = &g->params[worker];
+  const integer_t n = q->dnx;
+  const double dx = (double)q->xmin;
+  const double dy = (double)q->ymin;
+  integer_t oldcon = -1, newcon = 0;
+  integer_t e, k, ii, jj, iis, iie, xarr, yarr;
+  double xxi, xxa, yyi, yya, w, dover;
+  float vc, d, dow;
+  double t0 = 0.0;
+
+  DRIZ_STATS_TIC(q->stats, t0);
+
+  for (jj = begin; jj < end; ++jj) {
+    for (e = g->first[jj]; e < g->first[jj + 1]; ++e) {
+      k = g->entries[e];
+      xarr = k % n;
+      yarr = g->j0 + k / n;
+
+      /* Allow for stretching because of scale change */
+      d = input_value(q, xarr, yarr) * (float)q->scale2;
+      w = input_weight(q, xarr, yarr);
+
+      if (q->kernel == kernel_point) {
+        ii = fortran_round(g->xo[k] - dx);
+        vc = *output_counts_ptr(q, ii, jj);
+        dow = (float)w;
+        if (update_context(q, ii, jj, dow, &oldcon, &newcon, error)) {
+          return 1;
+        }
+        update_data(q, ii, jj, d, vc, dow);
+        continue;
+      }
+
+      xxi = g->xo[k] - dx - q->pfo;
+      xxa = g->xo[k] - dx + q->pfo;
+      yyi = g->yo[k] - dy - q->pfo;
+      yya = g->yo[k] - dy + q->pfo;
+      iis = MAX(fortran_round(xxi), 0);
+      iie = MIN(fortran_round(xxa), q->nsx - 1);
+      for (ii = iis; ii <= iie; ++ii) {
+        dover = over(ii, jj, xxi, xxa, yyi, yya);
+        if (dover > 0.0) {
+          /* Correct for the pixfrac area factor */
+          dover *= q->scale2 * q->ac;
+          vc = *output_counts_ptr(q, ii, jj);
+          dow = (float)(dover * w);
+          if (update_context(q, ii, jj, dow, &oldcon, &newcon, error)) {
+            return 1;
+          }
+          update_data(q, ii, jj, d, vc, dow);
+        }
+      }
+    }
+  }
+
+  DRIZ_STATS_TOC(q->stats, kernel_time, t0);
+
+  return 0;
+}
+
+/**
+List the pixels of the pass under the output rows they reach, in
+input order, counting those that miss the window and the rows all of
+whose pixels do.
+*/
+static int
+gather_list(struct dobox_gather_t* g,
+            /* Output parameters */
+            integer_t* nmiss, integer_t* nskip, struct driz_error_t* error) {
+  const integer_t nsy = g->p->nsy;
+  const size_t npixel = (size_t)g->nrow * (size_t)g->p->dnx;
+  const integer_t n = g->p->dnx;
+  integer_t* next = NULL;
+  integer_t jj, jjs, jje, nhit = 0;
+  size_t k, total;
+  integer_t* entries;
+
+  for (jj = 0; jj <= nsy; ++jj) {
+    g->first[jj] = 0;
+  }
+  for (k = 0; k < npixel; ++k) {
+    if (gather_rows(g, k, &jjs, &jje)) {
+      for (jj = jjs; jj <= jje; ++jj) {
+        ++g->first[jj + 1];
+      }
+      ++nhit;
+    } else {
+      ++(*nmiss);
+    }
+    if ((integer_t)(k % (size_t)n) == n - 1) {
+      if (nhit == 0) {
+        ++(*nskip);
+      }
+      nhit = 0;
+    }
+  }
+  total = 0;
+  for (jj = 1; jj <= nsy; ++jj) {
+    total += (size_t)g->first[jj];
+    g->first[jj] = (integer_t)total;
+  }
+
+  if (total > g->nentries) {
+    entries = (integer_t*)realloc(g->entries, total * sizeof(integer_t));
+    if (entries == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      return 1;
+    }
+    g->entries = entries;
+    g->nentries = total;
+  }
+
+  next = (integer_t*)malloc((size_t)nsy * sizeof(integer_t));
+  if (next == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    return 1;
+  }
+  memcpy(next, g->first, (size_t)nsy * sizeof(integer_t));
+  for (k = 0; k < npixel; ++k) {
+    if (gather_rows(g, k, &jjs, &jje)) {
+      for (jj = jjs; jj <= jje; ++jj) {
+        g->entries[next[jj]++] = (integer_t)k;
+      }
+    }
+  }
+  free(next);
+
+  return 0;
+}
+
+/**
+Drizzle with the point or turbo kernel by gathering onto each output
+pixel, rather than scattering from each input pixel, so that the
+threads share out the output rows and none writes a pixel another
+does.  The mapping runs only from the input to the output, so the
+input pixels are mapped first and listed under the output rows they
+reach, as doblot() maps its rows before reading them; each pixel of
+the output is then added to in input order, and the output is that
+of dobox_window().
+*/
+static int
+dobox_gather(struct driz_param_t* p, const integer_t ystart,
+             /* Output parameters */
+             integer_t* nmiss, integer_t* nskip,
+             struct driz_error_t* error) {
+  struct dobox_gather_t g;
+  struct footprint_t footprint;
+  struct driz_map_table_t map_table;
+  const double zero = 0.0;
+  integer_t np, k, pass, nmiss0, nskip0;
+  size_t npixel;
+  double t0 = 0.0;
+
+  memset(&g, 0, sizeof(g));
+  memset(&footprint, 0, sizeof(footprint));
+  memset(&map_table, 0, sizeof(map_table));
+
+  if (!p->no_over &&
+      chip_footprint(p, ystart + 1, ystart + p->ny, footprint_margin(p),
+                     &footprint, error)) {
+    return 1;
+  }
+  if (p->no_over) {
+    return dobox_window(p, ystart, 0, p->ny, &footprint, nmiss, nskip,
+                        error);
+  }
+
+  DRIZ_STATS_TIC(p->stats, t0);
+  nmiss0 = *nmiss;
+  nskip0 = *nskip;
+
+  /* As dobox_window() sets up the point and turbo kernels */
+  np = (p->uuid - 1) / 32 + 1;
+  p->bv = (integer_t)(1 << (p->uuid - 1 - (32 * (np - 1))));
+  p->nsx = p->xmax - p->xmin + 1;
+  p->nsy = p->ymax - p->ymin + 1;
+  p->ac = 1.0 / (p->pixel_fraction * p->pixel_fraction);
+  p->scale2 = p->scale * p->scale;
+  p->pfo = p->pixel_fraction / p->scale / 2.0;
+  p->pfo2 = p->pfo * p->pfo;
+  if (scale_input(p, error)) {
+    return 1;
+  }
+
+  pass = MAX((integer_t)1, DOBOX_GATHER_PIXELS / p->dnx);
+  pass = MIN(pass, p->ny);
+  npixel = (size_t)pass * (size_t)p->dnx;
+
+  g.p = p;
+  g.ystart = ystart;
+  g.params = (struct driz_param_t*)malloc((size_t)p->nthreads *
+                                          sizeof(struct driz_param_t));
+  g.stats = (struct driz_stats_t*)malloc((size_t)p->nthreads *
+                                         sizeof(struct driz_stats_t));
+  g.work = (double*)malloc((size_t)p->nthreads * 4 * (size_t)p->dnx *
+                           sizeof(double));
+  g.xo = (double*)malloc(npixel * sizeof(double));
+  g.yo = (double*)malloc(npixel * sizeof(double));
+  g.first = (integer_t*)malloc((size_t)(p->nsy + 1) * sizeof(integer_t));
+  if (g.params == NULL || g.stats == NULL || g.work == NULL ||
+      g.xo == NULL || g.yo == NULL || g.first == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto dobox_gather_exit_;
+  }
+  for (k = 0; k < p->nthreads; ++k) {
+    g.params[k] = *p;
+    driz_stats_init(&g.stats[k]);
+    g.params[k].stats = p->stats ? &g.stats[k] : NULL;
+  }
+
+  for (g.j0 = 0; g.j0 < p->ny; g.j0 += pass) {
+    g.nrow = MIN(pass, p->ny - g.j0);
+
+    /* Rows mapped ahead are mapped a pass at a time */
+    if (p->map_batch && p->mapping_callback != &default_mapping) {
+      map_table_free(&map_table);
+      if (map_table_fill(p, p->dnx, g.nrow, 1.0, p->x_scale,
+                         (double)(ystart + g.j0 + 1), 1, &zero, &zero,
+                         &map_table, error)) {
+        goto dobox_gather_exit_;
+      }
+      for (k = 0; k < p->nthreads; ++k) {
+        g.params[k].map_table = &map_table;
+      }
+    }
+
+    if (driz_parallel_for(p->nthreads, g.nrow, 1, &gather_map, &g, error) ||
+        gather_list(&g, nmiss, nskip, error)) {
+      goto dobox_gather_exit_;
+    }
+
+    if (driz_parallel_for(p->nthreads, p->nsy, 1, &gather_rows_add, &g,
+                          error)) {
+      goto dobox_gather_exit_;
+    }
+  }
+
+  if (p->stats) {
+    for (k = 0; k < p->nthreads; ++k) {
+      driz_stats_add_times(p->stats, &g.stats[k]);
+    }
+    DRIZ_STATS_ADD(p->stats, nhit, p->dnx * p->ny - (*nmiss - nmiss0));
+    DRIZ_STATS_ADD(p->stats, nmiss, *nmiss - nmiss0);
+    DRIZ_STATS_ADD(p->stats, nskip, *nskip - nskip0);
+    DRIZ_STATS_TOC(p->stats, total_time, t0);
+  }
+
+ dobox_gather_exit_:
+  map_table_free(&map_table);
+  free(g.params);
+  free(g.stats);
+  free(g.work);
+  free(g.xo);
+  free(g.yo);
+  free(g.first);
+  free(g.entries);
+
+  return driz_error_is_set(error);
+}
+
+/* log2 of the edge of the tiles in which each thread of a scatter
+   collects what it drizzles, and the tiles it holds before adding
+   them to the output */
+#define DOBOX_SCATTER_SHIFT 6
+#define DOBOX_SCATTER_TILES 64
+
+/** Input rows in the smallest run drizzled by one thread of a scatter */
+#define DOBOX_MIN_RUN 4
+
+/**
+A drizzle shared out among threads by runs of input rows, each thread
+drizzling into sparse tiles of its own, which are added to the output
+when enough of them have been touched, and at the end.
+*/
+struct dobox_scatter_t {
+  struct driz_param_t* p;
+  integer_t ystart;
+  struct footprint_t footprint;
+  /* A copy of p for each thread, drizzling into its tiles, and where
+     it records its time */
+  struct driz_param_t* params;
+  struct driz_stats_t* stats;
+  struct driz_tiles_t* caches;
+  integer_t ncaches;
+  /* A spinlock for each tile of the window, when the output holds
+     the weighted mean */
+  char* locks;
+  /* The pixels and rows that each thread finds to miss */
+  integer_t* counts;
+};
+
+/**
+Add the tiles of \a cache to the output and empty it.  Where the
+output holds sums, the weighted data and weights are added with
+atomic adds, pixel by pixel.  Where it holds the weighted mean, which
+is updated from the weight and the mean together, each tile of the
+output is locked while a tile is merged into it.  The context bits
+are set with an atomic or.
+*/
+static void
+scatter_flush(struct dobox_scatter_t* s, struct driz_tiles_t* cache) {
+  const struct driz_param_t* p = s->p;
+  const integer_t edge = (integer_t)1 << cache->shift;
+  const struct driz_tile_t* tile;
+  float* data;
+  float* counts;
+  integer_t* context;
+  integer_t i, x0, y0, nx, ny, x, y;
+  size_t k, offset;
+  double vc, w;
+
+  for (i = 0; i < cache->ntx * cache->nty; ++i) {
+    tile = cache->tiles[i];
+    if (tile == NULL) {
+      continue;
+    }
+
+    x0 = (i % cache->ntx) * edge;
+    y0 = (i / cache->ntx) * edge;
+    nx = MIN(edge, cache->onx - x0);
+    ny = MIN(edge, cache->ony - y0);
+    if (!p->output_sum) {
+      driz_spin_lock(&s->locks[i]);
+    }
+    for (y = 0; y < ny; ++y) {
+      offset = (size_t)(y0 + y) * (size_t)p->onx + (size_t)x0;
+      data = p->output_data + offset;
+      counts = p->output_counts + offset;
+      context = p->output_context ? p->output_context + offset : NULL;
+      k = (size_t)y << cache->shift;
+      for (x = 0; x < nx; ++x, ++k) {
+        if (context && tile->context[k]) {
+          driz_atomic_or(&context[x], tile->context[k]);
+        }
+        if (tile->counts[k] == 0.0f) {
+          continue;
+        }
+        if (p->output_sum) {
+          driz_atomic_add_float(&data[x], tile->data[k]);
+          driz_atomic_add_float(&counts[x], tile->counts[k]);
+        } else {
+          vc = counts[x];
+          w = vc + tile->counts[k];
+          data[x] = vc == 0.0 ? (float)(tile->data[k] / w) :
+            (float)((data[x] * vc + tile->data[k]) / w);
+          counts[x] = (float)w;
+        }
+      }
+    }
+    if (!p->output_sum) {
+      driz_spin_unlock(&s->locks[i]);
+    }
+  }
+
+  driz_tiles_clear(cache);
+}
+
+/**
+Drizzle input rows begin to end - 1 into the tiles of the thread,
+adding them to the output once more than DOBOX_SCATTER_TILES are
+held.
+*/
+static int
+scatter_rows(void* state, const integer_t worker,
+             const integer_t begin, const integer_t end,
+             /* Output parameters */
+             struct driz_error_t* error) {
+  struct dobox_scatter_t* s = (struct dobox_scatter_t*)state;
+  const struct driz_param_t* p = s->p;
+  struct driz_param_t* q = &s->params[worker];
+  struct driz_tiles_t* cache = &s->caches[worker];
+
+  q->no_over = FALSE;
+  q->data_raw = p->data_raw;
+  q->data_format = p->data_format;
+  q->lanczos.lut = NULL;
+  q->map_table = p->map_table;
+
+  if (dobox_window(q, s->ystart, begin, end, &s->footprint,
+                   &s->counts[2 * worker], &s->counts[2 * worker + 1],
+                   error)) {
+    return 1;
+  }
+  if (cache->ntouched > DOBOX_SCATTER_TILES) {
+    scatter_flush(s, cache);
+  }
+
+  return 0;
+}
+
+/** Add what is left in the tiles of threads begin to end - 1 */
+static int
+scatter_flush_caches(void* state, const integer_t worker UNUSED_PARAM,
+                     const integer_t begin, const integer_t end,
+                     /* Output parameters */
+                     struct driz_error_t* error UNUSED_PARAM) {
+  struct dobox_scatter_t* s = (struct dobox_scatter_t*)state;
+  integer_t k;
+
+  for (k = begin; k < end; ++k) {
+    scatter_flush(s, &s->caches[k]);
+  }
+
+  return 0;
+}
+
+/**
+Drizzle with p->nthreads threads sharing out the rows of the input,
+rather than the output, so that no thread drizzles a row that lands
+off its share, as bands of output rows do for rows that cross them.
+Each thread drizzles the sums of its rows into tiles of its own, the
+weighted data and the weight of each pixel, and adds them to the
+output, whichever thread is adding to it at the same time; see
+scatter_flush().  Each pixel gets the same contributions as with one
+thread, added in another order, so that the output is the same to
+rounding; nmiss and nskip are exact.
+*/
+static int
+dobox_scatter(struct driz_param_t* p, const integer_t ystart,
+              /* Output parameters */
+              integer_t* nmiss, integer_t* nskip,
+              struct driz_error_t* error) {
+  struct dobox_scatter_t s;
+  struct driz_map_table_t map_table;
+  integer_t k, margin, nmiss0, nskip0;
+  double t0 = 0.0;
+
+  memset(&s, 0, sizeof(s));
+  memset(&map_table, 0, sizeof(map_table));
+
+  margin = footprint_margin(p);
+  if (!p->no_over &&
+      chip_footprint(p, ystart + 1, ystart + p->ny, margin, &s.footprint,
+                     error)) {
+    return 1;
+  }
+  if (p->no_over) {
+    return dobox_window(p, ystart, 0, p->ny, &s.footprint, nmiss, nskip,
+                        error);
+  }
+
+  DRIZ_STATS_TIC(p->stats, t0);
+  nmiss0 = *nmiss;
+  nskip0 = *nskip;
+
+  s.p = p;
+  s.ystart = ystart;
+  s.params = (struct driz_param_t*)malloc((size_t)p->nthreads *
+                                          sizeof(struct driz_param_t));
+  s.stats = (struct driz_stats_t*)malloc((size_t)p->nthreads *
+                                         sizeof(struct driz_stats_t));
+  s.caches = (struct driz_tiles_t*)malloc((size_t)p->nthreads *
+                                          sizeof(struct driz_tiles_t));
+  s.counts = (integer_t*)calloc((size_t)p->nthreads * 2, sizeof(integer_t));
+  if (s.params == NULL || s.stats == NULL || s.caches == NULL ||
+      s.counts == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto dobox_scatter_exit_;
+  }
+  for (k = 0; k < p->nthreads; ++k) {
+    if (driz_tiles_init(&s.caches[k], p->xmax - p->xmin + 1,
+                        p->ymax - p->ymin + 1, DOBOX_SCATTER_SHIFT, 1, NULL,
+                        0, error)) {
+      goto dobox_scatter_exit_;
+    }
+    ++s.ncaches;
+    s.params[k] = *p;
+    s.params[k].output_tiles = &s.caches[k];
+    s.params[k].output_sum = TRUE;
+    driz_stats_init(&s.stats[k]);
+    s.params[k].stats = p->stats ? &s.stats[k] : NULL;
+  }
+  s.locks = (char*)calloc((size_t)s.caches[0].ntx * (size_t)s.caches[0].nty,
+                          1);
+  if (s.locks == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto dobox_scatter_exit_;
+  }
+
+  /* The rows are mapped once for all the threads, by all of them */
+  if (p->map_batch && p->mapping_callback != &default_mapping) {
+    if (map_rows_ahead(p, &s.footprint, ystart, margin, &map_table, error)) {
+      goto dobox_scatter_exit_;
+    }
+    p->map_table = &map_table;
+  }
+
+  if (driz_parallel_for(p->nthreads, p->ny, DOBOX_MIN_RUN, &scatter_rows, &s,
+                        error) ||
+      driz_parallel_for(p->nthreads, p->nthreads, 1, &scatter_flush_caches,
+                        &s, error)) {
+    goto dobox_scatter_exit_;
+  }
+
+  for (k = 0; k < p->nthreads; ++k) {
+    *nmiss += s.counts[2 * k];
+    *nskip += s.counts[2 * k + 1];
+  }
+  if (p->stats) {
+    for (k = 0; k < p->nthreads; ++k) {
+      driz_stats_add_times(p->stats, &s.stats[k]);
+    }
+    DRIZ_STATS_ADD(p->stats, nhit, p->dnx * p->ny - (*nmiss - nmiss0));
+    DRIZ_STATS_ADD(p->stats, nmiss, *nmiss - nmiss0);
+    DRIZ_STATS_ADD(p->stats, nskip, *nskip - nskip0);
+    DRIZ_STATS_TOC(p->stats, total_time, t0);
+  }
+
+ dobox_scatter_exit_:
+  p->map_table = NULL;
+  map_table_free(&map_table);
+  for (k = 0; k < s.ncaches; ++k) {
+    driz_tiles_free(&s.caches[k]);
+  }
+  free(s.params);
+  free(s.stats);
+  free(s.caches);
+  free(s.counts);
+  free(s.locks);
+
+  return driz_error_is_set(error);
+}
+
+/**
+This module does the actual mapping of input flux to output images
+using "boxer", a code written by Bill Sparks for FOC geometric
+distortion correction, rather than the "drizzling" approximation.
+
+This works by calculating the positions of the four corners of a
+quadrilateral on the output grid corresponding to the corners of the
+input pixel and then working out exactly how much of each pixel in the
+output is covered, or not.
+
+In V1.6 this was simplified to use the DRIVAL routine and also to
+include some limited multi-kernel support.
+
+The input may be a strip of p->ny rows of the image, rows ystart + 1
+to ystart + p->ny, so that an image can be drizzled a strip at a time
+onto the same output.
+
+With p->nthreads above 1, the window is cut into bands of output
+rows drizzled by the threads of driz_parallel_for(), so that no two
+threads write the same output pixel and the output is the same as
+with one thread.  The centres of the input pixels are first mapped,
+by the same threads, to find for each band the runs of each row that
+may reach it.  nmiss and nskip then count the pixels whose centres
+land off the window and the rows that cannot reach it, without what
+the kernels find to miss at its edges.  A sparse output, or a context
+table, is drizzled by the calling thread alone.
+
+With p->parallel set to parallel_gather, the point and turbo kernels
+instead gather onto each output pixel what lands on it, by any number
+of threads, which share out the output rows; see dobox_gather().
+nmiss is then that of one thread, and nskip counts the rows of the
+input that miss the window altogether.
+
+With p->parallel set to parallel_atomic, the threads instead share out
+the input rows and add what they drizzle to the output as it comes;
+see dobox_scatter().  This suits an input small beside the output,
+whose rows cross many bands.  Removing an image still goes by bands.
+*/
+int
+dobox(struct driz_param_t* p, const integer_t ystart,
+      /* Output parameters */
+      integer_t* nmiss, integer_t* nskip, struct driz_error_t* error) {
+  struct dobox_bands_t bands;
+  struct driz_map_table_t map_table;
+  integer_t k, nmiss0, nskip0;
+  double t0 = 0.0;
+
+  assert(p);
+  assert(nmiss);
+  assert(nskip);
+  assert(error);
+
+  DRIZLOG("-Drizzling using kernel = %s\n",kernel_enum2str(p->kernel));
+
+  if (p->output_tiles != NULL || p->output_done != NULL) {
+    return dobox_window(p, ystart, 0, p->ny, NULL, nmiss, nskip, error);
+  }
+  if (p->parallel == parallel_gather &&
+      (p->kernel == kernel_point || p->kernel == kernel_turbo)) {
+    return dobox_gather(p, ystart, nmiss, nskip, error);
+  }
+  if (p->nthreads <= 1) {
+    return dobox_window(p, ystart, 0, p->ny, NULL, nmiss, nskip, error);
+  }
+#ifdef DRIZ_HAVE_ATOMICS
+  /* Taking an image back off the output needs the weights it left */
+  if (p->parallel == parallel_atomic && p->weight_scale >= 0.0f) {
+    return dobox_scatter(p, ystart, nmiss, nskip, error);
+  }
+#endif
+
+  memset(&bands, 0, sizeof(bands));
+  memset(&map_table, 0, sizeof(map_table));
+
+  DRIZ_STATS_TIC(p->stats, t0);
+
+  bands.p = p;
+  bands.ystart = ystart;
+  bands.margin = footprint_margin(p);
+  if (!p->no_over &&
+      chip_footprint(p, ystart + 1, ystart + p->ny, bands.margin,
+                     &bands.footprint, error)) {
+    return 1;
+  }
+  if (p->no_over) {
+    return dobox_window(p, ystart, 0, p->ny, &bands.footprint, nmiss, nskip,
+                        error);
+  }
+
+  bands.footprint.full = FALSE;
+  bands.footprint.nspan = (p->dnx + FOOTPRINT_SPAN - 1) / FOOTPRINT_SPAN;
+  bands.footprint.ystart = ystart;
+  bands.params = (struct driz_param_t*)malloc((size_t)p->nthreads *
+                                              sizeof(struct driz_param_t));
+  bands.stats = (struct driz_stats_t*)malloc((size_t)p->nthreads *
+                                             sizeof(struct driz_stats_t));
+  bands.work = (double*)malloc((size_t)p->nthreads * 6 * (size_t)p->dnx *
+                               sizeof(double));
+  bands.counts = (integer_t*)calloc((size_t)p->nthreads * 2,
+                                    sizeof(integer_t));
+  bands.spans = (double*)malloc((size_t)p->ny *
+                                (size_t)bands.footprint.nspan * 4 *
+                                sizeof(double));
+  if (bands.params == NULL || bands.stats == NULL || bands.work == NULL ||
+      bands.counts == NULL || bands.spans == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto dobox_exit_;
+  }
+  bands.footprint.spans = bands.spans;
+  for (k = 0; k < p->nthreads; ++k) {
+    bands.params[k] = *p;
+    driz_stats_init(&bands.stats[k]);
+    bands.params[k].stats = p->stats ? &bands.stats[k] : NULL;
+  }
+
+  if (driz_parallel_for(p->nthreads, p->ny, 1, &dobox_spans, &bands,
+                        error)) {
+    goto dobox_exit_;
+  }
+
+  /* What misses the window as a whole, which no band knows */
+  nmiss0 = *nmiss;
+  nskip0 = *nskip;
+  for (k = 0; k < p->nthreads; ++k) {
+    *nmiss += bands.counts[2 * k];
+    *nskip += bands.counts[2 * k + 1];
+  }
+
+  /* The rows are mapped once for all the bands, by all the threads */
+  if (p->map_batch && p->mapping_callback != &default_mapping) {
+    if (map_rows_ahead(p, &bands.footprint, ystart, bands.margin,
+                       &map_table, error)) {
+      goto dobox_exit_;
+    }
+    p->map_table = &map_table;
+  }
+
+  if (driz_parallel_for(p->nthreads, p->ymax - p->ymin + 1, DOBOX_MIN_BAND,
+                        &dobox_band, &bands, error)) {
+    goto dobox_exit_;
+  }
+
+  if (p->stats) {
+    for (k = 0; k < p->nthreads; ++k) {
+      driz_stats_add_times(p->stats, &bands.stats[k]);
+    }
+    DRIZ_STATS_ADD(p->stats, nhit, p->dnx * p->ny - (*nmiss - nmiss0));
+    DRIZ_STATS_ADD(p->stats, nmiss, *nmiss - nmiss0);
+    DRIZ_STATS_ADD(p->stats, nskip, *nskip - nskip0);
+    DRIZ_STATS_TOC(p->stats, total_time, t0);
+  }
+
+ dobox_exit_:
+  p->map_table = NULL;
+  map_table_free(&map_table);
+  free(bands.params);
+  free(bands.stats);
+  free(bands.work);
+  free(bands.counts);
+  free(bands.spans);
+
+  return driz_error_is_set(error);
+}
@@ -3,6 +3,10 @@
 
 #include "cdrizzleutil.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
 dobox
 
@@ -17,9 +21,17 @@ output is covered, or not.
 
 In V1.6 this was simplified to use the DRIVAL routine and also to
 include some limited multi-kernel support.
+
+The input may be a strip of p->ny rows of the image, rows ystart + 1
+to ystart + p->ny, so that an image can be drizzled a strip at a time
+onto the same output.
 */
 int
 dobox(struct driz_param_t* p, const integer_t ystart, integer_t* nmiss,
       integer_t* nskip, struct driz_error_t* error);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* CDRIZZLEBOX_H */
@@ -1,154 +1,31 @@
-#define NO_IMPORT_ARRAY
-#define NO_IMPORT_ASTROPY_WCS_API
 #include "driz_portability.h"
-#include "astropy_wcs_api.h"
 
 #define _USE_MATH_DEFINES       /* needed for MS Windows to define M_PI */
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "cdrizzlemap.h"
+#include "cdrizzlesched.h"
 #include "cdrizzlewcs.h"
 
 
-static inline_macro int
-drizzle_polynomial(void* state,
-                   const double xd, const double yd,
-                   const integer_t n,
-                   const double* xin /*[n]*/, const double* yin /*[n]*/,
-                   /* Output parameters */
-                   double* xout, double* yout,
-                   struct driz_error_t* error) {
-  struct mapping_param_t* m = (struct mapping_param_t*)state;
-  double xdoff, ydoff;
-  integer_t i;
-  bool_t new_reference;
-
-  /* Check for the presence of "refpix" additional information in the
-     coefficients.  If it is, set a flag and offset again */
-  if (m->coeff_type > COEFF_OFFSET / 2) {
-    new_reference = TRUE;
-    m->coeff_type -= COEFF_OFFSET;
-    xdoff = m->xcen - m->x_coeffs[m->num_coeffs - 1] + 1.0;
-    ydoff = m->ycen - m->y_coeffs[m->num_coeffs - 1] + 1.0;
-    m->num_coeffs--;
-  } else {
-    new_reference = FALSE;
-    xdoff = 2.0;
-    ydoff = 2.0;
-  }
-
-  if (m->coeff_type == 3) {
-    for (i = 0; i < n; ++i) {
-      xout[i] = eval3(xin[i] + xdoff, yin[i] + ydoff, m->x_coeffs) - xdoff;
-      yout[i] = eval3(xin[i] + xdoff, yin[i] + ydoff, m->y_coeffs) - ydoff;
-    }
-  } else if (m->coeff_type == 4) {
-    for (i = 0; i < n; ++i) {
-      xout[i] = eval4(xin[i] + xdoff, yin[i] + ydoff, m->x_coeffs) - xdoff;
-      yout[i] = eval4(xin[i] + xdoff, yin[i] + ydoff, m->y_coeffs) - ydoff;
-    }
-  } else if (m->coeff_type == 5) {
-    for (i = 0; i < n; ++i) {
-      xout[i] = eval5(xin[i] + xdoff, yin[i] + ydoff, m->x_coeffs) - xdoff;
-      yout[i] = eval5(xin[i] + xdoff, yin[i] + ydoff, m->y_coeffs) - ydoff;
-    }
-  } else if (m->coeff_type >= 6 || m->coeff_type == 1 || m->coeff_type == 2) {
-    for (i = 0; i < n; ++i) {
-      if (evaln(xin[i] + xdoff, yin[i] + ydoff, m->x_coeffs, m->coeff_type, &xout[i], error) ||
-          evaln(xin[i] + xdoff, yin[i] + ydoff, m->y_coeffs, m->coeff_type, &yout[i], error))
-        return 1;
-      xout[i] -= xdoff;
-      yout[i] -= ydoff;
-    }
-  } else if (m->coeff_type == -3) {
-    for (i = 0; i < n; ++i) {
-      rad3(xin[i] + xdoff, yin[i] + ydoff, m->x_coeffs, &xout[i], &yout[i]);
-      xout[i] -= xdoff;
-      yout[i] -= ydoff;
-    }
-  } else {
-    driz_error_format_message(error, "Invalid coefficient type %d", m->coeff_type);
-    return 1;
-  }
-
-  if (new_reference) {
-    m->coeff_type += COEFF_OFFSET;
-    m->num_coeffs++;
-  }
-
-  return 0;
-}
-
-static inline_macro int
-drizzle_distortion_image(void* state,
-                         const double xd, const double yd,
-                         const integer_t n,
-                         const double* xin /*[n]*/, const double* yin /*[n]*/,
-                         /* Output parameters */
-                         double* xout, double* yout,
-                         struct driz_error_t* error) {
-  struct mapping_param_t* m = (struct mapping_param_t*)state;
-  integer_t ix, iy;
-  integer_t i;
-
-  if (m->use_distortion_image) {
-    for (i = 0; i < n; ++i) {
-      ix = (integer_t)(xin[i] + 1.0 - xd + m->xcen) - 1;
-      iy = (integer_t)(yin[i] + 1.0 - yd + m->ycen) - 1;
-      xout[i] += (double)(*x_distortion_ptr(m, ix, iy));
-      yout[i] += (double)(*y_distortion_ptr(m, ix, iy));
-    }
-  }
-
-  return 0;
-}
-
-static inline_macro int
-drizzle_alpha_beta(void* state,
-                   const double xd, const double yd,
-                   const integer_t n,
-                   const double* xin /*[n]*/, const double* yin /*[n]*/,
-                   /* Output parameters */
-                   double* xout, double* yout,
-                   struct driz_error_t* error) {
-  /* TODO: There is definitely something fishy in the original here
-     since the x in in the first line will have an effect in the
-     second.  We use xout and yout temporaries here to eliminate that. */
-  struct mapping_param_t* m = (struct mapping_param_t*)state;
-  double xt, yt, xa, ya;
-  integer_t i;
-
-  if (m->alpha != 0.0 || m->beta != 0.0) {
-    for (i = 0; i < n; ++i) {
-      xa = (xin[i] + 1.0 - m->xcen) / m->xcen;
-      ya = (yin[i] + 1.0 - m->ycen) / m->ycen;
-
-      xt = m->beta * xa + m->alpha * ya - 1.0;
-      yt = m->beta * ya + m->alpha * xa - 1.0;
-      xout[i] += xt;
-      yout[i] += yt;
-    }
-  }
-
-  return 0;
-}
-
-static inline_macro int
-drizzle_linear_or_secondary(void* state,
-                            const double xd, const double yd,
-                            const integer_t n,
-                            const double* xin /*[n]*/, const double* yin /*[n]*/,
-                            /* Output parameters */
-                            double* xout, double* yout,
-                            struct driz_error_t* error) {
-  struct mapping_param_t* m = (struct mapping_param_t*)state;
+/**
+Fold the linear transformation, and the secondary one when present,
+into the single 2x3 matrix m->linear.  This costs the sines and cosines
+of the rotations and, in WCS mode, the least-squares fit of
+wcs_derive_linear(), so it is done once and kept until
+mapping_param_changed().
+*/
+static int
+derive_linear(struct mapping_param_t* m, struct driz_error_t* error) {
   double xs, ys, xc, yc, xt, yt;
-  double xs2, ys2, xc2, yc2, xp2, yp2, xt2, yt2;
-  double xtmp, ytmp;
+  double xs2, ys2, xc2, yc2;
   double sinth, costh, xf, yf, xoff, yoff;
-  integer_t i;
+  double dx, dy, ex, ey;
+  double a, b, c, d, e, f;
+  double* l = m->linear;
 
   sinth = sin(m->rotation);
   costh = cos(m->rotation);
@@ -170,54 +47,155 @@ drizzle_linear_or_secondary(void* state,
     m->do_shift_first = shift_input;
   }
 
+  /* There are two ways the linear transform can be done - shift then
+     rotate or rotate then shift.  Either way it is a rotation of
+     (x + dx, y + dy) followed by a shift of (ex, ey). */
   if (m->has_secondary_parameters) {
+    if (m->do_shift_first == shift_input) {
+      dx = dy = 1.0;
+      ex = xt - m->xp;
+      ey = yt - m->yp;
+    } else {
+      dx = 1.0 + m->x_shift;
+      dy = 1.0 + m->y_shift;
+      ex = ey = 0.0;
+    }
+  } else if (m->do_shift_first == shift_output) {
+    dx = dy = 1.0;
+    ex = xt - 1.0;
+    ey = yt - 1.0;
+  } else {
+    dx = 1.0 + m->x_shift;
+    dy = 1.0 + m->y_shift;
+    ex = m->xp - 1.0;
+    ey = m->yp - 1.0;
+  }
+
+  l[0] = xc;
+  l[1] = -ys;
+  l[2] = xc * dx - ys * dy + ex;
+
+  if (!m->has_secondary_parameters) {
+    /* Without secondary parameters the original transformed the
+       points in place, so that y was rotated with the x already
+       transformed rather than the x given.  That is kept, folded into
+       the matrix, so that the results are unchanged. */
+    l[3] = xs * l[0];
+    l[4] = xs * l[1] + yc;
+    l[5] = xs * (l[2] + dx) + yc * dy + ey;
+  } else {
+    l[3] = xs;
+    l[4] = yc;
+    l[5] = xs * dx + yc * dy + ey;
+
     xs2 = ys2 = sin(m->rotation2);
     xc2 = yc2 = cos(m->rotation2);
-    xp2 = m->xp;
-    yp2 = m->yp;
-    xt2 = xp2 + m->x_shift2;
-    yt2 = yp2 + m->y_shift2;
 
-    for (i = 0; i < n; ++i) {
-      /* Apply the linear transform
-         There are two ways this can be done - shift then
-         rotate or rotate then shift */
-      if (m->do_shift_first == shift_input) {
-        xtmp = xc * (xin[i] + 1.0) - ys * (yin[i] + 1.0) + xt - m->xp;
-        ytmp = xs * (xin[i] + 1.0) + yc * (yin[i] + 1.0) + yt - m->yp;
-      } else {
-        xtmp = xc * (xin[i] + 1.0 + m->x_shift) - ys * (yin[i] + 1.0 + m->y_shift);
-        ytmp = xs * (xin[i] + 1.0 + m->x_shift) + yc * (yin[i] + 1.0 + m->y_shift);
-      }
-
-      /* Apply the secondary transform */
-      if (m->do_shift2_first == shift_output) {
-        xout[i] = xc2 * xtmp - ys2 * ytmp + xt2 - 1.0;
-        yout[i] = xs2 * xtmp + yc2 * ytmp + yt2 - 1.0;
-      } else {
-        xout[i] = xc2 * (xtmp + m->x_shift2) -
-          ys2 * (ytmp + m->y_shift2) + xp2 - 1.0;
-        yout[i] = xs2 * (xtmp + m->x_shift2) +
-          yc2 * (ytmp + m->y_shift2) + yp2 - 1.0;
-      }
-    }
-  } else {
-    if (m->do_shift_first == shift_output) {
-      for (i = 0; i < n; ++i) {
-        xout[i] = xc * (xin[i] + 1.0) - ys * (yin[i] + 1.0) + xt - 1.0;
-        yout[i] = xs * (xin[i] + 1.0) + yc * (yin[i] + 1.0) + yt - 1.0;
-      }
+    if (m->do_shift2_first == shift_output) {
+      dx = dy = 0.0;
+      ex = m->xp + m->x_shift2 - 1.0;
+      ey = m->yp + m->y_shift2 - 1.0;
     } else {
-      for (i = 0; i < n; ++i) {
-        xout[i] = xc * (xin[i] + 1.0 + m->x_shift) - ys * (yin[i] + 1.0 + m->y_shift) + m->xp - 1.0;
-        yout[i] = xs * (xin[i] + 1.0 + m->x_shift) + yc * (yin[i] + 1.0 + m->y_shift) + m->yp - 1.0;
-      }
+      dx = m->x_shift2;
+      dy = m->y_shift2;
+      ex = m->xp - 1.0;
+      ey = m->yp - 1.0;
     }
+
+    /* Apply the secondary transform to the primary one */
+    a = l[0];
+    b = l[1];
+    c = l[2] + dx;
+    d = l[3];
+    e = l[4];
+    f = l[5] + dy;
+    l[0] = xc2 * a - ys2 * d;
+    l[1] = xc2 * b - ys2 * e;
+    l[2] = xc2 * c - ys2 * f + ex;
+    l[3] = xs2 * a + yc2 * d;
+    l[4] = xs2 * b + yc2 * e;
+    l[5] = xs2 * c + yc2 * f + ey;
   }
 
+  m->got_linear = TRUE;
+
   return 0;
 }
 
+/* How far, in input pixels, a point may lie from a node of a
+   driz_map_table_t and still be looked up there; only the rounding of
+   the coordinates is forgiven */
+#define MAP_TABLE_TOLERANCE 1e-9
+
+/**
+Find the node of \a table at the point (x, y), returning FALSE if
+there is none.
+*/
+static inline_macro bool_t
+map_table_node(const struct driz_map_table_t* table,
+               const double x, const double y,
+               /* Output parameters */
+               size_t* index) {
+  const double tol = MAP_TABLE_TOLERANCE;
+  double u, v, fi, fj;
+  integer_t l;
+
+  for (l = 0; l < table->nlattice; ++l) {
+    u = (x - table->x0 - table->xoff[l]) / table->dx;
+    v = y - table->y0 - table->yoff[l];
+    fi = floor(u + 0.5);
+    fj = floor(v + 0.5);
+    if (fabs(u - fi) <= tol && fabs(v - fj) <= tol &&
+        fi >= 0.0 && fi < (double)table->nx &&
+        fj >= 0.0 && fj < (double)table->ny) {
+      *index = ((size_t)l * (size_t)table->ny + (size_t)fj) *
+        (size_t)table->nx + (size_t)fi;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+Look the n points up in \a table, returning FALSE, with the output
+partly filled in, as soon as one is not a node of any of its lattices.
+The points of a regular row are found from the first alone.
+*/
+static bool_t
+map_table_lookup(const struct driz_map_table_t* table,
+                 const bool_t regular, const integer_t n,
+                 const double* xin /*[n]*/, const double* yin /*[n]*/,
+                 /* Output parameters */
+                 double* xout /*[n]*/, double* yout /*[n]*/) {
+  size_t index;
+  integer_t k;
+
+  if (table->x == NULL || n <= 0) {
+    return FALSE;
+  }
+
+  if (regular) {
+    if (!map_table_node(table, xin[0], yin[0], &index) ||
+        (integer_t)(index % (size_t)table->nx) + n > table->nx) {
+      return FALSE;
+    }
+    memcpy(xout, table->x + index, (size_t)n * sizeof(double));
+    memcpy(yout, table->y + index, (size_t)n * sizeof(double));
+    return TRUE;
+  }
+
+  for (k = 0; k < n; ++k) {
+    if (!map_table_node(table, xin[k], yin[k], &index)) {
+      return FALSE;
+    }
+    xout[k] = table->x[index];
+    yout[k] = table->y[index];
+  }
+
+  return TRUE;
+}
+
 int
 map_value(struct driz_param_t* p,
           const bool_t regular,
@@ -228,6 +206,7 @@ map_value(struct driz_param_t* p,
           double* xout /*[n]*/, double* yout /*[n]*/,
           struct driz_error_t* error) {
   double x, y, xd, yd;
+  double t0 = 0.0;
   integer_t i;
 
   assert(p);
@@ -246,6 +225,17 @@ map_value(struct driz_param_t* p,
   assert(ytmp != yout);
   assert(error);
 
+  if (regular && p->mapping_callback == &default_mapping) {
+    /* The default mapping generates the row itself */
+    DRIZ_STATS_TIC(p->stats, t0);
+    if (default_mapping_row(p->mapping_callback_state, xin[0], yin[1], n,
+                            xin[0], p->x_scale, yin[0], xout, yout, error))
+      return 1;
+    DRIZ_STATS_TOC(p->stats, map_time, t0);
+    DRIZ_STATS_ADD(p->stats, nmap, n);
+    return 0;
+  }
+
   if (regular) {
     /* x = xin[0] - p->x_scale + 1.0; */
     /* y = yin[0] + yin[1] + 2.0; */
@@ -270,365 +260,571 @@ map_value(struct driz_param_t* p,
     }
   }
 
+  /* Points mapped ahead of time are only looked up */
+  if (p->map_table != NULL &&
+      map_table_lookup(p->map_table, regular, n, xtmp, ytmp, xout, yout)) {
+    return 0;
+  }
+
+  DRIZ_STATS_TIC(p->stats, t0);
   if (p->mapping_callback(p->mapping_callback_state, xd, yd, n,
                           xtmp, ytmp, xout, yout, error))
     return 1;
+  DRIZ_STATS_TOC(p->stats, map_time, t0);
+  DRIZ_STATS_ADD(p->stats, nmap, n);
 
   return 0;
 }
 
+/** The points of a map_table_fill() and where their mapping goes */
+struct map_table_work_t {
+  struct driz_param_t* p;
+  integer_t nx;
+  double* xin;
+  double* yin;
+  struct driz_map_table_t* table;
+};
+
+/** Map rows begin to end - 1 of the lattices of a table */
 static int
-default_wcsmap_direct(struct wcsmap_param_t* m,
-                      const double xd, const double yd,
-                      const integer_t n,
-                      double* xin /*[n]*/, double* yin /*[n]*/,
-                      /* Output parameters */
-                      double* xout, double* yout,
-                      struct driz_error_t* error) {
-
-  integer_t  i;
-  int        status;
-  double    *memory = NULL;
-  double    *ptr    = NULL;
-  double    *xyin   = NULL;
-  double    *skyout = NULL;
-  double    *xyout  = NULL;
-  double    *imgcrd = NULL;
-  double    *phi    = NULL;
-  double    *theta  = NULL;
-  int       *stat   = NULL;
-
-  /* Allocate memory for new 2-D array */
-  ptr = memory = (double *) malloc(n * 10 * sizeof(double));
-  if (memory == NULL) return 1;
-
-  xyin = ptr;
-  ptr += n * 2;
-  xyout = ptr;
-  ptr += n * 2;
-  skyout = ptr;
-  ptr += n * 2;
-  imgcrd = ptr;
-  ptr += n * 2;
-  phi = ptr;
-  ptr += n;
-  theta = ptr;
-
-  stat = (int *)malloc(n * sizeof(int));
-  if (stat == NULL) {
-      free(memory);
-      return 1;
-  }
+map_table_rows(void* state, const integer_t worker UNUSED_PARAM,
+               const integer_t begin, const integer_t end,
+               /* Output parameters */
+               struct driz_error_t* error) {
+  struct map_table_work_t* w = (struct map_table_work_t*)state;
+  const size_t k = (size_t)begin * (size_t)w->nx;
 
-  /* The input arrays need to be converted to 2-D arrays for input
-     to the PyWCS (and related) functions. */
+  return w->p->mapping_callback(w->p->mapping_callback_state, 0.0, 0.0,
+                                (end - begin) * w->nx, w->xin + k, w->yin + k,
+                                w->table->x + k, w->table->y + k, error);
+}
 
-  /* Populate new 2-D array with values from x and y input arrays */
-  for (i = 0; i < n; ++i) {
-    xyin[2*i] = xin[i];
-    xyin[2*i+1] = yin[i];
+int
+map_table_fill(struct driz_param_t* p,
+               const integer_t nx, const integer_t ny,
+               const double x0, const double dx, const double y0,
+               const integer_t nlattice,
+               const double* xoff /*[nlattice]*/,
+               const double* yoff /*[nlattice]*/,
+               /* Output parameters */
+               struct driz_map_table_t* table,
+               struct driz_error_t* error) {
+  const size_t npoint = (size_t)nlattice * (size_t)nx * (size_t)ny;
+  double* xin = NULL;
+  double* yin = NULL;
+  struct map_table_work_t work;
+  double x, y;
+  double t0 = 0.0;
+  integer_t i, j, l;
+  size_t k;
+  int status = 1;
+
+  assert(p);
+  assert(p->mapping_callback);
+  assert(nlattice >= 1 && nlattice <= 4);
+  assert(xoff);
+  assert(yoff);
+  assert(table);
+  assert(error);
+
+  table->nx = nx;
+  table->ny = ny;
+  table->nlattice = nlattice;
+  table->x0 = x0;
+  table->dx = dx;
+  table->y0 = y0;
+  for (l = 0; l < nlattice; ++l) {
+    table->xoff[l] = xoff[l];
+    table->yoff[l] = yoff[l];
   }
+  table->x = NULL;
+  table->y = NULL;
 
-  /*
-    Apply pix2sky() transformation from PyWCS
-  */
+  if (npoint == 0) {
+    return 0;
+  }
 
-  wcsprm_python2c(m->input_wcs->wcs);
-  status = pipeline_all_pixel2world(m->input_wcs, n, 2, xyin, skyout);
-  wcsprm_c2python(m->input_wcs->wcs);
-  if (status) {
-    free(memory);
-    free(stat);
-    return 1;
+  xin = (double*)malloc(npoint * sizeof(double));
+  yin = (double*)malloc(npoint * sizeof(double));
+  table->x = (double*)malloc(npoint * sizeof(double));
+  table->y = (double*)malloc(npoint * sizeof(double));
+  if (xin == NULL || yin == NULL || table->x == NULL || table->y == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    goto map_table_fill_exit_;
   }
 
-  /*
-    Finally, call wcs_sky2pix() for the output object.
-  */
-  wcsprm_python2c(m->output_wcs->wcs);
-  status = wcss2p(m->output_wcs->wcs, n, 2,
-                  skyout, phi, theta, imgcrd, xyout, stat);
-  wcsprm_c2python(m->output_wcs->wcs);
-  if (status) {
-    free(memory);
-    free(stat);
-    return 1;
+  k = 0;
+  for (l = 0; l < nlattice; ++l) {
+    for (j = 0; j < ny; ++j) {
+      y = y0 + yoff[l] + (double)j;
+      for (i = 0; i < nx; ++i, ++k) {
+        x = x0 + xoff[l] + (double)i * dx;
+        xin[k] = x;
+        yin[k] = y;
+      }
+    }
   }
 
-  /*
-    Transform results back to 2 1-D arrays, like the input.
-  */
-  for (i = 0; i < n; ++i){
-    xout[i] = xyout[2*i];
-    yout[i] = xyout[2*i+1];
+  /* In one call, or a run of rows at a time from each thread */
+  work.p = p;
+  work.nx = nx;
+  work.xin = xin;
+  work.yin = yin;
+  work.table = table;
+  DRIZ_STATS_TIC(p->stats, t0);
+  if (driz_parallel_for(p->nthreads, nlattice * ny, 1, &map_table_rows, &work,
+                        error))
+    goto map_table_fill_exit_;
+  DRIZ_STATS_TOC(p->stats, map_time, t0);
+  DRIZ_STATS_ADD(p->stats, nmap, (integer_t)npoint);
+
+  status = 0;
+
+ map_table_fill_exit_:
+  free(xin);
+  free(yin);
+  if (status) {
+    map_table_free(table);
   }
 
-  /* Free memory allocated to internal 2-D arrays */
-  free(memory);
-  free(stat);
-  return 0;
+  return status;
 }
 
-static int
-default_wcsmap_interpolate(struct wcsmap_param_t* m,
-                           const double xd, const double yd,
-                           const integer_t n,
-                           double* xin /*[n]*/, double* yin /*[n]*/,
-                           /* Output parameters */
-                           double* xout, double* yout,
-                           struct driz_error_t* error) {
-
-  int     i;
-  double *xiptr;
-  double *yiptr;
-  double *xoptr;
-  double *yoptr;
-  double *table;
-  double  x, y;
-  int     xi, yi;
-  double  xf, yf, ixf, iyf;
-  double  tabx00, tabx01, tabx10, tabx11;
-
-  /* do the bilinear interpolation */
-  xiptr = xin;
-  yiptr = yin;
-  xoptr = xout;
-  yoptr = yout;
-  table = m->table;
-
-#define TABLE_X(x, y) (table[((y)*m->snx + (x))*2])
-#define TABLE_Y(x, y) (table[((y)*m->snx + (x))*2 + 1])
-
-  for (i = 0; i < n; ++i) {
-    x = *xiptr++ / m->factor;
-    y = *yiptr++ / m->factor;
-    xi = (int)floor(x);
-    yi = (int)floor(y);
-    xf = x - (double)xi;
-    yf = y - (double)yi;
-    ixf = 1.0 - xf;
-    iyf = 1.0 - yf;
-
-    tabx00 = TABLE_X(xi, yi);
-    tabx10 = TABLE_X(xi+1, yi);
-    tabx01 = TABLE_X(xi, yi+1);
-    tabx11 = TABLE_X(xi+1, yi+1);
-
-    /* Account for interpolating across 360-0 boundary */
-    if ((tabx00 - tabx10) > 359) {
-      tabx00 -= 360.0;
-      tabx01 -= 360.0;
-    } else if ((tabx00 - tabx10) < -359) {
-      tabx10 -= 360.0;
-      tabx11 -= 360.0;
-    }
+void
+map_table_free(struct driz_map_table_t* table) {
+  assert(table);
 
-    *xoptr++ =
-      tabx00 * ixf * iyf +
-      tabx10 * xf * iyf +
-      tabx01 * ixf * yf +
-      tabx11 * xf * yf;
-
-    *yoptr++ =
-      TABLE_Y(xi, yi)     * ixf * iyf +
-      TABLE_Y(xi+1, yi)   * xf * iyf +
-      TABLE_Y(xi, yi+1)   * ixf * yf +
-      TABLE_Y(xi+1, yi+1) * xf * yf;
-  }
+  free(table->x);
+  free(table->y);
+  table->x = NULL;
+  table->y = NULL;
+}
 
-#undef TABLE_X
-#undef TABLE_Y
+void
+mapping_param_changed(struct mapping_param_t* m) {
+  assert(m);
 
-  return 0;
+  m->poly.order = 0;
+  m->got_linear = FALSE;
+  free(m->grid);
+  m->grid = NULL;
 }
 
+void
+mapping_param_free(struct mapping_param_t* m) {
+  assert(m);
 
+  free(m->grid);
+  m->grid = NULL;
+}
 
 /*
 
-Default WCS mapping code
+Default pixel-based mapping code:DefaultMapping
 
 */
-int
-default_wcsmap(void* state,
-               const double xd, const double yd,
-               const integer_t n,
-               double* xin /*[n]*/, double* yin /*[n]*/,
-               /* Output parameters */
-               double* xout, double* yout,
-               struct driz_error_t* error) {
 
-  struct wcsmap_param_t* m = (struct wcsmap_param_t*)state;
+/* Stages of the default mapping that may be switched off */
+#define MAP_DISTORTION_IMAGE 1
+#define MAP_ALPHA_BETA 2
+#define MAP_LINEAR 4
 
-  if (m->factor == 0) {
-    return default_wcsmap_direct(m, xd, yd, n, xin, yin, xout, yout, error);
-  } else {
-    return default_wcsmap_interpolate(m, xd, yd, n, xin, yin, xout, yout, error);
-  }
-}
+/* Points mapped together; small enough for the intermediate
+   coordinates to stay in the first-level cache */
+#define MAP_BLOCK 64
 
-int
-default_wcsmap_init(struct wcsmap_param_t* m,
-                    pipeline_t* input,
-                    pipeline_t* output,
-                    int nx, int ny,
-                    double factor,
-                    struct driz_error_t* error) {
-  int     n;
-  int     table_size;
-  double *pixcrd = NULL;
-  double *ptr    = NULL;
-  double *tmp    = NULL;
-  double *phi    = NULL;
-  double *theta  = NULL;
-  double *imgcrd = NULL;
-  int    *stat   = NULL;
-  int     snx = nx + 2;
-  int     sny = ny + 2;
-  int     i;
-  int     j;
-  int     istat;
+/**
+The stages of the default mapping that follow the polynomial, applied
+to a block of n points.  \a stages is a constant at every call site so
+that each combination is compiled separately, without the disabled
+stages.
+*/
+static inline_macro void
+map_block_stages(struct mapping_param_t* m, const int stages,
+                 const double xd, const double yd, const integer_t n,
+                 const double* xs /*[n]*/, const double* ys /*[n]*/,
+                 const double* xp /*[n]*/, const double* yp /*[n]*/,
+                 /* Output parameters */
+                 double* xout, double* yout) {
+  const double* l = m->linear;
+  double x, y, xa, ya;
+  integer_t ix, iy;
+  integer_t i;
 
-  assert(m);
-  assert(input);
-  assert(output);
-  assert(m->input_wcs == NULL);
-  assert(m->output_wcs == NULL);
-  assert(m->table == NULL);
-
-  if (factor > 0) {
-    snx = (int)((double)nx / factor) + 2;
-    sny = (int)((double)ny / factor) + 2;
-
-    n = (snx) * (sny);
-    table_size = n << 1;
-
-    pixcrd = malloc(table_size * sizeof(double));
-    if (pixcrd == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+  for (i = 0; i < n; ++i) {
+    x = xp[i];
+    y = yp[i];
+
+    if (stages & MAP_DISTORTION_IMAGE) {
+      ix = (integer_t)(xs[i] + 1.0 - xd + m->xcen) - 1;
+      iy = (integer_t)(ys[i] + 1.0 - yd + m->ycen) - 1;
+      x += (double)(*x_distortion_ptr(m, ix, iy));
+      y += (double)(*y_distortion_ptr(m, ix, iy));
     }
 
-    m->table = malloc(table_size * sizeof(double));
-    if (m->table == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+    /* TODO: There is definitely something fishy in the original here
+       since the x in in the first line will have an effect in the
+       second.  We use temporaries here to eliminate that. */
+    if (stages & MAP_ALPHA_BETA) {
+      xa = (x + 1.0 - m->xcen) / m->xcen;
+      ya = (y + 1.0 - m->ycen) / m->ycen;
+      x += m->beta * xa + m->alpha * ya - 1.0;
+      y += m->beta * ya + m->alpha * xa - 1.0;
     }
 
-    tmp = malloc(table_size * sizeof(double));
-    if (tmp == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+    if (stages & MAP_LINEAR) {
+      xout[i] = l[0] * x + l[1] * y + l[2];
+      yout[i] = l[3] * x + l[4] * y + l[5];
+    } else {
+      xout[i] = x;
+      yout[i] = y;
     }
+  }
+}
 
-    phi = malloc(n * sizeof(double));
-    if (phi == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
-    }
+/**
+The polynomial (or radial) distortion of a block of n points, of the
+given coefficient type with any "refpix" offset already removed.
+*/
+static inline_macro void
+map_block_polynomial(struct mapping_param_t* m, const integer_t coeff_type,
+                     const double xdoff, const double ydoff,
+                     const integer_t n,
+                     const double* xs /*[n]*/, const double* ys /*[n]*/,
+                     /* Output parameters */
+                     double* xp /*[n]*/, double* yp /*[n]*/) {
+  integer_t i;
 
-    theta = malloc(n * sizeof(double));
-    if (theta == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+  if (coeff_type == 3) {
+    for (i = 0; i < n; ++i) {
+      xp[i] = eval3(xs[i] + xdoff, ys[i] + ydoff, m->x_coeffs) - xdoff;
+      yp[i] = eval3(xs[i] + xdoff, ys[i] + ydoff, m->y_coeffs) - ydoff;
     }
-
-    imgcrd = malloc(table_size * sizeof(double));
-    if (imgcrd == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+  } else if (coeff_type == 4) {
+    for (i = 0; i < n; ++i) {
+      xp[i] = eval4(xs[i] + xdoff, ys[i] + ydoff, m->x_coeffs) - xdoff;
+      yp[i] = eval4(xs[i] + xdoff, ys[i] + ydoff, m->y_coeffs) - ydoff;
     }
-
-    stat = malloc(n * sizeof(int));
-    if (stat == NULL) {
-      driz_error_set_message(error, "Out of memory");
-      goto exit;
+  } else if (coeff_type == 5) {
+    for (i = 0; i < n; ++i) {
+      xp[i] = eval5(xs[i] + xdoff, ys[i] + ydoff, m->x_coeffs) - xdoff;
+      yp[i] = eval5(xs[i] + xdoff, ys[i] + ydoff, m->y_coeffs) - ydoff;
     }
-
-    ptr = pixcrd;
-    for (j = 0; j < sny; ++j) {
-      for (i = 0; i < snx; ++i) {
-        *ptr++ = (double)i * factor;
-        *ptr++ = (double)j * factor;
-      }
+  } else if (coeff_type == -3) {
+    for (i = 0; i < n; ++i) {
+      rad3(xs[i] + xdoff, ys[i] + ydoff, m->x_coeffs, &xp[i], &yp[i]);
+      xp[i] -= xdoff;
+      yp[i] -= ydoff;
+    }
+  } else {
+    poly_eval_n(&m->poly, n, xs, ys, xdoff, ydoff, xp, yp);
+    for (i = 0; i < n; ++i) {
+      xp[i] -= xdoff;
+      yp[i] -= ydoff;
     }
+  }
+}
 
-    wcsprm_python2c(input->wcs);
-    istat = pipeline_all_pixel2world(input, n, 2, pixcrd, tmp);
-    wcsprm_c2python(input->wcs);
+/**
+Sample the polynomial, distortion image and alpha/beta stages every
+m->grid_step input pixels into m->grid, as displacements from the
+rescaled input coordinates.  The nodes cover the input image, from 0
+to dnx + 1 and 0 to dny + 1, and the distortion image is sampled at
+the pixel each node falls in, clamped to its edges.
+*/
+static int
+build_grid(struct mapping_param_t* m, const integer_t coeff_type,
+           const double xdoff, const double ydoff, const int stages,
+           struct driz_error_t* error) {
+  double xs[MAP_BLOCK], ys[MAP_BLOCK], xp[MAP_BLOCK], yp[MAP_BLOCK];
+  const double step = m->grid_step;
+  double* g;
+  integer_t gnx, gny;
+  integer_t ix, iy;
+  integer_t i, j, k0, nb;
 
-    if (istat) {
-      free(m->table);
-      m->table = NULL;
-      driz_error_set_message(error, wcslib_get_error_message(istat));
-      goto exit;
-    }
+  assert(m->grid == NULL);
 
-    wcsprm_python2c(output->wcs);
-    istat = wcss2p(output->wcs, n, 2, tmp, phi, theta, imgcrd, m->table, stat);
-    wcsprm_c2python(output->wcs);
+  if (m->dnx <= 0 || m->dny <= 0) {
+    driz_error_set_message(error, "The mapping grid needs the size of the input image");
+    return 1;
+  }
 
-    if (istat) {
-      free(m->table);
-      m->table = NULL;
-      driz_error_set_message(error, wcslib_get_error_message(istat));
-      goto exit;
-    }
-  } /* End if_then for factor > 0 */
+  gnx = (integer_t)((double)(m->dnx + 1) / step) + 2;
+  gny = (integer_t)((double)(m->dny + 1) / step) + 2;
+  m->grid = (double*)malloc((size_t)gnx * (size_t)gny * 2 * sizeof(double));
+  if (m->grid == NULL) {
+    driz_error_set_message(error, "Out of memory");
+    return 1;
+  }
+  m->grid_nx = gnx;
+  m->grid_ny = gny;
 
-  m->input_wcs = input;
-  m->output_wcs = output;
+  for (j = 0; j < gny; ++j) {
+    for (k0 = 0; k0 < gnx; k0 += MAP_BLOCK) {
+      nb = gnx - k0 < MAP_BLOCK ? gnx - k0 : MAP_BLOCK;
 
-  m->nx = nx;
-  m->ny = ny;
-  m->snx = snx;
-  m->sny = sny;
-  m->factor = factor;
+      for (i = 0; i < nb; ++i) {
+        xs[i] = m->x_scale * ((double)(k0 + i) * step + 1.0 - m->xcen) - 1.0;
+        ys[i] = m->y_scale * ((double)j * step + 1.0 - m->ycen) - 1.0;
+      }
+
+      map_block_polynomial(m, coeff_type, xdoff, ydoff, nb, xs, ys, xp, yp);
+
+      if (stages & MAP_DISTORTION_IMAGE) {
+        for (i = 0; i < nb; ++i) {
+          ix = (integer_t)floor(xs[i] + m->xcen) - 1;
+          iy = (integer_t)floor(ys[i] + m->ycen) - 1;
+          ix = CLAMP(ix, 0, m->x_dist_dim - 1);
+          iy = CLAMP(iy, 0, m->y_dist_dim - 1);
+          xp[i] += (double)(*x_distortion_ptr(m, ix, iy));
+          yp[i] += (double)(*y_distortion_ptr(m, ix, iy));
+        }
+      }
 
- exit:
+      map_block_stages(m, stages & MAP_ALPHA_BETA, 0.0, 0.0, nb, xs, ys,
+                       xp, yp, xp, yp);
 
-  free(pixcrd);
-  free(tmp);
-  free(phi);
-  free(theta);
-  free(imgcrd);
-  free(stat);
+      g = m->grid + 2 * ((size_t)j * (size_t)gnx + (size_t)k0);
+      for (i = 0; i < nb; ++i) {
+        g[2 * i] = xp[i] - xs[i];
+        g[2 * i + 1] = yp[i] - ys[i];
+      }
+    }
+  }
 
   return 0;
 }
 
-void
-wcsmap_param_dump(struct wcsmap_param_t* m) {
-  assert(m);
+/**
+Bilinear interpolation of m->grid at a block of n input points (xr,
+yr), added to their rescaled coordinates (xs, ys).  Points beyond the
+grid are extrapolated from its edge cells.
+*/
+static inline_macro void
+map_block_grid(struct mapping_param_t* m, const integer_t n,
+               const double* xr /*[n]*/, const double* yr /*[n]*/,
+               const double* xs /*[n]*/, const double* ys /*[n]*/,
+               /* Output parameters */
+               double* xp /*[n]*/, double* yp /*[n]*/) {
+  const double rstep = 1.0 / m->grid_step;
+  const integer_t gnx = m->grid_nx;
+  const double* g0;
+  const double* g1;
+  double u, v, x0, x1, y0, y1;
+  integer_t iu, iv;
+  integer_t i;
 
-  printf("WCS MAPPING PARAMETERS:\n"
-         "input WCS:            \n");
-  wcsprt(m->input_wcs->wcs);
-  printf("output WCS:           \n");
-  wcsprt(m->input_wcs->wcs);
+  for (i = 0; i < n; ++i) {
+    u = xr[i] * rstep;
+    v = yr[i] * rstep;
+    iu = CLAMP((integer_t)floor(u), 0, gnx - 2);
+    iv = CLAMP((integer_t)floor(v), 0, m->grid_ny - 2);
+    u -= (double)iu;
+    v -= (double)iv;
+
+    g0 = m->grid + 2 * ((size_t)iv * (size_t)gnx + (size_t)iu);
+    g1 = g0 + 2 * gnx;
+    x0 = g0[0] + u * (g0[2] - g0[0]);
+    x1 = g1[0] + u * (g1[2] - g1[0]);
+    y0 = g0[1] + u * (g0[3] - g0[1]);
+    y1 = g1[1] + u * (g1[3] - g1[1]);
+    xp[i] = xs[i] + x0 + v * (x1 - x0);
+    yp[i] = ys[i] + y0 + v * (y1 - y0);
+  }
 }
 
-void
-wcsmap_param_free(struct wcsmap_param_t* m) {
-  free(m->table);
-  wcsmap_param_init(m);
-}
+/**
+The forward differences, table[0] to table[d], at u of the polynomial
+co of degree d (3, 4 or 5, in the ordering of eval3() etc) along the
+row y = v, stepping in x by h.  They are derived from the Taylor
+coefficients at u rather than by differencing values, which would
+lose most of the precision of the higher differences.
+*/
+static void
+row_differences(const double* co, const integer_t d,
+                const double u, const double v, const double h,
+                /* Output parameters */
+                double* table /*[d+1]*/) {
+  /* The k-th forward difference of t^j at 0, j! S(k, j) with S the
+     Stirling numbers of the second kind */
+  static const double delta[6][6] = {
+    {1.0, 0.0, 0.0, 0.0, 0.0, 0.0},
+    {0.0, 1.0, 0.0, 0.0, 0.0, 0.0},
+    {0.0, 1.0, 2.0, 0.0, 0.0, 0.0},
+    {0.0, 1.0, 6.0, 6.0, 0.0, 0.0},
+    {0.0, 1.0, 14.0, 36.0, 24.0, 0.0},
+    {0.0, 1.0, 30.0, 150.0, 240.0, 120.0}
+  };
+  double a[6];
+  double vj, hk;
+  integer_t i, j, k;
+
+  assert(d >= 3 && d <= 5);
+
+  /* The polynomial in x along the row */
+  for (i = 0; i <= d; ++i)
+    a[i] = 0.0;
+  vj = 1.0;
+  for (j = 0; j <= d; ++j) {
+    for (i = 0; i <= d - j; ++i)
+      a[i] += co[(i + j) * (i + j + 1) / 2 + j] * vj;
+    vj *= v;
+  }
 
-void
-wcsmap_param_init(struct wcsmap_param_t* m) {
-  assert(m);
+  /* Its Taylor coefficients at u */
+  for (k = 0; k < d; ++k)
+    for (i = d - 1; i >= k; --i)
+      a[i] += u * a[i + 1];
+
+  /* In steps of h */
+  hk = h;
+  for (k = 1; k <= d; ++k) {
+    a[k] *= hk;
+    hk *= h;
+  }
 
-  /* Pointers to the PyWCS objects */
-  m->input_wcs = NULL;
-  m->output_wcs = NULL;
-  m->table = NULL;
+  for (j = 0; j <= d; ++j) {
+    table[j] = 0.0;
+    for (k = j; k <= d; ++k)
+      table[j] += delta[k][j] * a[k];
+  }
 }
 
-/*
+/**
+The default mapping of n points, either given by \a xin and \a yin
+or, when \a xin is NULL, the row (x0 + i * dx, y0).  All the stages
+are applied to a block of points before moving on to the next, so no
+pass is made over the whole of the coordinate arrays.
+*/
+static int
+fused_mapping(struct mapping_param_t* m,
+              const double xd, const double yd,
+              const integer_t n,
+              const double* xin /*[n]*/, const double* yin /*[n]*/,
+              const double x0, const double dx, const double y0,
+              /* Output parameters */
+              double* xout, double* yout,
+              struct driz_error_t* error) {
+  double xr[MAP_BLOCK], yr[MAP_BLOCK];
+  double xs[MAP_BLOCK], ys[MAP_BLOCK], xp[MAP_BLOCK], yp[MAP_BLOCK];
+  double xtable[6], ytable[6];
+  const double* rx;
+  const double* ry;
+  double x, xdoff, ydoff;
+  integer_t coeff_type;
+  integer_t i, j, k0, nb;
+  bool_t difference;
+  int stages;
 
-Default pixel-based mapping code:DefaultMapping
+  /* Check for the presence of "refpix" additional information in the
+     coefficients.  If it is, offset again */
+  coeff_type = m->coeff_type;
+  if (coeff_type > COEFF_OFFSET / 2) {
+    coeff_type -= COEFF_OFFSET;
+    xdoff = m->xcen - m->x_coeffs[m->num_coeffs - 1] + 1.0;
+    ydoff = m->ycen - m->y_coeffs[m->num_coeffs - 1] + 1.0;
+  } else {
+    xdoff = 2.0;
+    ydoff = 2.0;
+  }
 
-*/
+  if (coeff_type >= 6 || coeff_type == 1 || coeff_type == 2) {
+    if (m->poly.order != coeff_type &&
+        poly_compile(&m->poly, m->x_coeffs, m->y_coeffs, coeff_type, error))
+      return 1;
+  } else if (coeff_type < 3 && coeff_type != -3) {
+    driz_error_format_message(error, "Invalid coefficient type %d", coeff_type);
+    return 1;
+  }
+
+  if (!m->got_linear && derive_linear(m, error))
+    return 1;
+
+  stages = 0;
+  if (m->use_distortion_image)
+    stages |= MAP_DISTORTION_IMAGE;
+  if (m->alpha != 0.0 || m->beta != 0.0)
+    stages |= MAP_ALPHA_BETA;
+
+  if (m->grid_step > 0.0) {
+    if (m->grid == NULL &&
+        build_grid(m, coeff_type, xdoff, ydoff, stages, error))
+      return 1;
+    /* The grid stands in for all of the stages but the last */
+    stages = 0;
+  }
+
+  difference = (xin == NULL && m->difference_interval > 0 &&
+                m->grid_step <= 0.0 && coeff_type >= 3 && coeff_type <= 5);
+
+  x = x0;
+  for (k0 = 0; k0 < n; k0 += MAP_BLOCK) {
+    nb = n - k0 < MAP_BLOCK ? n - k0 : MAP_BLOCK;
+
+    /* The built-in "default" mapping needs some pre-processing on its
+       input values. */
+    if (xin == NULL) {
+      for (i = 0; i < nb; ++i) {
+        xr[i] = x;
+        yr[i] = y0;
+        x += dx;
+      }
+      rx = xr;
+      ry = yr;
+    } else {
+      rx = xin + k0;
+      ry = yin + k0;
+    }
+    for (i = 0; i < nb; ++i) {
+      xs[i] = m->x_scale * (rx[i] + 1.0 - m->xcen) - 1.0;
+      ys[i] = m->y_scale * (ry[i] + 1.0 - m->ycen) - 1.0;
+    }
+
+    if (m->grid != NULL) {
+      map_block_grid(m, nb, rx, ry, xs, ys, xp, yp);
+    } else if (difference) {
+      for (i = 0; i < nb; ++i) {
+        if ((k0 + i) % m->difference_interval == 0) {
+          row_differences(m->x_coeffs, coeff_type, xs[i] + xdoff,
+                          ys[i] + ydoff, m->x_scale * dx, xtable);
+          row_differences(m->y_coeffs, coeff_type, xs[i] + xdoff,
+                          ys[i] + ydoff, m->x_scale * dx, ytable);
+        } else {
+          for (j = 0; j < coeff_type; ++j) {
+            xtable[j] += xtable[j + 1];
+            ytable[j] += ytable[j + 1];
+          }
+        }
+        xp[i] = xtable[0] - xdoff;
+        yp[i] = ytable[0] - ydoff;
+      }
+    } else {
+      map_block_polynomial(m, coeff_type, xdoff, ydoff, nb, xs, ys, xp, yp);
+    }
+
+    switch (stages) {
+    case 0:
+      map_block_stages(m, MAP_LINEAR, xd, yd, nb, xs, ys, xp, yp,
+                       xout + k0, yout + k0);
+      break;
+    case MAP_DISTORTION_IMAGE:
+      map_block_stages(m, MAP_DISTORTION_IMAGE | MAP_LINEAR, xd, yd, nb,
+                       xs, ys, xp, yp, xout + k0, yout + k0);
+      break;
+    case MAP_ALPHA_BETA:
+      map_block_stages(m, MAP_ALPHA_BETA | MAP_LINEAR, xd, yd, nb,
+                       xs, ys, xp, yp, xout + k0, yout + k0);
+      break;
+    default:
+      map_block_stages(m, MAP_DISTORTION_IMAGE | MAP_ALPHA_BETA | MAP_LINEAR,
+                       xd, yd, nb, xs, ys, xp, yp, xout + k0, yout + k0);
+      break;
+    }
+  }
+
+  return 0;
+}
 
 int
 default_mapping(void* state,
@@ -638,29 +834,18 @@ default_mapping(void* state,
                 /* Output parameters */
                 double* xout, double* yout,
                 struct driz_error_t* error) {
-  struct mapping_param_t* m = (struct mapping_param_t*)state;
-  integer_t i;
-
-  /* The built-in "default" mapping needs some pre-processing on its
-     input values. */
-  for (i = 0; i < n; ++i) {
-    xin[i] = m->x_scale * (xin[i] + 1.0 - m->xcen) - 1.0;
-    yin[i] = m->y_scale * (yin[i] + 1.0 - m->ycen) - 1.0;
-  }
-
-  if (drizzle_polynomial(state, xd, yd, n, xin, yin, xout, yout, error))
-    return 1;
-
-  if (drizzle_distortion_image(state, xd, yd, n, xin, yin, xout, yout, error))
-    return 1;
-
-  /* These next two build on the values already in xout/yout, so they
-     are passed as inputs.  This is not a mistake. */
-  if (drizzle_alpha_beta(state, xd, yd, n, xout, yout, xout, yout, error))
-    return 1;
-
-  if (drizzle_linear_or_secondary(state, xd, yd, n, xout, yout, xout, yout, error))
-    return 1;
+  return fused_mapping((struct mapping_param_t*)state, xd, yd, n,
+                       xin, yin, 0.0, 0.0, 0.0, xout, yout, error);
+}
 
-  return 0;
+int
+default_mapping_row(void* state,
+                    const double xd, const double yd,
+                    const integer_t n,
+                    const double x0, const double dx, const double y,
+                    /* Output parameters */
+                    double* xout, double* yout,
+                    struct driz_error_t* error) {
+  return fused_mapping((struct mapping_param_t*)state, xd, yd, n,
+                       NULL, NULL, x0, dx, y, xout, yout, error);
 }
@@ -0,0 +1,216 @@
+#include "driz_portability.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "cdrizzlesched.h"
+
+#ifndef _WIN32
+
+struct sched_t;
+
+/** The items left to one thread, and what it has measured of them */
+struct sched_worker_t {
+  struct sched_t* sched;
+  integer_t index;
+  integer_t next; /* The first item left */
+  integer_t end;  /* One past the last */
+  double cost;    /* Seconds per item, 0 until measured */
+  bool_t started;
+  pthread_t thread;
+  struct driz_error_t error;
+};
+
+/**
+The state shared by the threads of a driz_parallel_for().  Tasks last
+milliseconds, so that a single lock over the ranges of all threads is
+taken rarely enough not to be contended, and keeps the test for the
+end of the work simple: no range has any item left.
+*/
+struct sched_t {
+  pthread_mutex_t lock;
+  struct sched_worker_t* workers;
+  integer_t nthreads;
+  integer_t min_chunk;
+  driz_range_func_t func;
+  void* state;
+  /* The first thread whose task failed, or -1 */
+  integer_t failed;
+};
+
+/**
+Take the next task of thread \a w into [*begin, *end), stealing from
+another thread when it has none left.  Returns FALSE when no item is
+left anywhere, or a task has failed.  Called with the lock held.
+*/
+static bool_t
+sched_claim(struct sched_t* s, struct sched_worker_t* w,
+            /* Output parameters */
+            integer_t* begin, integer_t* end) {
+  struct sched_worker_t* victim = NULL;
+  integer_t k, left, most, size;
+  double fit;
+
+  if (s->failed >= 0) {
+    return FALSE;
+  }
+
+  if (w->next >= w->end) {
+    /* The back half of whatever thread has the most left, the items
+       furthest from those it is working on */
+    most = 0;
+    for (k = 0; k < s->nthreads; ++k) {
+      left = s->workers[k].end - s->workers[k].next;
+      if (left > most) {
+        most = left;
+        victim = &s->workers[k];
+      }
+    }
+    if (victim == NULL) {
+      return FALSE;
+    }
+
+    size = (most + 1) / 2;
+    w->end = victim->end;
+    w->next = victim->end - size;
+    victim->end = w->next;
+    /* Neighbouring items cost about the same */
+    if (victim->cost > 0.0) {
+      w->cost = victim->cost;
+    }
+  }
+
+  left = w->end - w->next;
+  size = s->min_chunk;
+  if (w->cost > 0.0) {
+    fit = DRIZ_SCHED_TASK_TIME / w->cost;
+    size = fit < (double)left ? MAX((integer_t)fit, s->min_chunk) : left;
+  }
+  size = MIN(size, left);
+
+  *begin = w->next;
+  *end = w->next + size;
+  w->next += size;
+
+  return TRUE;
+}
+
+static void*
+sched_run(void* arg) {
+  struct sched_worker_t* w = (struct sched_worker_t*)arg;
+  struct sched_t* s = w->sched;
+  integer_t begin, end;
+  double t0, cost;
+  int status;
+
+  pthread_mutex_lock(&s->lock);
+  while (sched_claim(s, w, &begin, &end)) {
+    pthread_mutex_unlock(&s->lock);
+
+    t0 = driz_timer();
+    status = s->func(s->state, w->index, begin, end, &w->error);
+    cost = (driz_timer() - t0) / (double)(end - begin);
+
+    pthread_mutex_lock(&s->lock);
+    if (status) {
+      if (s->failed < 0) {
+        s->failed = w->index;
+      }
+      break;
+    }
+
+    /* Follow the cost as it changes along the items, without being
+       thrown by one task */
+    w->cost = w->cost > 0.0 ? 0.5 * (w->cost + cost) : cost;
+    if (!(w->cost > 0.0)) {
+      w->cost = 1e-9;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return NULL;
+}
+
+#endif /* _WIN32 */
+
+int
+driz_parallel_for(const integer_t nthreads, const integer_t n,
+                  const integer_t min_chunk,
+                  driz_range_func_t func, void* state,
+                  /* Output parameters */
+                  struct driz_error_t* error) {
+#ifndef _WIN32
+  struct sched_t s;
+  struct sched_worker_t* w;
+  integer_t nt, k;
+#endif
+
+  assert(func);
+  assert(error);
+
+  if (n <= 0) {
+    return 0;
+  }
+
+#ifndef _WIN32
+  s.min_chunk = MAX(min_chunk, 1);
+  /* No more threads than there are first tasks to give them */
+  nt = MIN(nthreads, (n + s.min_chunk - 1) / s.min_chunk);
+  if (nt > 1) {
+    s.workers = (struct sched_worker_t*)calloc((size_t)nt,
+                                               sizeof(struct sched_worker_t));
+    if (s.workers == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      return 1;
+    }
+    if (pthread_mutex_init(&s.lock, NULL) != 0) {
+      free(s.workers);
+      driz_error_set_message(error, "Could not create a lock");
+      return 1;
+    }
+    s.nthreads = nt;
+    s.func = func;
+    s.state = state;
+    s.failed = -1;
+
+    for (k = 0; k < nt; ++k) {
+      w = &s.workers[k];
+      w->sched = &s;
+      w->index = k;
+      w->next = (integer_t)((double)n * (double)k / (double)nt);
+      w->end = (integer_t)((double)n * (double)(k + 1) / (double)nt);
+      w->cost = 0.0;
+      driz_error_init(&w->error);
+    }
+
+    /* The calling thread is the first.  A thread that cannot be
+       started leaves its share to be stolen by the others */
+    for (k = 1; k < nt; ++k) {
+      w = &s.workers[k];
+      w->started = (bool_t)(pthread_create(&w->thread, NULL, &sched_run, w) == 0);
+    }
+    sched_run(&s.workers[0]);
+    for (k = 1; k < nt; ++k) {
+      if (s.workers[k].started) {
+        pthread_join(s.workers[k].thread, NULL);
+      }
+    }
+
+    if (s.failed >= 0) {
+      driz_error_set_message(error,
+                             driz_error_get_message(&s.workers[s.failed].error));
+    }
+
+    pthread_mutex_destroy(&s.lock);
+    free(s.workers);
+
+    return driz_error_is_set(error);
+  }
+#endif
+
+  return func(state, 0, 0, n, error);
+}
@@ -0,0 +1,118 @@
+#ifndef CDRIZZLESCHED_H
+#define CDRIZZLESCHED_H
+
+#include "cdrizzleutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+The work of one task: items \a begin to \a end - 1, done by \a worker,
+0 to nthreads - 1, so that it can keep scratch space of its own.  Must
+return non-zero, with \a error set, on failure.
+*/
+typedef int (*driz_range_func_t) \
+  (void* state, const integer_t worker,
+   const integer_t begin, const integer_t end,
+   /* Output parameters */
+   struct driz_error_t* error);
+
+/**
+Seconds of work each task is sized to take, once the cost of an item
+has been measured
+*/
+#define DRIZ_SCHED_TASK_TIME 2e-3
+
+/**
+Do items 0 to \a n - 1, such as rows, with \a nthreads threads, the
+calling thread among them, calling \a func on runs of neighbouring
+items.
+
+Each thread starts with an even share of the items and takes tasks
+from the front of it.  The first task of a thread is \a min_chunk
+items; after that each task is sized to take DRIZ_SCHED_TASK_TIME
+from the time per item measured so far, and never less than \a
+min_chunk, so that items that are nearly free, such as rows off the
+output, go by in large tasks and costly ones in small.  A thread that
+runs out steals the back half of whatever thread has the most left,
+so that threads finish together however unevenly the cost falls.
+
+Calls of \a func may run at once, and must not write the same memory.
+Once one fails no more are started, and its error is returned.  With
+one thread, or where threads are not supported, the items are done in
+order by the calling thread.
+*/
+int
+driz_parallel_for(const integer_t nthreads, const integer_t n,
+                  const integer_t min_chunk,
+                  driz_range_func_t func, void* state,
+                  /* Output parameters */
+                  struct driz_error_t* error);
+
+/**
+DRIZ_HAVE_ATOMICS is defined where the threads of driz_parallel_for()
+may add to the same memory with the helpers below.  Elsewhere they do
+plain, unguarded updates, which is safe only with one thread.
+*/
+#if !defined(_WIN32) && defined(__GNUC__)
+#define DRIZ_HAVE_ATOMICS 1
+#endif
+
+/** Add \a v to \a *a, in one step as far as other threads can see */
+static inline_macro void
+driz_atomic_add_float(float* a, const float v) {
+#ifdef DRIZ_HAVE_ATOMICS
+  float old, sum;
+
+  __atomic_load(a, &old, __ATOMIC_RELAXED);
+  do {
+    sum = old + v;
+  } while (!__atomic_compare_exchange(a, &old, &sum, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+#else
+  *a += v;
+#endif
+}
+
+/** Set the bits \a v in \a *a, in one step */
+static inline_macro void
+driz_atomic_or(integer_t* a, const integer_t v) {
+#ifdef DRIZ_HAVE_ATOMICS
+  __atomic_fetch_or(a, v, __ATOMIC_RELAXED);
+#else
+  *a |= v;
+#endif
+}
+
+/**
+Take a spinlock, a char that is 0 when it is free, for updates too
+short to be worth sleeping over
+*/
+static inline_macro void
+driz_spin_lock(char* lock) {
+#ifdef DRIZ_HAVE_ATOMICS
+  while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+      /* Wait without writing, until it may be free */
+    }
+  }
+#else
+  *lock = 1;
+#endif
+}
+
+static inline_macro void
+driz_spin_unlock(char* lock) {
+#ifdef DRIZ_HAVE_ATOMICS
+  __atomic_clear(lock, __ATOMIC_RELEASE);
+#else
+  *lock = 0;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRIZZLESCHED_H */
@@ -1,5 +1,3 @@
-#define NO_IMPORT_ARRAY
-#define NO_IMPORT_ASTROPY_WCS_API
 #include "cdrizzlemap.h"
 #include "cdrizzleutil.h"
 
@@ -10,6 +8,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 /*****************************************************************
  ERROR HANDLING
@@ -88,7 +94,7 @@ driz_param_dump(struct driz_param_t* p) {
   assert(p);
 
   printf("DRIZZLING PARAMETERS:\n"
-         "callback:             %lx (%lx)\n"
+         "callback:             %lx\n"
          "kernel:               %s\n"
          "pixel_fraction:       %f\n"
          "exposure_time:        %f\n"
@@ -107,7 +113,6 @@ driz_param_dump(struct driz_param_t* p) {
          "x_scale:              %f\n"
          "y_scale:              %f\n",
          (unsigned long)p->mapping_callback,
-         (unsigned long)&default_wcsmap,
          kernel_enum2str(p->kernel),
          p->pixel_fraction,
          p->exposure_time,
@@ -137,6 +142,18 @@ driz_param_init(struct driz_param_t* p) {
   /* Actual drizzle callback */
   p->mapping_callback = NULL;
   p->mapping_callback_state = NULL;
+  p->map_batch = FALSE;
+  p->map_table = NULL;
+  p->nthreads = 1;
+  p->parallel = parallel_bands;
+  p->data_raw = NULL;
+  p->weights_raw = NULL;
+  driz_pixel_format_init(&p->data_format);
+  driz_pixel_format_init(&p->weights_format);
+  p->dq = NULL;
+  p->dq_swapped = FALSE;
+  p->dq_ignore = 0;
+  p->weights_error = FALSE;
 
   /* Kernel shape and size */
   p->kernel = kernel_square;
@@ -168,12 +185,23 @@ driz_param_init(struct driz_param_t* p) {
   p->ony = 0;
   p->output_data = NULL;
   p->output_counts = NULL;
+  p->output_sum = FALSE;
+  p->output_tiles = NULL;
   p->output_context = NULL;
   p->output_done = NULL;
 
   p->lanczos.lut = NULL;
   p->lanczos.space = 1.0;
 
+  /* Blotting order and source layout */
+  p->blot_tile = 0;
+  p->blot_block_shift = 0;
+  p->blot_x1 = 0;
+  p->blot_y1 = 0;
+  p->blot_wnx = 0;
+  p->blot_wny = 0;
+  p->blot_outside = FALSE;
+
   for (i = 0; i < MAXEN * MAXIM; ++i)
     p->intab[i] = 0;
 
@@ -183,6 +211,367 @@ driz_param_init(struct driz_param_t* p) {
   p->scale2 = 1.0;
   p->x_scale = 1.0;
   p->y_scale = 1.0;
+
+  p->stats = NULL;
+}
+
+void
+driz_pixel_format_init(struct driz_pixel_format_t* format) {
+  assert(format);
+
+  format->type = pixel_float32;
+  format->swapped = FALSE;
+  format->bscale = 1.0;
+  format->bzero = 0.0;
+}
+
+/*****************************************************************
+ SPARSE OUTPUT
+*/
+/** Lay the arrays of a tile out from \a base, data first */
+static void
+layout_tile(struct driz_tile_t* tile, const integer_t shift, void* base) {
+  const size_t n = (size_t)1 << (2 * shift);
+
+  tile->data = (float*)base;
+  tile->counts = tile->data + n;
+  tile->context = (integer_t*)(tile->counts + n);
+}
+
+/** The bytes of the arrays of a tile */
+static size_t
+tile_bytes(const integer_t shift, const integer_t nplanes) {
+  return ((size_t)1 << (2 * shift)) *
+    (2 * sizeof(float) + (size_t)nplanes * sizeof(integer_t));
+}
+
+/** Allocate a tile, its arrays following it in one block, all zero */
+static struct driz_tile_t*
+alloc_tile(const integer_t shift, const integer_t nplanes) {
+  struct driz_tile_t* tile;
+
+  tile = (struct driz_tile_t*)calloc(1, sizeof(struct driz_tile_t) +
+                                     tile_bytes(shift, nplanes));
+  if (tile == NULL) {
+    return NULL;
+  }
+  layout_tile(tile, shift, tile + 1);
+
+  return tile;
+}
+
+int
+driz_tiles_init(struct driz_tiles_t* t, const integer_t onx,
+                const integer_t ony, const integer_t shift,
+                const integer_t nplanes, const char* filename,
+                const integer_t max_resident, struct driz_error_t* error) {
+  size_t ntiles;
+#ifndef _WIN32
+  long page;
+#endif
+
+  assert(t);
+  assert(error);
+
+  memset(t, 0, sizeof(struct driz_tiles_t));
+  t->fd = -1;
+  t->last = -1;
+
+  if (onx < 1 || ony < 1 || shift < 4 || shift > 12 || nplanes < 1 ||
+      (filename != NULL && max_resident < 1)) {
+    driz_error_set_message(error, "Invalid sparse output");
+    return 1;
+  }
+
+  t->shift = shift;
+  t->onx = onx;
+  t->ony = ony;
+  t->ntx = ((onx - 1) >> shift) + 1;
+  t->nty = ((ony - 1) >> shift) + 1;
+  t->nplanes = nplanes;
+  ntiles = (size_t)t->ntx * (size_t)t->nty;
+  t->tiles = (struct driz_tile_t**)calloc(ntiles, sizeof(struct driz_tile_t*));
+  t->touched = (char*)calloc(ntiles, 1);
+  t->scratch = alloc_tile(shift, nplanes);
+  if (t->tiles == NULL || t->touched == NULL || t->scratch == NULL) {
+    driz_tiles_free(t);
+    driz_error_set_message(error, "Out of memory");
+    return 1;
+  }
+
+  if (filename == NULL) {
+    return 0;
+  }
+
+#ifdef _WIN32
+  driz_tiles_free(t);
+  driz_error_set_message(error,
+                         "Out-of-core output is not supported on Windows");
+  return 1;
+#else
+  /* Slots start on page boundaries, to be mapped one at a time */
+  page = sysconf(_SC_PAGESIZE);
+  t->slot_bytes = tile_bytes(shift, nplanes);
+  t->slot_bytes = (t->slot_bytes + (size_t)page - 1) / (size_t)page *
+    (size_t)page;
+  t->max_resident = max_resident;
+  t->resident = (integer_t*)malloc((size_t)max_resident * sizeof(integer_t));
+  t->resident_tiles = (struct driz_tile_t*)
+    malloc((size_t)max_resident * sizeof(struct driz_tile_t));
+  t->stamp = (unsigned long*)calloc((size_t)max_resident,
+                                    sizeof(unsigned long));
+  if (t->resident == NULL || t->resident_tiles == NULL || t->stamp == NULL) {
+    driz_tiles_free(t);
+    driz_error_set_message(error, "Out of memory");
+    return 1;
+  }
+
+  t->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (t->fd < 0 || ftruncate(t->fd, (off_t)(ntiles * t->slot_bytes)) != 0) {
+    driz_error_format_message(error, "Could not create '%s': %s", filename,
+                              strerror(errno));
+    driz_tiles_free(t);
+    return 1;
+  }
+
+  return 0;
+#endif
+}
+
+void
+driz_tiles_free(struct driz_tiles_t* t) {
+  integer_t i;
+
+  assert(t);
+
+#ifndef _WIN32
+  if (t->fd >= 0) {
+    for (i = 0; i < t->nresident; ++i) {
+      munmap((void*)t->resident_tiles[i].data, t->slot_bytes);
+    }
+    close(t->fd);
+    t->fd = -1;
+  } else
+#endif
+  if (t->tiles) {
+    for (i = 0; i < t->ntx * t->nty; ++i) {
+      free(t->tiles[i]);
+    }
+  }
+  free(t->tiles);
+  free(t->touched);
+  free(t->scratch);
+  free(t->resident);
+  free(t->resident_tiles);
+  free(t->stamp);
+  t->tiles = NULL;
+  t->touched = NULL;
+  t->scratch = NULL;
+  t->resident = NULL;
+  t->resident_tiles = NULL;
+  t->stamp = NULL;
+  t->nresident = 0;
+  t->ntouched = 0;
+  t->last = -1;
+}
+
+void
+driz_tiles_clear(struct driz_tiles_t* t) {
+  integer_t i;
+
+  assert(t);
+  assert(t->fd < 0);
+
+  for (i = 0; i < t->ntx * t->nty; ++i) {
+    free(t->tiles[i]);
+    t->tiles[i] = NULL;
+    t->touched[i] = 0;
+  }
+  t->ntouched = 0;
+  t->last = -1;
+  t->failed = FALSE;
+}
+
+#ifndef _WIN32
+/**
+Map tile i from its slot of the file, first unmapping the tile used
+least recently if max_resident are mapped already.
+*/
+static struct driz_tile_t*
+map_tile(struct driz_tiles_t* t, const integer_t i) {
+  integer_t s, k;
+  void* base;
+
+  if (t->nresident < t->max_resident) {
+    s = t->nresident++;
+  } else {
+    s = 0;
+    for (k = 1; k < t->nresident; ++k) {
+      if (t->stamp[k] < t->stamp[s]) {
+        s = k;
+      }
+    }
+    munmap((void*)t->resident_tiles[s].data, t->slot_bytes);
+    t->tiles[t->resident[s]] = NULL;
+    ++t->nevict;
+  }
+
+  base = mmap(NULL, t->slot_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+              t->fd, (off_t)((size_t)i * t->slot_bytes));
+  if (base == MAP_FAILED) {
+    /* Give the slot up */
+    --t->nresident;
+    if (s != t->nresident) {
+      t->resident[s] = t->resident[t->nresident];
+      t->resident_tiles[s] = t->resident_tiles[t->nresident];
+      t->stamp[s] = t->stamp[t->nresident];
+      t->tiles[t->resident[s]] = &t->resident_tiles[s];
+    }
+    return NULL;
+  }
+
+  t->resident[s] = i;
+  t->stamp[s] = ++t->clock;
+  layout_tile(&t->resident_tiles[s], t->shift, base);
+
+  return &t->resident_tiles[s];
+}
+#endif
+
+struct driz_tile_t*
+driz_tiles_touch(struct driz_tiles_t* t, const integer_t tx,
+                 const integer_t ty) {
+  const integer_t i = ty * t->ntx + tx;
+  struct driz_tile_t* tile;
+
+  assert(t);
+  assert(tx >= 0 && tx < t->ntx);
+  assert(ty >= 0 && ty < t->nty);
+
+  tile = t->tiles[i];
+  if (tile != NULL) {
+    if (t->fd >= 0) {
+      t->stamp[tile - t->resident_tiles] = ++t->clock;
+    }
+    t->last = i;
+    return tile;
+  }
+
+#ifndef _WIN32
+  if (t->fd >= 0) {
+    tile = map_tile(t, i);
+  } else
+#endif
+  tile = alloc_tile(t->shift, t->nplanes);
+
+  if (tile == NULL) {
+    t->failed = TRUE;
+    t->last = -1;
+    return t->scratch;
+  }
+
+  t->tiles[i] = tile;
+  if (!t->touched[i]) {
+    t->touched[i] = 1;
+    ++t->ntouched;
+  }
+  t->last = i;
+
+  return tile;
+}
+
+int
+driz_tiles_read_rows(struct driz_tiles_t* t, const integer_t y0,
+                     const integer_t ny,
+                     /* Output parameters */
+                     float* data, float* counts, integer_t* context) {
+  const integer_t edge = (integer_t)1 << t->shift;
+  const size_t n = (size_t)t->onx * (size_t)ny;
+  const struct driz_tile_t* tile;
+  integer_t tx, ty, j, j1, j2, k, nx;
+  size_t src, dst;
+
+  assert(t);
+  assert(y0 >= 0 && ny >= 0 && y0 + ny <= t->ony);
+  assert(data);
+  assert(counts);
+  assert(context);
+
+  memset(data, 0, n * sizeof(float));
+  memset(counts, 0, n * sizeof(float));
+  memset(context, 0, n * (size_t)t->nplanes * sizeof(integer_t));
+
+  for (ty = y0 >> t->shift; ty * edge < y0 + ny; ++ty) {
+    j1 = MAX(y0, ty * edge);
+    j2 = MIN(y0 + ny, (ty + 1) * edge);
+    for (tx = 0; tx < t->ntx; ++tx) {
+      if (!t->touched[ty * t->ntx + tx]) {
+        continue;
+      }
+      tile = driz_tiles_touch(t, tx, ty);
+      if (tile == t->scratch) {
+        return 1;
+      }
+      nx = MIN(edge, t->onx - tx * edge);
+      for (j = j1; j < j2; ++j) {
+        src = (size_t)(j - ty * edge) * edge;
+        dst = (size_t)(j - y0) * t->onx + (size_t)tx * edge;
+        memcpy(data + dst, tile->data + src, nx * sizeof(float));
+        memcpy(counts + dst, tile->counts + src, nx * sizeof(float));
+        for (k = 0; k < t->nplanes; ++k) {
+          memcpy(context + (size_t)k * n + dst,
+                 tile->context + ((size_t)k << (2 * t->shift)) + src,
+                 nx * sizeof(integer_t));
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*****************************************************************
+ INSTRUMENTATION
+*/
+void
+driz_stats_init(struct driz_stats_t* stats) {
+  assert(stats);
+
+  stats->total_time = 0.0;
+  stats->map_time = 0.0;
+  stats->kernel_time = 0.0;
+  stats->wcs_pix2sky_time = 0.0;
+  stats->wcs_sky2pix_time = 0.0;
+  stats->wcs_table_time = 0.0;
+  stats->nmap = 0;
+  stats->nhit = 0;
+  stats->nmiss = 0;
+  stats->nskip = 0;
+}
+
+void
+driz_stats_add_times(struct driz_stats_t* to, const struct driz_stats_t* from) {
+  assert(to);
+  assert(from);
+
+  to->map_time += from->map_time;
+  to->kernel_time += from->kernel_time;
+  to->wcs_pix2sky_time += from->wcs_pix2sky_time;
+  to->wcs_sky2pix_time += from->wcs_sky2pix_time;
+  to->wcs_table_time += from->wcs_table_time;
+  to->nmap += from->nmap;
+}
+
+double
+driz_timer(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
 /*****************************************************************
@@ -230,6 +619,13 @@ static const char* interp_string_table[] = {
   NULL
 };
 
+static const char* parallel_string_table[] = {
+  "bands",
+  "gather",
+  "atomic",
+  NULL
+};
+
 static const char* bool_string_table[] = {
   "FALSE",
   "TRUE",
@@ -306,6 +702,16 @@ interp_str2enum(const char* s, enum e_interp_t* result, struct driz_error_t* err
   return 0;
 }
 
+int
+parallel_str2enum(const char* s, enum e_parallel_t* result, struct driz_error_t* error) {
+  if (str2enum(s, parallel_string_table, (int *)result, error)) {
+    driz_error_format_message(error, "Unknown parallel mode '%s'", s);
+    return 1;
+  }
+
+  return 0;
+}
+
 const char*
 shift_enum2str(enum e_shift_t value) {
   assert(value >= 0 && value < 2);
@@ -341,6 +747,13 @@ interp_enum2str(enum e_interp_t value) {
   return interp_string_table[value];
 }
 
+const char*
+parallel_enum2str(enum e_parallel_t value) {
+  assert(value >= 0 && value < parallel_LAST);
+
+  return parallel_string_table[value];
+}
+
 const char*
 bool2str(bool_t value) {
   return bool_string_table[value ? 1 : 0];
@@ -372,25 +785,197 @@ create_lanczos_lut(const int kernel_order, const size_t npix,
   }
 }
 
+int
+poly_compile(struct driz_poly_t* poly,
+             const double* xco, const double* yco, const integer_t order,
+             struct driz_error_t* error) {
+  integer_t d, j, k;
+
+  assert(poly);
+  assert(xco);
+  assert(yco);
+
+  if (order < 1 || (order + 1) * (order + 2) / 2 > MAX_COEFFS) {
+    driz_error_format_message(error, "Invalid polynomial order %d", order);
+    return 1;
+  }
+
+  /* The coefficient of x^(d-j) y^j is at d(d+1)/2 + j on input and at
+     j(order+1) - j(j-1)/2 + (d-j) when grouped by the power of y */
+  for (d = 0; d <= order; ++d) {
+    for (j = 0; j <= d; ++j) {
+      k = j * (order + 1) - j * (j - 1) / 2 + (d - j);
+      poly->x[k] = xco[d * (d + 1) / 2 + j];
+      poly->y[k] = yco[d * (d + 1) / 2 + j];
+    }
+  }
+
+  poly->order = order;
+
+  return 0;
+}
+
+#define POLY_BLOCK 64
+
 void
-put_fill(struct driz_param_t* p, const float fill_value) {
-  integer_t i, j;
-  integer_t onx, ony;
+poly_eval_n(const struct driz_poly_t* poly, const integer_t n,
+            const double* xin, const double* yin,
+            const double xoff, const double yoff,
+            /* Output parameters */
+            double* xout, double* yout) {
+  double u[POLY_BLOCK], v[POLY_BLOCK];
+  double px[POLY_BLOCK], py[POLY_BLOCK];
+  double qx[POLY_BLOCK], qy[POLY_BLOCK];
+  const double* cx;
+  const double* cy;
+  integer_t order;
+  integer_t i, j, k, k0, nb;
+
+  assert(poly);
+  assert(poly->order > 0);
+
+  order = poly->order;
+
+  for (k0 = 0; k0 < n; k0 += POLY_BLOCK) {
+    nb = n - k0 < POLY_BLOCK ? n - k0 : POLY_BLOCK;
+
+    for (k = 0; k < nb; ++k) {
+      u[k] = xin[k0 + k] + xoff;
+      v[k] = yin[k0 + k] + yoff;
+      px[k] = 0.0;
+      py[k] = 0.0;
+    }
 
-  assert(p);
+    for (j = order; j >= 0; --j) {
+      /* The polynomial in x multiplying y^j */
+      cx = poly->x + j * (order + 1) - j * (j - 1) / 2;
+      cy = poly->y + j * (order + 1) - j * (j - 1) / 2;
+      for (k = 0; k < nb; ++k) {
+        qx[k] = cx[order - j];
+        qy[k] = cy[order - j];
+      }
+      for (i = order - j - 1; i >= 0; --i) {
+        for (k = 0; k < nb; ++k) {
+          qx[k] = qx[k] * u[k] + cx[i];
+          qy[k] = qy[k] * u[k] + cy[i];
+        }
+      }
+
+      for (k = 0; k < nb; ++k) {
+        px[k] = px[k] * v[k] + qx[k];
+        py[k] = py[k] * v[k] + qy[k];
+      }
+    }
+
+    for (k = 0; k < nb; ++k) {
+      xout[k0 + k] = px[k];
+      yout[k0 + k] = py[k];
+    }
+  }
+}
+
+/** Something done to each row of the output, n pixels long */
+typedef void (*output_row_func_t)(float* data, float* counts,
+                                  const integer_t n, const bool_t do_fill,
+                                  const float fill_value);
+
+/**
+Call func on each row of the output, or of each tile of a sparse
+output that has been touched.
+*/
+static void
+for_each_output_row(struct driz_param_t* p, output_row_func_t func,
+                    const bool_t do_fill, const float fill_value) {
+  const struct driz_tiles_t* t = p->output_tiles;
+  const struct driz_tile_t* tile;
+  integer_t i, j, edge, nx, ny;
+  integer_t onx, ony;
 
   onx = p->xmax - p->xmin + 1;
   ony = p->ymax - p->ymin + 1;
 
-  for (j = 0; j < ony; ++j) {
-    for (i = 0; i < onx; ++i) {
-      if (*output_counts_ptr(p, i, j) == 0.0) {
-        *output_data_ptr(p, i, j) = fill_value;
-      }
+  if (t == NULL) {
+    for (j = 0; j < ony; ++j) {
+      func(output_data_ptr(p, 0, j), output_counts_ptr(p, 0, j), onx,
+           do_fill, fill_value);
+    }
+    return;
+  }
+
+  edge = (integer_t)1 << t->shift;
+  for (i = 0; i < t->ntx * t->nty; ++i) {
+    if (!t->touched[i]) {
+      continue;
+    }
+    tile = driz_tiles_touch(p->output_tiles, i % t->ntx, i / t->ntx);
+    nx = MIN(edge, t->onx - (i % t->ntx) * edge);
+    ny = MIN(edge, t->ony - (i / t->ntx) * edge);
+    for (j = 0; j < ny; ++j) {
+      func(tile->data + (size_t)j * edge, tile->counts + (size_t)j * edge,
+           nx, do_fill, fill_value);
     }
   }
 }
 
+static void
+put_fill_row(float* data, float* counts, const integer_t n,
+             const bool_t do_fill UNUSED_PARAM, const float fill_value) {
+  integer_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (counts[i] == 0.0) {
+      data[i] = fill_value;
+    }
+  }
+}
+
+static void
+sum_output_row(float* data, float* counts, const integer_t n,
+               const bool_t do_fill UNUSED_PARAM,
+               const float fill_value UNUSED_PARAM) {
+  integer_t i;
+
+  for (i = 0; i < n; ++i) {
+    data[i] = (counts[i] == 0.0f) ? 0.0f : data[i] * counts[i];
+  }
+}
+
+static void
+normalize_output_row(float* data, float* counts, const integer_t n,
+                     const bool_t do_fill, const float fill_value) {
+  integer_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (counts[i] != 0.0f) {
+      data[i] /= counts[i];
+    } else if (do_fill) {
+      data[i] = fill_value;
+    }
+  }
+}
+
+void
+put_fill(struct driz_param_t* p, const float fill_value) {
+  assert(p);
+
+  for_each_output_row(p, &put_fill_row, TRUE, fill_value);
+}
+
+void
+sum_output(struct driz_param_t* p) {
+  assert(p);
+
+  for_each_output_row(p, &sum_output_row, FALSE, 0.0f);
+}
+
+void
+normalize_output(struct driz_param_t* p, const bool_t do_fill,
+                 const float fill_value) {
+  assert(p);
+
+  for_each_output_row(p, &normalize_output_row, do_fill, fill_value);
+}
+
 double
 mgf2(double lambda) {
   double sig, sig2;
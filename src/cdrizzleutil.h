@@ -11,6 +11,10 @@
 #endif
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*****************************************************************
  ERROR HANDLING
 */
@@ -115,6 +119,19 @@ enum e_unit_t {
   unit_cps
 };
 
+/**
+How the threads of a drizzle share it out (see dobox()).
+*/
+enum e_parallel_t {
+  parallel_bands,  /* Each thread drizzles bands of output rows */
+  parallel_gather, /* Each output pixel gathers the input that lands
+                      on it, for the point and turbo kernels */
+  parallel_atomic, /* Each thread drizzles runs of input rows into
+                      tiles of its own, added to the output as they
+                      fill; the same output to rounding only */
+  parallel_LAST
+};
+
 enum e_interp_t {
   interp_nearest,
   interp_bilinear,
@@ -128,6 +145,66 @@ enum e_interp_t {
   interp_LAST
 };
 
+/**
+How an input array is stored.  The value of a pixel is bscale * v +
+bzero, where v is the number stored, its bytes reversed first when
+swapped is set (a big-endian FITS array on a little-endian machine).
+*/
+enum e_pixel_t {
+  pixel_float32,
+  pixel_int16,
+  pixel_uint16,
+  pixel_LAST
+};
+
+struct driz_pixel_format_t {
+  enum e_pixel_t type;
+  bool_t swapped;
+  double bscale;
+  double bzero;
+};
+
+/** Native float32, to be read as it is */
+void
+driz_pixel_format_init(struct driz_pixel_format_t* format);
+
+/** Convert pixel \a index of the array \a raw stored as \a format */
+static inline_macro float
+raw_pixel_value(const struct driz_pixel_format_t* format, const void* raw,
+                const size_t index) {
+  const unsigned char* b;
+  union {
+    float f;
+    short s;
+    unsigned short u;
+    unsigned char b[4];
+  } v;
+  double value;
+
+  assert(format);
+  assert(raw);
+
+  if (format->type == pixel_float32) {
+    b = (const unsigned char*)raw + 4 * index;
+    if (format->swapped) {
+      v.b[0] = b[3]; v.b[1] = b[2]; v.b[2] = b[1]; v.b[3] = b[0];
+    } else {
+      v.b[0] = b[0]; v.b[1] = b[1]; v.b[2] = b[2]; v.b[3] = b[3];
+    }
+    value = (double)v.f;
+  } else {
+    b = (const unsigned char*)raw + 2 * index;
+    if (format->swapped) {
+      v.b[0] = b[1]; v.b[1] = b[0];
+    } else {
+      v.b[0] = b[0]; v.b[1] = b[1];
+    }
+    value = format->type == pixel_int16 ? (double)v.s : (double)v.u;
+  }
+
+  return (float)(format->bscale * value + format->bzero);
+}
+
 /* Lanczos values */
 struct lanczos_param_t {
   size_t nlut;
@@ -138,6 +215,19 @@ struct lanczos_param_t {
   float misval;
 };
 
+/**
+The mapping interface of the core: transform \a n points from input to
+output pixel coordinates (or, for blot, from output to input).  Any
+caller can provide one, with whatever it needs in \a state;
+default_mapping (cdrizzlemap.h) is the pixel-based one, and
+default_wcsmap (cdrizzlewcsmap.h, only in the Python extension) the one
+built on astropy.wcs.
+
+The arguments are the state, the offsets xd and yd (see map_value),
+the number of points, the input x and y, which the callback may
+overwrite, the output x and y, and the error to set on failure, when
+the callback must return non-zero.
+*/
 typedef int (*mapping_callback_t) \
   (void* state,
    const double, const double,
@@ -147,10 +237,212 @@ typedef int (*mapping_callback_t) \
    double* /*[n]*/, double* /*[n]*/,
    struct driz_error_t*);
 
+/*****************************************************************
+ INSTRUMENTATION
+*/
+
+/**
+Where the time of a call of dobox or doblot goes, and what became of
+its pixels.  Recording is switched on by pointing driz_param_t.stats
+at one of these, and compiled out altogether by defining
+DRIZ_NO_STATS.  Times are in seconds and accumulate over calls; with
+several threads (driz_param_t.nthreads), every time but the total is
+summed over the threads.
+*/
+struct driz_stats_t {
+  double total_time;   /* The whole of dobox or doblot */
+  double map_time;     /* map_value, i.e. the mapping callback */
+  double kernel_time;  /* Kernels, context updates included, or
+                          interpolation, less map_time */
+  double wcs_pix2sky_time; /* default_wcsmap: input pixels to sky */
+  double wcs_sky2pix_time; /* default_wcsmap: sky to output pixels */
+  double wcs_table_time;   /* default_wcsmap: interpolating its table */
+  integer_t nmap;  /* Points mapped */
+  integer_t nhit;  /* Pixels that landed on the output (drizzle) or
+                      were interpolated (blot) */
+  integer_t nmiss; /* Pixels that missed */
+  integer_t nskip; /* Input lines (drizzle) or blocks of output pixels
+                      (blot) skipped without mapping each pixel */
+};
+
+void
+driz_stats_init(struct driz_stats_t* stats);
+
+/**
+Add the times, and the points mapped, that one of the threads of a
+call recorded in \a from to \a to.  The times are then summed over the
+threads rather than taken from the clock.
+*/
+void
+driz_stats_add_times(struct driz_stats_t* to, const struct driz_stats_t* from);
+
+/** Seconds on a monotonic clock, for use in differences */
+double
+driz_timer(void);
+
+#ifdef DRIZ_NO_STATS
+#define DRIZ_STATS_ADD(stats, field, value) ((void)(value))
+#define DRIZ_STATS_TIC(stats, t0) ((void)(t0))
+#define DRIZ_STATS_TOC(stats, field, t0) ((void)(t0))
+#else
+/** Add \a value to \a field of \a stats, unless \a stats is NULL */
+#define DRIZ_STATS_ADD(stats, field, value) \
+  do { if (stats) (stats)->field += (value); } while (0)
+/** Start timing into \a t0 */
+#define DRIZ_STATS_TIC(stats, t0) \
+  do { if (stats) (t0) = driz_timer(); } while (0)
+/** Add the time since DRIZ_STATS_TIC to \a field */
+#define DRIZ_STATS_TOC(stats, field, t0) \
+  do { if (stats) (stats)->field += driz_timer() - (t0); } while (0)
+#endif
+
+/**
+The output coordinates of every point that the regular rows of a call
+of dobox or doblot will ask for, mapped ahead of time with a single
+call of the mapping callback (see map_table_fill in cdrizzlemap.h).
+Point i of row j of lattice l is the input point (x0 + xoff[l] + i *
+dx, y0 + yoff[l] + j).
+*/
+struct driz_map_table_t {
+  integer_t nx;
+  integer_t ny;
+  integer_t nlattice; /* 1, or 4 for the corners of the square kernel */
+  double x0;
+  double dx;
+  double y0;
+  double xoff[4];
+  double yoff[4];
+  double* x; /* [nlattice][ny][nx] */
+  double* y; /* [nlattice][ny][nx] */
+};
+
+/**
+A sparse output, cut into square tiles that are allocated only when
+first touched, so that its memory follows the area drizzled onto
+rather than the size of the output.  A tile never touched holds no
+data, no weight and no context.
+
+Out of core, the tiles live in slots of a file instead, and no more
+than max_resident of them are mapped into memory at once: touching
+another unmaps the one used least recently, which the system writes
+back.  Slots never touched take no room on disk in a sparse file.
+
+driz_param_t.output_tiles points at one of these instead of at the
+output_data, output_counts and output_context arrays.  If a tile cannot
+be allocated or mapped, failed is set and the scratch tile stands in
+for it, so that the caller can finish the row and report the error.
+*/
+struct driz_tile_t {
+  float* data; /* [edge][edge] */
+  float* counts; /* [edge][edge] */
+  integer_t* context; /* [nplanes][edge][edge] */
+};
+
+struct driz_tiles_t {
+  integer_t shift; /* log2 of the edge of a tile */
+  integer_t onx; /* Size of the output */
+  integer_t ony;
+  integer_t ntx; /* Tiles across and down */
+  integer_t nty;
+  integer_t nplanes; /* Planes of context held by each tile */
+  integer_t plane; /* The plane of context drizzled onto */
+  integer_t ntouched; /* Tiles drizzled onto */
+  bool_t failed;
+  struct driz_tile_t** tiles; /* [nty][ntx], NULL until touched, or
+                                 while not mapped */
+  char* touched; /* [nty][ntx] */
+  integer_t last; /* The tile used last */
+  struct driz_tile_t* scratch;
+
+  /* Out of core only: the file, or -1, the size of its slots, and the
+     tiles mapped, each with the clock when it was last used */
+  int fd;
+  size_t slot_bytes;
+  integer_t max_resident;
+  integer_t nresident;
+  integer_t* resident; /* [max_resident] */
+  struct driz_tile_t* resident_tiles; /* [max_resident] */
+  unsigned long* stamp; /* [max_resident] */
+  unsigned long clock;
+  integer_t nevict; /* Tiles unmapped to make room for others */
+};
+
+/**
+Set up an empty sparse output of onx x ony pixels, in tiles 2^shift
+pixels on a side, with nplanes planes of context.  With a filename,
+the tiles are kept in that file, which is created or truncated, with
+at most max_resident of them in memory.  Returns non-zero with the
+error set if it is out of memory or the file cannot be made.
+*/
+int
+driz_tiles_init(struct driz_tiles_t* t, const integer_t onx,
+                const integer_t ony, const integer_t shift,
+                const integer_t nplanes, const char* filename,
+                const integer_t max_resident, struct driz_error_t* error);
+
+void
+driz_tiles_free(struct driz_tiles_t* t);
+
+/**
+Empty an in-core sparse output, freeing its tiles, so that every tile
+is untouched again.
+*/
+void
+driz_tiles_clear(struct driz_tiles_t* t);
+
+/**
+Make tile (tx, ty) the one used last, allocating or mapping it if it
+is not in memory.
+*/
+struct driz_tile_t*
+driz_tiles_touch(struct driz_tiles_t* t, const integer_t tx,
+                 const integer_t ty);
+
+/**
+Copy rows y0 to y0 + ny - 1 of a sparse output into dense ny x onx
+arrays, of which context has nplanes planes.  Pixels of tiles never
+touched are set to 0.  Returns non-zero if a tile could not be mapped.
+*/
+int
+driz_tiles_read_rows(struct driz_tiles_t* t, const integer_t y0,
+                     const integer_t ny,
+                     /* Output parameters */
+                     float* data, float* counts, integer_t* context);
+
+/**
+The tile holding pixel (x, y) of a sparse output, touching it if it is
+not the one used last, and the offset of the pixel within it.
+*/
+static inline_macro struct driz_tile_t*
+driz_tile_at(struct driz_tiles_t* t, const integer_t x, const integer_t y,
+             /* Output parameters */
+             size_t* k) {
+  const integer_t tx = x >> t->shift;
+  const integer_t ty = y >> t->shift;
+  const integer_t mask = (1 << t->shift) - 1;
+
+  assert(x >= 0 && x < t->onx);
+  assert(y >= 0 && y < t->ony);
+
+  *k = ((size_t)(y & mask) << t->shift) + (size_t)(x & mask);
+
+  return ty * t->ntx + tx == t->last ? t->tiles[t->last] :
+    driz_tiles_touch(t, tx, ty);
+}
+
 struct driz_param_t {
   /* Drizzle callback to perform the actual drizzling */
   mapping_callback_t mapping_callback;
   void* mapping_callback_state;
+  /* Map the whole grid of a call of dobox or doblot at once, and
+     the table holding it while the call lasts */
+  bool_t map_batch;
+  struct driz_map_table_t* map_table;
+  /* Threads to drizzle or blot with (see driz_parallel_for() in
+     cdrizzlesched.h), for which the mapping callback must be safe to
+     call from several threads at once */
+  integer_t nthreads;
+  enum e_parallel_t parallel;
 
   /* Kernel shape and size */
   enum e_kernel_t kernel;
@@ -170,18 +462,38 @@ struct driz_param_t {
   enum e_unit_t in_units; /* was: INCPS, either counts or CPS */
   enum e_unit_t out_units; /* was: INCPS, either counts or CPS */
 
-  /* Input data */
+  /* Input data: the dny rows held, of which the first ny are drizzled,
+     and which may be a strip of the image, see dobox() */
   integer_t dny;
   integer_t dnx;
   integer_t ny;
   float* data; /* [dny][dnx] */
   float* weights; /* [dny][dnx] */
+  /* Data and weights stored other than as native float32, converted as
+     they are read, or NULL to read data and weights */
+  const void* data_raw; /* [dny][dnx] */
+  const void* weights_raw; /* [dny][dnx] */
+  struct driz_pixel_format_t data_format;
+  struct driz_pixel_format_t weights_format;
+  /* Weights built as they are read, see input_weight(): a data
+     quality array of 16-bit flags, byte-swapped when dq_swapped is set,
+     a pixel being good when it has no flags but those in dq_ignore;
+     and weights that are errors, weighing as their inverse squares */
+  const void* dq; /* [dny][dnx] */
+  bool_t dq_swapped;
+  integer_t dq_ignore;
+  bool_t weights_error;
 
   /* Output data */
   integer_t onx;
   integer_t ony;
   float* output_data; /* [ony][onx] */
   float* output_counts; /* [ony][onx] was: COU */
+  /* The output data holds the sum of the weighted data, rather than
+     its weighted mean, until normalize_output() is called */
+  bool_t output_sum;
+  /* A sparse output, used instead of the three arrays above when set */
+  struct driz_tiles_t* output_tiles;
   integer_t* output_context; /* [ony][onx] was: CONTIM */
 
   /* Blotting-specific parameters */
@@ -191,6 +503,13 @@ struct driz_param_t {
   float sinscl;
   float kscale;
   float kscale2;
+  integer_t blot_tile; /* Edge of square output tiles, 0 for row order */
+  integer_t blot_block_shift; /* log2 of the source block edge, 0 for rows */
+  integer_t blot_x1; /* Origin of the window of the source held in data */
+  integer_t blot_y1;
+  integer_t blot_wnx; /* Size of that window, 0 for the whole source */
+  integer_t blot_wny;
+  bool_t blot_outside; /* Set by doblot when a point maps out of the window */
 
   double ox;
   double oy;
@@ -232,6 +551,9 @@ struct driz_param_t {
   double scale2;
   double x_scale;
   double y_scale;
+
+  /* Instrumentation, or NULL to record none */
+  struct driz_stats_t* stats;
 };
 
 /**
@@ -266,9 +588,81 @@ weights_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
   return (p->weights + (y * p->dnx) + x);
 }
 
+/** Pixel (x, y) of the input, however it is stored */
+static inline_macro float
+input_value(struct driz_param_t* p, integer_t x, integer_t y) {
+  if (p->data_raw == NULL) {
+    return *data_ptr(p, x, y);
+  }
+  assert(x >= 0 && x < p->dnx);
+  assert(y >= 0 && y < p->dny);
+  return raw_pixel_value(&p->data_format, p->data_raw,
+                         (size_t)y * (size_t)p->dnx + (size_t)x);
+}
+
+/** Whether pixel (x, y) of the input has no data quality flags but
+    those ignored */
+static inline_macro bool_t
+input_good(struct driz_param_t* p, integer_t x, integer_t y) {
+  const unsigned char* b;
+  union {
+    unsigned short u;
+    unsigned char b[2];
+  } v;
+
+  if (p->dq == NULL) {
+    return TRUE;
+  }
+  assert(x >= 0 && x < p->dnx);
+  assert(y >= 0 && y < p->dny);
+  b = (const unsigned char*)p->dq +
+    2 * ((size_t)y * (size_t)p->dnx + (size_t)x);
+  if (p->dq_swapped) {
+    v.b[0] = b[1]; v.b[1] = b[0];
+  } else {
+    v.b[0] = b[0]; v.b[1] = b[1];
+  }
+  return ((unsigned int)v.u & ~(unsigned int)p->dq_ignore) == 0;
+}
+
+/** The weight of pixel (x, y) of the input scaled by the weight
+    scale: 0 for a pixel with data quality flags not ignored or whose
+    error is not positive, and without weights the weight scale alone.
+    A negative weight scale removes the input, see update_data() */
+static inline_macro float
+input_weight(struct driz_param_t* p, integer_t x, integer_t y) {
+  float w;
+
+  if (!input_good(p, x, y)) {
+    return 0.0f;
+  }
+
+  if (p->weights_raw != NULL) {
+    assert(x >= 0 && x < p->dnx);
+    assert(y >= 0 && y < p->dny);
+    w = raw_pixel_value(&p->weights_format, p->weights_raw,
+                        (size_t)y * (size_t)p->dnx + (size_t)x);
+  } else if (p->weights) {
+    w = *weights_ptr(p, x, y);
+  } else {
+    return p->weight_scale;
+  }
+
+  if (p->weights_error) {
+    w = w > 0.0f ? 1.0f / (w * w) : 0.0f;
+  }
+
+  return w * p->weight_scale;
+}
+
 static inline_macro float*
 output_data_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
+  size_t k;
+
   assert(p);
+  if (p->output_tiles) {
+    return driz_tile_at(p->output_tiles, x, y, &k)->data + k;
+  }
   assert(p->output_data);
   assert(x >= 0 && x < p->onx);
   assert(y >= 0 && y < p->ony);
@@ -277,7 +671,12 @@ output_data_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
 
 static inline_macro float*
 output_counts_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
+  size_t k;
+
   assert(p);
+  if (p->output_tiles) {
+    return driz_tile_at(p->output_tiles, x, y, &k)->counts + k;
+  }
   assert(p->output_counts);
   assert(x >= 0 && x < p->onx);
   assert(y >= 0 && y < p->ony);
@@ -286,7 +685,14 @@ output_counts_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
 
 static inline_macro integer_t*
 output_context_ptr(struct driz_param_t* p, integer_t x, integer_t y) {
+  const struct driz_tiles_t* t = p->output_tiles;
+  size_t k;
+
   assert(p);
+  if (t) {
+    return driz_tile_at(p->output_tiles, x, y, &k)->context +
+      ((size_t)t->plane << (2 * t->shift)) + k;
+  }
   assert(p->output_context);
   assert(x >= 0 && x < p->onx);
   assert(y >= 0 && y < p->ony);
@@ -329,6 +735,9 @@ unit_str2enum(const char* s, enum e_unit_t* result, struct driz_error_t* error);
 int
 interp_str2enum(const char* s, enum e_interp_t* result, struct driz_error_t* error);
 
+int
+parallel_str2enum(const char* s, enum e_parallel_t* result, struct driz_error_t* error);
+
 const char*
 shift_enum2str(enum e_shift_t value);
 
@@ -344,6 +753,9 @@ unit_enum2str(enum e_unit_t value);
 const char*
 interp_enum2str(enum e_interp_t value);
 
+const char*
+parallel_enum2str(enum e_parallel_t value);
+
 const char*
 bool2str(bool_t value);
 
@@ -371,6 +783,23 @@ create_lanczos_lut(const int kernel_order, const size_t npix,
 void
 put_fill(struct driz_param_t* p, const float fill_value);
 
+/**
+Turn output data holding the weighted mean of the data drizzled onto
+it into the sum of the weighted data, so that it may be drizzled onto
+with output_sum set.
+*/
+void
+sum_output(struct driz_param_t* p);
+
+/**
+Turn output data holding the sum of the weighted data into its
+weighted mean, dividing by the output weights, and put in the fill
+value (if do_fill is set) where nothing was drizzled, in one pass.
+*/
+void
+normalize_output(struct driz_param_t* p, const bool_t do_fill,
+                 const float fill_value);
+
 /**
  Calculate the refractive index of MgF2 for a given C wavelength (in
  nm) using the formula given by Trauger (1995)
@@ -441,8 +870,8 @@ Evaluate a cubic geometric distortion in 2D
 static inline_macro double
 eval3(const double x, const double y, const double* co) {
 
-  register double x2 = x * x;
-  register double y2 = y * y;
+  const double x2 = x * x;
+  const double y2 = y * y;
 
   assert(co);
 
@@ -473,10 +902,10 @@ Evaluate a 4th order (quartic) geometric distortion in 2d
 static inline_macro double
 eval4(const double x, const double y, const double* co) {
 
-  register double x2 = x * x;
-  register double y2 = y * y;
-  register double x3 = x2 * x;
-  register double y3 = y2 * y;
+  const double x2 = x * x;
+  const double y2 = y * y;
+  const double x3 = x2 * x;
+  const double y3 = y2 * y;
 
   assert(co);
 
@@ -512,11 +941,11 @@ Evaluate a 5th order geometric distortion in 2d
 static inline_macro double
 eval5(const double x, const double y, const double* co) {
 
-  register double x2 = x * x;
-  register double y2 = y * y;
-  register double x3 = x2 * x;
-  register double y3 = y2 * y;
-  register double xy = x * y;
+  const double x2 = x * x;
+  const double y2 = y * y;
+  const double x3 = x2 * x;
+  const double y3 = y2 * y;
+  const double xy = x * y;
 
   assert(co);
 
@@ -545,58 +974,57 @@ eval5(const double x, const double y, const double* co) {
 }
 
 /**
-Evaluate the value of a general 2d polynomial in X and Y
-complete with "half" cross-terms.
+A general 2d polynomial in X and Y, complete with "half" cross-terms,
+compiled into Horner form.
+
+The coefficients are given in the usual order of the distortion
+coefficients, in which the terms of total degree d run from x^d
+through x^(d-1) y down to y^d.  poly_compile() regroups them by the
+power of y, so that the coefficients of x^0 y^j, x^1 y^j, ...,
+x^(order-j) y^j are contiguous and each group can be evaluated as a
+Horner scheme in x, nested inside a Horner scheme in y.  The x and y
+polynomials share their powers and are always evaluated together.
+
+For orders lower than 6 it is slightly more efficient to use the
+specific (eval4 etc) routines instead.
+*/
+struct driz_poly_t {
+  integer_t order; /* 0 when nothing has been compiled */
+  double x[MAX_COEFFS];
+  double y[MAX_COEFFS];
+};
 
-For orders lower than 7 it is slightly more efficient to
-use the specific (eval4 etc) routines instead.
+/**
+Compile the x and y coefficients of a polynomial of the given order
+into Horner form.
 
-@param x The x coordinate
+@param poly The compiled polynomial
 
-@param y The y coordinate
-
-@param co An array of length 10 of coefficients
+@param xco, yco Arrays of (order+1)(order+2)/2 coefficients
 
 @param order The order of the polynomial
 
-@param result The distorted value
-
 @return 1 if error occurred
 */
-static inline_macro int
-evaln(const double x, const double y, const double* co, const integer_t order,
-      /* Output parameters */
-      double* result, struct driz_error_t* error) {
-  integer_t n, m;
-  double t;
-  const double* c;
-  double xco, yco;
-
-  assert(co);
-
-  t = 0.0;
-  c = co;
-  errno = 0;
-  for (n = 1; n <= order + 1; ++n) {
-    for (m = 1; m <= n; ++m) {
-      xco = pow(x, (double)(n - m));
-      if (errno != 0) {
-        driz_error_set_message(error, "pow failed");
-        return 1;
-      }
-      yco = pow(y, (double)(m - 1));
-      if (errno != 0) {
-        driz_error_set_message(error, "pow failed");
-        return 1;
-      }
-      t += *(c++) * xco * yco;
-    }
-  }
+int
+poly_compile(struct driz_poly_t* poly,
+             const double* xco, const double* yco, const integer_t order,
+             struct driz_error_t* error);
 
-  *result = t;
+/**
+Evaluate a compiled polynomial at n points, (xin[i] + xoff, yin[i] +
+yoff).  The points are processed in blocks with the loop over the
+points innermost, so that a whole row is evaluated by one vectorized
+loop.  xout/yout may be the same arrays as xin/yin.
 
-  return 0;
-}
+was: EVALN
+*/
+void
+poly_eval_n(const struct driz_poly_t* poly, const integer_t n,
+            const double* xin, const double* yin,
+            const double xoff, const double yoff,
+            /* Output parameters */
+            double* xout, double* yout);
 
 /**
 Evaluate a 3rd order radial geometric distortion in 2d
@@ -630,4 +1058,8 @@ rad3(const double x, const double y, const double* co,
   *yo = f*y;
 }
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* CDRIZZLEUTIL_H */
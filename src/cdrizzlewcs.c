@@ -1,5 +1,3 @@
-#define NO_IMPORT_ARRAY
-#define NO_IMPORT_ASTROPY_WCS_API
 #include "driz_portability.h"
 #include "cdrizzlewcs.h"
 #include "cdrizzlemap.h"
@@ -416,6 +414,7 @@ wcs_derive_linear(struct mapping_param_t* m,
   double xin[4], yin[4], xout[4], yout[4], x[4], y[4];
   double ra, dec;
   double x0, y0, a, b, c, d;
+  struct driz_poly_t poly;
   integer_t coeff_type;
   integer_t i;
 
@@ -504,10 +503,10 @@ wcs_derive_linear(struct mapping_param_t* m,
       y[i] = eval5(xin[i] - xcen + xdoff, yin[i] - ycen + ydoff, m->y_coeffs) - ydoff;
     }
   } else if (coeff_type >= 6 || coeff_type == 1 || coeff_type == 2) {
+    if (poly_compile(&poly, m->x_coeffs, m->y_coeffs, coeff_type, error))
+      return 1;
+    poly_eval_n(&poly, 4, xin, yin, xdoff - xcen, ydoff - ycen, x, y);
     for (i = 0; i < 4; ++i) {
-      if (evaln(xin[i] - xcen + xdoff, yin[i] - ycen + ydoff, m->x_coeffs, coeff_type, &x[i], error) ||
-          evaln(xin[i] - xcen + xdoff, yin[i] - ycen + ydoff, m->y_coeffs, coeff_type, &y[i], error))
-        return 1;
       x[i] -= xdoff;
       y[i] -= ydoff;
     }
@@ -4,6 +4,10 @@
 #include "cdrizzlemap.h"
 #include "cdrizzleutil.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
 Derive best linear transformation coefficients to map
 pixel positions from one world coordinate system to another.
@@ -49,4 +53,8 @@ blot_update_wcs(struct driz_param_t* p,
                 double wcsout[8],
                 struct driz_error_t* error);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* CDRIZZLEWCS_H */
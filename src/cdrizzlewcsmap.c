@@ -0,0 +1,488 @@
+#define NO_IMPORT_ARRAY
+#define NO_IMPORT_ASTROPY_WCS_API
+#include "driz_portability.h"
+#include "cdrizzlewcsmap.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int
+default_wcsmap_direct(struct wcsmap_param_t* m,
+                      const double xd, const double yd,
+                      const integer_t n,
+                      double* xin /*[n]*/, double* yin /*[n]*/,
+                      /* Output parameters */
+                      double* xout, double* yout,
+                      struct driz_error_t* error) {
+
+  integer_t  i;
+  int        status;
+  double    *memory = NULL;
+  double    *ptr    = NULL;
+  double    *xyin   = NULL;
+  double    *skyout = NULL;
+  double    *xyout  = NULL;
+  double    *imgcrd = NULL;
+  double    *phi    = NULL;
+  double    *theta  = NULL;
+  int       *stat   = NULL;
+  double     t0     = 0.0;
+
+  /* Allocate memory for new 2-D array */
+  ptr = memory = (double *) malloc(n * 10 * sizeof(double));
+  if (memory == NULL) return 1;
+
+  xyin = ptr;
+  ptr += n * 2;
+  xyout = ptr;
+  ptr += n * 2;
+  skyout = ptr;
+  ptr += n * 2;
+  imgcrd = ptr;
+  ptr += n * 2;
+  phi = ptr;
+  ptr += n;
+  theta = ptr;
+
+  stat = (int *)malloc(n * sizeof(int));
+  if (stat == NULL) {
+      free(memory);
+      return 1;
+  }
+
+  /* The input arrays need to be converted to 2-D arrays for input
+     to the PyWCS (and related) functions. */
+
+  /* Populate new 2-D array with values from x and y input arrays */
+  for (i = 0; i < n; ++i) {
+    xyin[2*i] = xin[i];
+    xyin[2*i+1] = yin[i];
+  }
+
+  /*
+    Apply pix2sky() transformation from PyWCS
+  */
+
+  DRIZ_STATS_TIC(m->stats, t0);
+  wcsprm_python2c(m->input_wcs->wcs);
+  status = pipeline_all_pixel2world(m->input_wcs, n, 2, xyin, skyout);
+  wcsprm_c2python(m->input_wcs->wcs);
+  if (status) {
+    free(memory);
+    free(stat);
+    return 1;
+  }
+  DRIZ_STATS_TOC(m->stats, wcs_pix2sky_time, t0);
+
+  /*
+    Finally, call wcs_sky2pix() for the output object.
+  */
+  DRIZ_STATS_TIC(m->stats, t0);
+  wcsprm_python2c(m->output_wcs->wcs);
+  status = wcss2p(m->output_wcs->wcs, n, 2,
+                  skyout, phi, theta, imgcrd, xyout, stat);
+  wcsprm_c2python(m->output_wcs->wcs);
+  if (status) {
+    free(memory);
+    free(stat);
+    return 1;
+  }
+  DRIZ_STATS_TOC(m->stats, wcs_sky2pix_time, t0);
+
+  /*
+    Transform results back to 2 1-D arrays, like the input.
+  */
+  for (i = 0; i < n; ++i){
+    xout[i] = xyout[2*i];
+    yout[i] = xyout[2*i+1];
+  }
+
+  /* Free memory allocated to internal 2-D arrays */
+  free(memory);
+  free(stat);
+  return 0;
+}
+
+static int
+default_wcsmap_interpolate(struct wcsmap_param_t* m,
+                           const double xd, const double yd,
+                           const integer_t n,
+                           double* xin /*[n]*/, double* yin /*[n]*/,
+                           /* Output parameters */
+                           double* xout, double* yout,
+                           struct driz_error_t* error) {
+
+  int     i;
+  double *xiptr;
+  double *yiptr;
+  double *xoptr;
+  double *yoptr;
+  double *table;
+  double  x, y;
+  int     xi, yi;
+  double  xf, yf, ixf, iyf;
+  double  tabx00, tabx01, tabx10, tabx11;
+  double  t0 = 0.0;
+
+  DRIZ_STATS_TIC(m->stats, t0);
+
+  /* do the bilinear interpolation */
+  xiptr = xin;
+  yiptr = yin;
+  xoptr = xout;
+  yoptr = yout;
+  table = m->table;
+
+#define TABLE_X(x, y) (table[((y)*m->snx + (x))*2])
+#define TABLE_Y(x, y) (table[((y)*m->snx + (x))*2 + 1])
+
+  for (i = 0; i < n; ++i) {
+    x = *xiptr++ / m->factor;
+    y = *yiptr++ / m->factor;
+    xi = (int)floor(x);
+    yi = (int)floor(y);
+    xf = x - (double)xi;
+    yf = y - (double)yi;
+    ixf = 1.0 - xf;
+    iyf = 1.0 - yf;
+
+    tabx00 = TABLE_X(xi, yi);
+    tabx10 = TABLE_X(xi+1, yi);
+    tabx01 = TABLE_X(xi, yi+1);
+    tabx11 = TABLE_X(xi+1, yi+1);
+
+    /* Account for interpolating across 360-0 boundary */
+    if ((tabx00 - tabx10) > 359) {
+      tabx00 -= 360.0;
+      tabx01 -= 360.0;
+    } else if ((tabx00 - tabx10) < -359) {
+      tabx10 -= 360.0;
+      tabx11 -= 360.0;
+    }
+
+    *xoptr++ =
+      tabx00 * ixf * iyf +
+      tabx10 * xf * iyf +
+      tabx01 * ixf * yf +
+      tabx11 * xf * yf;
+
+    *yoptr++ =
+      TABLE_Y(xi, yi)     * ixf * iyf +
+      TABLE_Y(xi+1, yi)   * xf * iyf +
+      TABLE_Y(xi, yi+1)   * ixf * yf +
+      TABLE_Y(xi+1, yi+1) * xf * yf;
+  }
+
+#undef TABLE_X
+#undef TABLE_Y
+
+  DRIZ_STATS_TOC(m->stats, wcs_table_time, t0);
+
+  return 0;
+}
+
+static int
+default_wcsmap_affine(struct wcsmap_param_t* m,
+                      const integer_t n,
+                      const double* xin /*[n]*/, const double* yin /*[n]*/,
+                      /* Output parameters */
+                      double* xout, double* yout) {
+  const double* a = m->affine;
+  double x, y;
+  integer_t i;
+
+  for (i = 0; i < n; ++i) {
+    x = xin[i];
+    y = yin[i];
+    xout[i] = a[0] * x + a[1] * y + a[2];
+    yout[i] = a[3] * x + a[4] * y + a[5];
+  }
+
+  return 0;
+}
+
+/* Points along each side of the grid used to test for an affine
+   mapping */
+#define AFFINE_NPOINT 9
+
+/**
+Fit an affine transformation to the mapping at a grid of points over
+the nx x ny input, and keep it in m->affine if it reproduces every
+point to within WCSMAP_AFFINE_TOLERANCE.  Only an input without SIP,
+det2im or cpdis distortion is considered, since a distortion table
+may vary on scales finer than the grid.
+*/
+static void
+find_affine(struct wcsmap_param_t* m, const int nx, const int ny) {
+  const integer_t n = AFFINE_NPOINT * AFFINE_NPOINT;
+  double xin[AFFINE_NPOINT * AFFINE_NPOINT], yin[AFFINE_NPOINT * AFFINE_NPOINT];
+  double xout[AFFINE_NPOINT * AFFINE_NPOINT], yout[AFFINE_NPOINT * AFFINE_NPOINT];
+  double mx, my, mu, mv;
+  double sxx, sxy, syy, sux, suy, svx, svy;
+  double dx, dy, du, dv, det;
+  double* a = m->affine;
+  struct driz_error_t error;
+  integer_t i, j, k;
+
+  m->is_affine = 0;
+
+  if (m->input_wcs->sip != NULL ||
+      m->input_wcs->det2im[0] != NULL || m->input_wcs->det2im[1] != NULL ||
+      m->input_wcs->cpdis[0] != NULL || m->input_wcs->cpdis[1] != NULL)
+    return;
+
+  /* Over the same range as the table, including the pixel edges */
+  for (j = 0; j < AFFINE_NPOINT; ++j) {
+    for (i = 0; i < AFFINE_NPOINT; ++i) {
+      k = j * AFFINE_NPOINT + i;
+      xin[k] = (double)(nx + 1) * (double)i / (double)(AFFINE_NPOINT - 1);
+      yin[k] = (double)(ny + 1) * (double)j / (double)(AFFINE_NPOINT - 1);
+    }
+  }
+
+  /* Any failure is left for the mapping proper to report */
+  driz_error_init(&error);
+  if (default_wcsmap_direct(m, 0.0, 0.0, n, xin, yin, xout, yout, &error))
+    return;
+
+  mx = my = mu = mv = 0.0;
+  for (k = 0; k < n; ++k) {
+    mx += xin[k];
+    my += yin[k];
+    mu += xout[k];
+    mv += yout[k];
+  }
+  mx /= (double)n;
+  my /= (double)n;
+  mu /= (double)n;
+  mv /= (double)n;
+
+  sxx = sxy = syy = sux = suy = svx = svy = 0.0;
+  for (k = 0; k < n; ++k) {
+    dx = xin[k] - mx;
+    dy = yin[k] - my;
+    du = xout[k] - mu;
+    dv = yout[k] - mv;
+    sxx += dx * dx;
+    sxy += dx * dy;
+    syy += dy * dy;
+    sux += du * dx;
+    suy += du * dy;
+    svx += dv * dx;
+    svy += dv * dy;
+  }
+
+  det = sxx * syy - sxy * sxy;
+  if (det == 0.0)
+    return;
+
+  a[0] = (sux * syy - suy * sxy) / det;
+  a[1] = (suy * sxx - sux * sxy) / det;
+  a[2] = mu - a[0] * mx - a[1] * my;
+  a[3] = (svx * syy - svy * sxy) / det;
+  a[4] = (svy * sxx - svx * sxy) / det;
+  a[5] = mv - a[3] * mx - a[4] * my;
+
+  for (k = 0; k < n; ++k) {
+    du = a[0] * xin[k] + a[1] * yin[k] + a[2] - xout[k];
+    dv = a[3] * xin[k] + a[4] * yin[k] + a[5] - yout[k];
+    if (!(fabs(du) <= WCSMAP_AFFINE_TOLERANCE &&
+          fabs(dv) <= WCSMAP_AFFINE_TOLERANCE))
+      return;
+  }
+
+  m->is_affine = 1;
+}
+
+/*
+
+Default WCS mapping code
+
+*/
+int
+default_wcsmap(void* state,
+               const double xd, const double yd,
+               const integer_t n,
+               double* xin /*[n]*/, double* yin /*[n]*/,
+               /* Output parameters */
+               double* xout, double* yout,
+               struct driz_error_t* error) {
+
+  struct wcsmap_param_t* m = (struct wcsmap_param_t*)state;
+
+  if (m->factor <= 0) {
+    return default_wcsmap_direct(m, xd, yd, n, xin, yin, xout, yout, error);
+  } else if (m->is_affine) {
+    return default_wcsmap_affine(m, n, xin, yin, xout, yout);
+  } else {
+    return default_wcsmap_interpolate(m, xd, yd, n, xin, yin, xout, yout, error);
+  }
+}
+
+int
+default_wcsmap_init(struct wcsmap_param_t* m,
+                    pipeline_t* input,
+                    pipeline_t* output,
+                    int nx, int ny,
+                    double factor,
+                    struct driz_error_t* error) {
+  int     n;
+  int     table_size;
+  double *pixcrd = NULL;
+  double *ptr    = NULL;
+  double *tmp    = NULL;
+  double *phi    = NULL;
+  double *theta  = NULL;
+  double *imgcrd = NULL;
+  int    *stat   = NULL;
+  int     snx = nx + 2;
+  int     sny = ny + 2;
+  int     i;
+  int     j;
+  int     istat;
+
+  assert(m);
+  assert(input);
+  assert(output);
+  assert(m->input_wcs == NULL);
+  assert(m->output_wcs == NULL);
+  assert(m->table == NULL);
+
+  m->input_wcs = input;
+  m->output_wcs = output;
+
+  /* A factor of 0 asks for WCSLIB at every point, which an affine
+     approximation would not honour */
+  m->is_affine = 0;
+  if (factor > 0) {
+    find_affine(m, nx, ny);
+  }
+
+  if (factor > 0 && !m->is_affine) {
+    snx = (int)((double)nx / factor) + 2;
+    sny = (int)((double)ny / factor) + 2;
+
+    n = (snx) * (sny);
+    table_size = n << 1;
+
+    pixcrd = malloc(table_size * sizeof(double));
+    if (pixcrd == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    m->table = malloc(table_size * sizeof(double));
+    if (m->table == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    tmp = malloc(table_size * sizeof(double));
+    if (tmp == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    phi = malloc(n * sizeof(double));
+    if (phi == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    theta = malloc(n * sizeof(double));
+    if (theta == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    imgcrd = malloc(table_size * sizeof(double));
+    if (imgcrd == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    stat = malloc(n * sizeof(int));
+    if (stat == NULL) {
+      driz_error_set_message(error, "Out of memory");
+      goto exit;
+    }
+
+    ptr = pixcrd;
+    for (j = 0; j < sny; ++j) {
+      for (i = 0; i < snx; ++i) {
+        *ptr++ = (double)i * factor;
+        *ptr++ = (double)j * factor;
+      }
+    }
+
+    wcsprm_python2c(input->wcs);
+    istat = pipeline_all_pixel2world(input, n, 2, pixcrd, tmp);
+    wcsprm_c2python(input->wcs);
+
+    if (istat) {
+      free(m->table);
+      m->table = NULL;
+      driz_error_set_message(error, wcslib_get_error_message(istat));
+      goto exit;
+    }
+
+    wcsprm_python2c(output->wcs);
+    istat = wcss2p(output->wcs, n, 2, tmp, phi, theta, imgcrd, m->table, stat);
+    wcsprm_c2python(output->wcs);
+
+    if (istat) {
+      free(m->table);
+      m->table = NULL;
+      driz_error_set_message(error, wcslib_get_error_message(istat));
+      goto exit;
+    }
+  } /* End if_then for factor > 0 */
+
+  m->nx = nx;
+  m->ny = ny;
+  m->snx = snx;
+  m->sny = sny;
+  m->factor = factor;
+
+ exit:
+
+  free(pixcrd);
+  free(tmp);
+  free(phi);
+  free(theta);
+  free(imgcrd);
+  free(stat);
+
+  return 0;
+}
+
+void
+wcsmap_param_dump(struct wcsmap_param_t* m) {
+  assert(m);
+
+  printf("WCS MAPPING PARAMETERS:\n"
+         "input WCS:            \n");
+  wcsprt(m->input_wcs->wcs);
+  printf("output WCS:           \n");
+  wcsprt(m->input_wcs->wcs);
+}
+
+void
+wcsmap_param_free(struct wcsmap_param_t* m) {
+  free(m->table);
+  wcsmap_param_init(m);
+}
+
+void
+wcsmap_param_init(struct wcsmap_param_t* m) {
+  assert(m);
+
+  /* Pointers to the PyWCS objects */
+  m->input_wcs = NULL;
+  m->output_wcs = NULL;
+  m->table = NULL;
+  m->stats = NULL;
+  m->is_affine = 0;
+}
@@ -0,0 +1,91 @@
+#ifndef CDRIZZLEWCSMAP_H
+#define CDRIZZLEWCSMAP_H
+
+/*
+The DefaultWCSMapping, built on the astropy.wcs pipeline and hence on
+Python.  It is kept apart from the rest of the mapping code so that
+the core (libcdrizzle) builds and runs without Python.
+*/
+
+#include "astropy_wcs_api.h"
+
+#include "driz_portability.h"
+#include "cdrizzleutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+
+Declarations for supporting the DefaultWCSMapping (WCS-based)
+transformations.
+
+*/
+struct wcsmap_param_t {
+  /* Pointers to PyWCS objects for input and output WCS */
+  pipeline_t* input_wcs;
+  pipeline_t* output_wcs;
+  double*     table;
+  int         nx, ny;
+  int         snx, sny;
+  double      factor;
+  /* Set, with a positive factor, when the mapping is affine to within
+     WCSMAP_AFFINE_TOLERANCE over the input, xout = affine[0] x + affine[1] y + affine[2] and
+     yout = affine[3] x + affine[4] y + affine[5] */
+  int         is_affine;
+  double      affine[6];
+  /* Where to record the time spent in WCSLIB, or NULL */
+  struct driz_stats_t* stats;
+};
+
+/* Largest departure from the fitted affine transformation, in output
+   pixels, for which a mapping is treated as affine */
+#define WCSMAP_AFFINE_TOLERANCE 1e-4
+
+/**
+Initialize all of the members of the mapping_param_t to sane default
+values, mostly zeroes.  Note, these are not *meaningful* values, just
+ones that help with memory management etc.  It is up to users of the
+struct, e.g. cdrizzle_, to fill the struct with valid parameters.
+*/
+void
+wcsmap_param_init(struct wcsmap_param_t* m);
+
+void
+wcsmap_param_dump(struct wcsmap_param_t* m);
+
+void
+wcsmap_param_free(struct wcsmap_param_t* m);
+
+int
+default_wcsmap(void* state,
+                const double xd, const double yd,
+                const integer_t n,
+                double* xin /*[n]*/, double* yin /*[n]*/,
+                /* Output parameters */
+                double* xout, double* yout,
+                struct driz_error_t* error);
+/**
+Set up the mapping from the input to the output WCS of an nx x ny
+input.  With a \a factor of 0, the mapping is evaluated through WCSLIB
+at each point.  Otherwise, when the input has no SIP, det2im or cpdis
+distortion and the mapping is affine to within WCSMAP_AFFINE_TOLERANCE
+at a grid of points over the input, as for already resampled images
+or aligned skycells, the affine transformation is applied in closed
+form and no table is built; failing that, the mapping is interpolated
+in a table sampled every \a factor pixels.
+*/
+int
+default_wcsmap_init(struct wcsmap_param_t* m,
+                    pipeline_t* input,
+                    pipeline_t* output,
+                    int nx, int ny, double factor,
+                    /* Output parameters */
+                    struct driz_error_t* error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDRIZZLEWCSMAP_H */
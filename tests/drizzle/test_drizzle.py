@@ -50,3 +50,1040 @@ def test_zero_input_weight(kernel):
 
     # check that no pixel with 0 weight has any counts:
     assert np.allclose(np.sum(np.abs(outsci[(outwht == 0)])), 0)
+
+
+def test_driz_stats():
+    """
+    Test that tdriz accounts for every input pixel in its statistics
+    """
+    insci = np.ones((200, 400), dtype=np.float32)
+    inwht = np.ones((200, 400), dtype=np.float32)
+    outsci = np.zeros((210, 410), dtype=np.float32)
+    outwht = np.zeros((210, 410), dtype=np.float32)
+    outctx = np.zeros((210, 410), dtype=np.int32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---CAR', 'DEC--CAR']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cdelt = [1e-3, 1e-3]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---CAR', 'DEC--CAR']
+    w2.wcs.crpix = [106, 106]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cdelt = [1e-3, 1e-3]
+    w2.wcs.set()
+
+    mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+
+    _vers, nmiss, nskip, stats = cdriz.tdriz(
+        insci, inwht, outsci, outwht,
+        outctx, 1, 0, 1, 1, 200,
+        1.0, 1.0, 1.0, 'center', 1.0,
+        'square', 'cps', 1.0, 1.0,
+        'INDEF', 0, 0, 1, mapping, stats=True
+    )
+
+    assert stats['nmiss'] == nmiss > 0
+    assert stats['nskip'] == nskip
+    assert stats['nhit'] + stats['nmiss'] == insci.size
+    assert stats['nmap'] > 0
+    assert 0 < stats['map_time'] <= stats['total_time']
+
+
+def test_blot_stats():
+    """
+    Test that tblot returns its status along with its statistics, which
+    account for every output pixel
+    """
+    insci = np.ones((200, 400), dtype=np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---CAR', 'DEC--CAR']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cdelt = [1e-3, 1e-3]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---CAR', 'DEC--CAR']
+    w2.wcs.crpix = [106.3, 105.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cdelt = [1e-3, 1e-3]
+    w2.wcs.set()
+
+    mapping = cdriz.DefaultWCSMapping(w2, w1, 410, 210, 1)
+    outsci = np.zeros((210, 410), dtype=np.float32)
+    status, stats = cdriz.tblot(
+        insci, outsci, 1, 400, 1, 200, 1.0, 1.0, 1.0, 1.0,
+        'center', 'linear', 1.0, 0.0, 1.0, 1, mapping, stats=True
+    )
+
+    assert status == 0
+    assert stats['nmiss'] > 0
+    assert stats['nhit'] + stats['nmiss'] == outsci.size
+    assert 0 < stats['map_time'] <= stats['total_time']
+    assert 'context_time' not in stats
+
+
+@pytest.mark.parametrize('interp', ['nearest', 'linear', 'poly5', 'lan3'])
+def test_blot_tiled_matches_rows(interp):
+    """
+    Test that tiled blotting from a blocked source gives the same output
+    as blotting row by row
+    """
+    insci = np.random.RandomState(0).rand(300, 350).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [176, 151]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [120.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for tile, block in [(0, 0), (37, 0), (32, 16)]:
+        mapping = cdriz.DefaultWCSMapping(w2, w1, 240, 220, 1)
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        cdriz.tblot(
+            insci, outsci, 1, 350, 1, 300, 1.0, 1.0, 1.0, 1.0,
+            'center', interp, 1.0, 0.0, 1.0, 1, mapping,
+            tile=tile, block=block
+        )
+        outputs.append(outsci)
+
+    assert np.any(outputs[0] != 0)
+    for outsci in outputs[1:]:
+        assert np.array_equal(outsci, outputs[0])
+
+
+@pytest.mark.parametrize('interp', ['linear', 'poly5', 'lan3'])
+def test_blot_source_window(interp):
+    """
+    Test that blotting an output that only partly overlaps the source,
+    which reads only the overlapping window of an array source, gives
+    the same output as blotting from the whole source
+    """
+    # Not C-contiguous, so only the window of it is copied
+    insci = np.asfortranarray(
+        np.random.RandomState(0).rand(300, 350).astype(np.float32)
+    )
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [176, 151]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [-30.3, 60.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for source in [insci, insci.tolist()]:
+        mapping = cdriz.DefaultWCSMapping(w2, w1, 240, 220, 1)
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        cdriz.tblot(
+            source, outsci, 1, 350, 1, 300, 1.0, 1.0, 1.0, 1.0,
+            'center', interp, 1.0, -1.0, 1.0, 1, mapping
+        )
+        outputs.append(outsci)
+
+    assert np.any(outputs[0] == -1.0)
+    assert np.any(outputs[0] > 0)
+    assert np.array_equal(outputs[0], outputs[1])
+
+
+@pytest.mark.parametrize('interp', ['linear', 'poly5', 'lan3'])
+def test_blot_source_window_folded(interp):
+    """
+    Test that a mapping which takes the inside of the output beyond
+    where its edges land on the source, and so beyond the window of the
+    source read, gives the same output as blotting from the whole source
+    """
+    # Not C-contiguous, so only the window of it is copied
+    insci = np.asfortranarray(
+        np.random.RandomState(0).rand(300, 400).astype(np.float32)
+    )
+
+    def mapping(x, y):
+        # Zero on the edges of the output, 150 pixels at its center
+        bump = 150.0 * np.sin(np.pi * (x - 0.5) / 100.0) * \
+            np.sin(np.pi * (y - 0.5) / 100.0)
+        return x + 100.0 + bump, y + 100.0
+
+    outputs = []
+    for source in [insci, insci.tolist()]:
+        outsci = np.zeros((100, 100), dtype=np.float32)
+        cdriz.tblot(
+            source, outsci, 1, 400, 1, 300, 1.0, 1.0, 1.0, 1.0,
+            'center', interp, 1.0, -1.0, 1.0, 1, mapping
+        )
+        outputs.append(outsci)
+
+    assert not np.any(outputs[0] == -1.0)
+    assert np.array_equal(outputs[0], outputs[1])
+
+@pytest.mark.parametrize('factor', [0, 1])
+@pytest.mark.parametrize('cdelt,crval2', [(1e-5, 10), (1e-3, 12)])
+def test_wcsmap_affine(factor, cdelt, crval2):
+    """
+    Test that DefaultWCSMapping agrees with WCSLIB both when the mapping
+    is affine (small field, common tangent point) and when it is not
+    """
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-cdelt, 0], [0, cdelt]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [150.5, 120.2]
+    w2.wcs.crval = [10, crval2]
+    w2.wcs.cd = [[-0.9 * cdelt, 0.5 * cdelt], [0.5 * cdelt, 0.9 * cdelt]]
+    w2.wcs.set()
+
+    rng = np.random.RandomState(0)
+    x = rng.uniform(0, 401, 1000)
+    y = rng.uniform(0, 201, 1000)
+
+    mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, factor)
+    xout, yout = mapping(x, y)
+    xref, yref = w2.wcs_world2pix(*w1.wcs_pix2world(x, y, 1), 1)
+
+    tolerance = 1e-3 if factor else 1e-9
+    assert np.allclose(xout, xref, rtol=0, atol=tolerance)
+    assert np.allclose(yout, yref, rtol=0, atol=tolerance)
+
+
+@pytest.mark.parametrize('kernel', ['square', 'point', 'gaussian'])
+def test_batched_python_mapping(kernel):
+    """
+    Test that drizzling and blotting through a Python mapping called
+    once for the whole grid gives the same output as calling it row by
+    row
+    """
+    insci = np.random.RandomState(0).rand(200, 400).astype(np.float32)
+    inwht = np.ones((200, 400), dtype=np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    ncalls = []
+
+    def mapping(x, y):
+        ncalls[-1] += 1
+        return w2.wcs_world2pix(*w1.wcs_pix2world(x, y, 1), 1)
+
+    drizzled = []
+    blotted = []
+    for batch in [False, True]:
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        outwht = np.zeros((220, 240), dtype=np.float32)
+        outctx = np.zeros((220, 240), dtype=np.int32)
+        ncalls.append(0)
+        cdriz.tdriz(
+            insci, inwht, outsci, outwht,
+            outctx, 1, 0, 1, 1, 200,
+            1.0, 1.0, 1.0, 'center', 0.8,
+            kernel, 'cps', 1.0, 1.0,
+            'INDEF', 0, 0, 1, mapping, batch=batch
+        )
+        drizzled.append((outsci, outwht))
+
+        blot = np.zeros((200, 400), dtype=np.float32)
+        cdriz.tblot(
+            outsci, blot, 1, 240, 1, 220, 1.0, 1.0, 1.0, 1.0,
+            'center', 'poly5', 1.0, 0.0, 1.0, 1, mapping, batch=batch
+        )
+        blotted.append(blot)
+
+    assert ncalls[1] < ncalls[0] / 10
+    assert np.any(drizzled[0][1] > 0)
+    assert np.array_equal(drizzled[0][0], drizzled[1][0])
+    assert np.array_equal(drizzled[0][1], drizzled[1][1])
+    assert np.any(blotted[0] != 0)
+    assert np.array_equal(blotted[0], blotted[1])
+
+
+def test_driz_fits_input():
+    """
+    Test that big-endian float32 data, and int16 data with BSCALE and
+    BZERO, drizzle the same as the native float32 array they hold
+    """
+    rng = np.random.RandomState(0)
+    raw = rng.randint(-3000, 3000, (200, 400)).astype(np.int16)
+    insci = (raw * 0.5 + 100.0).astype(np.float32)
+    inwht = rng.randint(0, 3, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for sci, wht, scaling in [
+            (insci, inwht, {}),
+            (insci.astype('>f4'), inwht.astype('>f4'), {}),
+            (raw.astype('>i2'), inwht.astype('>u2'),
+             {'bscale': 0.5, 'bzero': 100.0})]:
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        outwht = np.zeros((220, 240), dtype=np.float32)
+        outctx = np.zeros((220, 240), dtype=np.int32)
+        cdriz.tdriz(
+            sci, wht, outsci, outwht,
+            outctx, 1, 0, 1, 1, 200,
+            1.0, 1.0, 1.0, 'center', 1.0,
+            'square', 'counts', 2.0, 1.0,
+            'INDEF', 0, 0, 1, mapping, **scaling
+        )
+        outputs.append((outsci, outwht))
+
+    assert np.any(outputs[0][1] > 0)
+    for outsci, outwht in outputs[1:]:
+        assert np.array_equal(outsci, outputs[0][0])
+        assert np.array_equal(outwht, outputs[0][1])
+
+
+def test_driz_dq_weights():
+    """
+    Test that weights built in the kernel from data quality flags and
+    errors match the weight image built from them beforehand
+    """
+    rng = np.random.RandomState(1)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inerr = (2.0 ** rng.randint(-2, 3, (200, 400))).astype(np.float32)
+    inerr[::37, ::23] = 0.0
+    dq = rng.choice([0, 4, 16, 20, 256], (200, 400)).astype('>u2')
+    bits = 4 | 16
+
+    inwht = (((dq & (0xffff ^ bits)) == 0) &
+             (inerr > 0)).astype(np.float32) / np.where(inerr > 0, inerr, 1) ** 2
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for wht, quality in [(inwht, {}),
+                         (inerr, {'dq': dq, 'bits': bits, 'errors': True})]:
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        outwht = np.zeros((220, 240), dtype=np.float32)
+        outctx = np.zeros((220, 240), dtype=np.int32)
+        cdriz.tdriz(
+            insci, wht, outsci, outwht,
+            outctx, 1, 0, 1, 1, 200,
+            1.0, 1.0, 1.0, 'center', 1.0,
+            'square', 'cps', 1.0, 1.0,
+            'INDEF', 0, 0, 1, mapping, **quality
+        )
+        outputs.append((outsci, outwht, outctx))
+
+    assert np.any(outputs[0][1] > 0)
+    for expected, actual in zip(outputs[0], outputs[1]):
+        assert np.array_equal(expected, actual)
+
+
+@pytest.mark.parametrize('kernel', ['square', 'point', 'turbo', 'gaussian',
+                                    'lanczos3'])
+def test_driz_no_weights(kernel):
+    """
+    Test that without weights or data quality flags every input pixel
+    weighs wtscl, as if given a weight image of ones
+    """
+    insci = np.random.RandomState(2).normal(
+        100.0, 10.0, (200, 400)).astype(np.float32)
+    wtscl = 2.5
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for wht in [np.ones_like(insci), None]:
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        outwht = np.zeros((220, 240), dtype=np.float32)
+        outctx = np.zeros((220, 240), dtype=np.int32)
+        cdriz.tdriz(
+            insci, wht, outsci, outwht,
+            outctx, 1, 0, 1, 1, 200,
+            1.0, 1.0, 1.0, 'center', 1.0,
+            kernel, 'cps', 1.0, wtscl,
+            'INDEF', 0, 0, 1, mapping, dq=None
+        )
+        outputs.append((outsci, outwht, outctx))
+
+    assert np.any(outputs[0][1] > 0)
+    for expected, actual in zip(outputs[0], outputs[1]):
+        assert np.array_equal(expected, actual)
+
+def test_driz_sum_normalize():
+    """
+    Test that drizzling two chips as sums and normalizing once matches
+    drizzling them as running weighted means
+    """
+    rng = np.random.RandomState(2)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 2.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    outputs = []
+    for sum in [False, True]:
+        outsci = np.zeros((220, 240), dtype=np.float32)
+        outwht = np.zeros((220, 240), dtype=np.float32)
+        outctx = np.zeros((220, 240), dtype=np.int32)
+        for uniqid, sci in [(1, insci), (2, insci[::-1] + 1.0)]:
+            mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+            cdriz.tdriz(
+                np.ascontiguousarray(sci), inwht, outsci, outwht,
+                outctx, uniqid, 0, 1, 1, 200,
+                1.0, 1.0, 1.0, 'center', 1.0,
+                'square', 'cps', 1.0, 1.0,
+                '-1', 0, 0, 1, mapping, sum=sum
+            )
+        if sum:
+            cdriz.normalize(outsci, outwht, '-1')
+        outputs.append((outsci, outwht, outctx))
+
+    (mean, meanwht, meanctx), (total, totalwht, totalctx) = outputs
+    assert np.any(meanwht == 0) and np.any(meanwht > 0)
+    assert np.array_equal(meanwht, totalwht)
+    assert np.array_equal(meanctx, totalctx)
+    assert np.array_equal(mean == -1, total == -1)
+    assert np.allclose(mean, total, rtol=1e-5, atol=0)
+
+
+def test_drizzle_state_resume(tmp_path):
+    """
+    Test that a product saved after one input and resumed with another
+    matches the product of both drizzled in one run
+    """
+    from drizzlepac.drizstate import DrizzleState
+
+    rng = np.random.RandomState(3)
+    inputs = [('a', rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)),
+              ('b', rng.normal(50.0, 10.0, (200, 400)).astype(np.float32))]
+    inwht = np.ones((200, 400), dtype=np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [90.3, 110.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    def mapping():
+        return cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+
+    once = DrizzleState((220, 240))
+    for name, sci in inputs:
+        once.add(name, sci, inwht, mapping(), expin=2.0)
+
+    filename = str(tmp_path / 'state.fits')
+    first = DrizzleState((220, 240))
+    first.add(inputs[0][0], inputs[0][1], inwht, mapping(), expin=2.0)
+    first.save(filename)
+
+    resumed = DrizzleState.load(filename)
+    with pytest.raises(ValueError):
+        resumed.add(inputs[0][0], inputs[0][1], inwht, mapping())
+    resumed.add(inputs[1][0], inputs[1][1], inwht, mapping(), expin=2.0)
+
+    assert resumed.inputs == once.inputs
+    assert resumed.exptime == 4.0
+    for expected, actual in zip(once.product(fillval=0),
+                                resumed.product(fillval=0)):
+        assert np.array_equal(expected, actual)
+
+
+def test_drizzle_state_remove():
+    """
+    Test that removing an input leaves the product of the others
+    """
+    from drizzlepac.drizstate import DrizzleState
+
+    rng = np.random.RandomState(4)
+    inwht = rng.uniform(0.5, 2.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    inputs = []
+    for name, crpix in [('a', [90.3, 110.6]), ('b', [150.2, 60.7]),
+                        ('c', [100.9, 95.1])]:
+        w2 = wcs.WCS()
+        w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+        w2.wcs.crpix = crpix
+        w2.wcs.crval = [10, 10]
+        w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+        w2.wcs.set()
+        sci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+        inputs.append((name, sci, w2))
+
+    def add(state, name, sci, w2):
+        state.add(name, sci, inwht, cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1),
+                  kernel='turbo')
+
+    expected = DrizzleState((220, 240))
+    for name, sci, w2 in inputs:
+        if name != 'b':
+            add(expected, name, sci, w2)
+
+    state = DrizzleState((220, 240))
+    for name, sci, w2 in inputs:
+        add(state, name, sci, w2)
+    name, sci, w2 = inputs[1]
+    state.remove(name, sci, inwht, cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1))
+
+    outsci, outwht, outcon = state.product(fillval=-1)
+    expsci, expwht, expcon = expected.product(fillval=-1)
+    assert [row['NAME'] for row in state.inputs] == ['a', 'c']
+    # The context bit of 'b' is cleared, and 'c' keeps its bit
+    assert not np.any(outcon & 2)
+    assert np.array_equal(outcon & 1, expcon & 1)
+    assert np.array_equal(outcon >> 2, expcon >> 1)
+    assert np.array_equal(outsci == -1, expsci == -1)
+    assert np.allclose(outwht, expwht, rtol=1e-5, atol=1e-5)
+    assert np.allclose(outsci, expsci, rtol=1e-4, atol=0)
+
+    with pytest.raises(Exception):
+        cdriz.tdriz(sci, inwht, outsci, outwht, outcon[0], 2, 0, 1, 1, 200,
+                    1.0, 1.0, 1.0, 'center', 1.0, 'turbo', 'cps', 1.0, 1.0,
+                    'INDEF', 0, 0, 1,
+                    cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1), remove=True)
+
+
+@pytest.mark.parametrize('kernel', ['lanczos2', 'lanczos3', 'square'])
+def test_drizzle_state_remove_round_trip(kernel):
+    """
+    Test that adding an input and removing it again leaves the product
+    as it was, with the mixed signs of the lanczos weights
+    """
+    from drizzlepac.drizstate import DrizzleState
+
+    rng = np.random.RandomState(5)
+    inwht = rng.uniform(0.5, 2.0, (150, 200)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [121, 111]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    inputs = []
+    for name, crpix in [('a', [90.3, 100.6]), ('b', [60.2, 70.7])]:
+        w2 = wcs.WCS()
+        w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+        w2.wcs.crpix = crpix
+        w2.wcs.crval = [10, 10]
+        w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+        w2.wcs.set()
+        sci = rng.normal(100.0, 10.0, (150, 200)).astype(np.float32)
+        inputs.append((name, sci, cdriz.DefaultWCSMapping(w1, w2, 200, 150, 1)))
+
+    expected = DrizzleState((220, 240))
+    expected.add(*inputs[0][:2], inwht, inputs[0][2], kernel=kernel)
+
+    state = DrizzleState((220, 240))
+    for name, sci, mapping in inputs:
+        state.add(name, sci, inwht, mapping, kernel=kernel)
+    name, sci, mapping = inputs[1]
+    state.remove(name, sci, inwht, mapping)
+
+    # The lanczos lobes leave pixels of 'a' with negative weight
+    if kernel != 'square':
+        assert np.any(expected.weight < -0.1)
+    assert np.array_equal(state.context, expected.context)
+    assert np.array_equal(state.weight == 0, expected.weight == 0)
+    assert np.allclose(state.weight, expected.weight, rtol=0, atol=1e-5)
+    assert np.allclose(state.sum, expected.sum, rtol=0, atol=1e-3)
+
+
+@pytest.mark.parametrize('sum', [False, True])
+def test_driz_sparse_output(sum):
+    """
+    Test that drizzling onto a sparse output matches a dense one, and
+    that only the tiles drizzled onto are allocated
+    """
+    rng = np.random.RandomState(5)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 2.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    # A large output, of which the input covers a corner
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [300.3, 250.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    shape = (2000, 3000)
+    args = (0, 1, 1, 200, 1.0, 1.0, 1.0, 'center', 1.0, 'square', 'cps',
+            1.0, 1.0, '-1', 0, 0, 1)
+
+    outsci = np.zeros(shape, dtype=np.float32)
+    outwht = np.zeros(shape, dtype=np.float32)
+    outctx = np.zeros(shape, dtype=np.int32)
+    sparse = cdriz.SparseOutput(shape, nplanes=2, tile=128)
+    for uniqid in [1, 33]:
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        cdriz.tdriz(insci, inwht, outsci, outwht,
+                    outctx if uniqid == 1 else np.zeros_like(outctx),
+                    uniqid, *args, mapping, sum=sum)
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        cdriz.tdriz(insci, inwht, sparse, None, None,
+                    uniqid, *args, mapping, sum=sum)
+    if sum:
+        cdriz.normalize(outsci, outwht, '-1')
+        cdriz.normalize(sparse, None, '-1')
+
+    assert sparse.shape == shape
+    assert 0 < sparse.ntiles < 40
+    assert sparse.nbytes == sparse.ntiles * 128 * 128 * 16
+
+    sci, wht, ctx = sparse.to_dense('-1')
+    assert np.array_equal(sci, outsci)
+    assert np.array_equal(wht, outwht)
+    assert np.array_equal(ctx[0], outctx)
+    assert np.array_equal(ctx[1], outctx)
+
+
+def test_driz_out_of_core(tmp_path):
+    """
+    Test that drizzling onto tiles kept on disk, with few of them in
+    memory, matches a dense output, with the inputs in tile order
+    """
+    from drizzlepac.drizstate import footprint_box, tile_order
+
+    rng = np.random.RandomState(6)
+    inwht = np.ones((200, 400), dtype=np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    inputs = []
+    for crpix in [[1500.3, 1250.6], [300.2, 250.7], [1400.9, 1300.1],
+                  [350.5, 200.5]]:
+        w2 = wcs.WCS()
+        w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+        w2.wcs.crpix = crpix
+        w2.wcs.crval = [10, 10]
+        w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+        w2.wcs.set()
+        sci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+        inputs.append((sci, w2))
+
+    boxes = [footprint_box(cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1),
+                           400, 200) for sci, w2 in inputs]
+    order = tile_order(boxes, 64)
+    assert sorted(order) == [0, 1, 2, 3]
+    assert abs(order.index(0) - order.index(2)) == 1
+
+    shape = (2000, 3000)
+    args = (0, 1, 1, 200, 1.0, 1.0, 1.0, 'center', 1.0, 'square', 'cps',
+            1.0, 1.0, 'INDEF', 0, 0, 1)
+    outsci = np.zeros(shape, dtype=np.float32)
+    outwht = np.zeros(shape, dtype=np.float32)
+    outctx = np.zeros(shape, dtype=np.int32)
+    tiled = cdriz.SparseOutput(shape, tile=64, filename=str(tmp_path / 'tiles'),
+                               max_tiles=4)
+    for i in order:
+        sci, w2 = inputs[i]
+        cdriz.tdriz(sci, inwht, outsci, outwht, outctx, i + 1, *args,
+                    cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1))
+        cdriz.tdriz(sci, inwht, tiled, None, None, i + 1, *args,
+                    cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1))
+
+    assert tiled.nevict > 0
+    assert tiled.nbytes <= 4 * 64 * 64 * 12
+
+    for y0 in range(0, 2000, 700):
+        ny = min(700, 2000 - y0)
+        sci, wht, ctx = tiled.read_rows(y0, ny, '-1')
+        assert np.array_equal(wht, outwht[y0:y0 + ny])
+        assert np.array_equal(ctx[0], outctx[y0:y0 + ny])
+        assert np.array_equal(sci, np.where(outwht[y0:y0 + ny] > 0,
+                                            outsci[y0:y0 + ny], -1))
+
+
+@pytest.mark.parametrize('kernel', ['square', 'point', 'gaussian'])
+def test_driz_strips(kernel):
+    """
+    Test that drizzling an input a strip of rows at a time, with ystart,
+    matches drizzling it whole
+    """
+    rng = np.random.RandomState(7)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [160.3, 150.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.5e-5], [0.5e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    args = (1.0, 1.0, 1.0, 'center', 1.0, kernel, 'cps', 1.0, 1.0)
+    outputs = []
+    for nrows in [200, 37]:
+        outsci = np.zeros((300, 320), dtype=np.float32)
+        outwht = np.zeros((300, 320), dtype=np.float32)
+        outctx = np.zeros((300, 320), dtype=np.int32)
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        nmiss = 0
+        for ystart in range(0, 200, nrows):
+            sci = insci[ystart:ystart + nrows].copy()
+            wht = inwht[ystart:ystart + nrows].copy()
+            miss = cdriz.tdriz(sci, wht, outsci, outwht, outctx, 1,
+                               ystart, 1, 1, sci.shape[0], *args,
+                               'INDEF', 0, 0, 1, mapping)[1]
+            nmiss += miss
+        outputs.append((outsci, outwht, outctx, nmiss))
+
+    (sci1, wht1, ctx1, nmiss1), (sci2, wht2, ctx2, nmiss2) = outputs
+    assert nmiss1 == nmiss2 > 0
+    assert np.array_equal(ctx1, ctx2)
+    assert np.allclose(wht1, wht2, rtol=1e-6, atol=1e-6)
+    assert np.allclose(sci1, sci2, rtol=1e-5, atol=1e-4)
+
+
+@pytest.mark.parametrize('kernel', ['square', 'turbo', 'lanczos3'])
+def test_driz_output_windows(kernel):
+    """
+    Test that drizzling onto windows of the output from several threads
+    gives the same output as drizzling onto all of it
+    """
+    from concurrent.futures import ThreadPoolExecutor
+
+    rng = np.random.RandomState(8)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [160.3, 150.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.45e-5, 0.15e-5], [0.15e-5, 0.45e-5]]
+    w2.wcs.set()
+
+    def drizzle(outputs, xmin, xmax, ymin, ymax):
+        # Each window has a mapping of its own, as each thread must
+        w = [wcs.WCS(w.to_header()) for w in (w1, w2)]
+        mapping = cdriz.DefaultWCSMapping(w[0], w[1], 400, 200, 1)
+        cdriz.tdriz(insci, inwht, *outputs, 1, 0, xmin, ymin, 200,
+                    0.5, 1.0, 1.0, 'center', 1.0, kernel, 'counts', 2.0, 1.0,
+                    'INDEF', 0, 0, 1, mapping, xmax=xmax, ymax=ymax)
+
+    shape = (500, 640)
+    whole = [np.zeros(shape, dtype=np.float32),
+             np.zeros(shape, dtype=np.float32),
+             np.zeros(shape, dtype=np.int32)]
+    drizzle(whole, 1, 0, 1, 0)
+
+    tiled = [np.zeros_like(a) for a in whole]
+    windows = [(x, min(x + 99, shape[1]), y, min(y + 99, shape[0]))
+               for y in range(1, shape[0] + 1, 100)
+               for x in range(1, shape[1] + 1, 100)]
+    with ThreadPoolExecutor(max_workers=4) as pool:
+        list(pool.map(lambda w: drizzle(tiled, *w), windows))
+
+    assert whole[1].any()
+    for a, b in zip(whole, tiled):
+        assert np.array_equal(a, b)
+    # The input was scaled by the exposure time as it was read
+    assert insci.mean() > 90.0
+
+
+@pytest.mark.parametrize('kernel', ['square', 'gaussian', 'lanczos3'])
+def test_driz_blot_threads(kernel):
+    """
+    Test that drizzling and blotting with several threads gives the
+    same output as with one
+    """
+    rng = np.random.RandomState(9)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [160.3, 150.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.45e-5, 0.15e-5], [0.15e-5, 0.45e-5]]
+    w2.wcs.set()
+
+    drizzled = []
+    blotted = []
+    for threads, batch in [(1, False), (4, False), (3, True)]:
+        outputs = [np.zeros((500, 640), dtype=np.float32),
+                   np.zeros((500, 640), dtype=np.float32),
+                   np.zeros((500, 640), dtype=np.int32)]
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        cdriz.tdriz(insci, inwht, *outputs, 1, 0, 1, 1, 200,
+                    0.5, 1.0, 1.0, 'center', 1.0, kernel, 'cps', 1.0, 1.0,
+                    'INDEF', 0, 0, 1, mapping, batch=batch, threads=threads)
+        drizzled.append(outputs)
+
+        outsci = np.zeros((200, 400), dtype=np.float32)
+        mapping = cdriz.DefaultWCSMapping(w2, w1, 640, 500, 1)
+        cdriz.tblot(outputs[0], outsci, 1, 640, 1, 500, 0.5, 1.0, 1.0, 1.0,
+                    'center', 'poly5', 1.0, 0.0, 1.0, 1, mapping,
+                    tile=32 if batch else 0, batch=batch, threads=threads)
+        blotted.append(outsci)
+
+    assert drizzled[0][1].any()
+    for outputs in drizzled[1:]:
+        for a, b in zip(drizzled[0], outputs):
+            assert np.array_equal(a, b)
+    assert np.array_equal(blotted[0], blotted[1])
+    assert np.array_equal(blotted[0], blotted[2])
+
+
+@pytest.mark.parametrize('kernel', ['point', 'turbo'])
+def test_driz_gather(kernel):
+    """
+    Test that gathering onto each output pixel gives the output and
+    the misses of scattering from each input pixel
+    """
+    rng = np.random.RandomState(11)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [200.3, 150.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.9e-5, 0.3e-5], [0.3e-5, 0.9e-5]]
+    w2.wcs.set()
+
+    drizzled = []
+    for parallel, threads in [('bands', 1), ('gather', 1), ('gather', 3)]:
+        outputs = [np.zeros((300, 320), dtype=np.float32),
+                   np.zeros((300, 320), dtype=np.float32),
+                   np.zeros((300, 320), dtype=np.int32)]
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        _, nmiss, _ = cdriz.tdriz(insci, inwht, *outputs, 1, 0, 1, 1, 200,
+                                  1.0, 1.0, 1.0, 'center', 0.8, kernel,
+                                  'cps', 1.0, 1.0, 'INDEF', 0, 0, 1,
+                                  mapping, threads=threads,
+                                  parallel=parallel)
+        drizzled.append((outputs, nmiss))
+
+    assert drizzled[0][0][1].any()
+    assert drizzled[0][1] > 0
+    for outputs, nmiss in drizzled[1:]:
+        assert nmiss == drizzled[0][1]
+        for a, b in zip(drizzled[0][0], outputs):
+            assert np.array_equal(a, b)
+
+
+@pytest.mark.parametrize('kernel', ['square', 'point', 'gaussian'])
+@pytest.mark.parametrize('sum', [False, True])
+def test_driz_atomic(kernel, sum):
+    """
+    Test that threads adding what they drizzle to the output as they go
+    give the output of one thread, to rounding
+    """
+    rng = np.random.RandomState(13)
+    insci = rng.normal(100.0, 10.0, (200, 400)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (200, 400)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [201, 101]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [160.3, 150.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.45e-5, 0.15e-5], [0.15e-5, 0.45e-5]]
+    w2.wcs.set()
+
+    drizzled = []
+    for parallel, threads in [('bands', 1), ('atomic', 4)]:
+        outputs = [np.zeros((500, 640), dtype=np.float32),
+                   np.zeros((500, 640), dtype=np.float32),
+                   np.zeros((500, 640), dtype=np.int32)]
+        mapping = cdriz.DefaultWCSMapping(w1, w2, 400, 200, 1)
+        _, nmiss, nskip = cdriz.tdriz(
+            insci, inwht, *outputs, 1, 0, 1, 1, 200, 0.5, 1.0, 1.0,
+            'center', 1.0, kernel, 'cps', 1.0, 1.0, 'INDEF', 0, 0, 1,
+            mapping, sum=sum, threads=threads, parallel=parallel)
+        drizzled.append((outputs, nmiss, nskip))
+
+    (sci, wht, con), nmiss, nskip = drizzled[0]
+    assert wht.any()
+    assert drizzled[1][1:] == (nmiss, nskip)
+    np.testing.assert_allclose(drizzled[1][0][0], sci, rtol=1e-5, atol=1e-3)
+    np.testing.assert_allclose(drizzled[1][0][1], wht, rtol=1e-5, atol=1e-6)
+    assert np.array_equal(drizzled[1][0][2], con)
+
+
+def test_driz_lanczos3_negative_lobes():
+    """
+    Test that the negative side lobes of the lanczos3 kernel add to an
+    ordinary drizzle as they always have, rather than taking the input
+    back off the output and its context
+    """
+    rng = np.random.RandomState(3)
+    insci = rng.normal(100.0, 10.0, (120, 150)).astype(np.float32)
+    inwht = rng.uniform(0.5, 1.0, (120, 150)).astype(np.float32)
+
+    w1 = wcs.WCS()
+    w1.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w1.wcs.crpix = [75, 60]
+    w1.wcs.crval = [10, 10]
+    w1.wcs.cd = [[-1e-5, 0], [0, 1e-5]]
+    w1.wcs.set()
+
+    # Rotated, and overlapping the output only in part
+    w2 = wcs.WCS()
+    w2.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    w2.wcs.crpix = [20.3, 30.6]
+    w2.wcs.crval = [10, 10]
+    w2.wcs.cd = [[-0.8e-5, 0.6e-5], [0.6e-5, 0.8e-5]]
+    w2.wcs.set()
+
+    outsci = np.zeros((100, 110), dtype=np.float32)
+    outwht = np.zeros((100, 110), dtype=np.float32)
+    outcon = np.zeros((100, 110), dtype=np.int32)
+    mapping = cdriz.DefaultWCSMapping(w1, w2, 150, 120, 1)
+    cdriz.tdriz(insci, inwht, outsci, outwht, outcon, 1, 0, 1, 1, 120,
+                1.0, 1.0, 1.0, 'center', 1.0, 'lanczos3', 'cps', 1.0, 1.0,
+                'INDEF', 0, 0, 1, mapping)
+
+    # As drizzled by the original code
+    assert np.count_nonzero(outwht) == 8642
+    assert np.count_nonzero(outwht < 0) == 184
+    assert np.count_nonzero(outcon) == 8617
+    np.testing.assert_allclose(outsci.sum(dtype=np.float64),
+                               864299.7814435959, rtol=1e-9)
+    np.testing.assert_allclose(outwht.sum(dtype=np.float64),
+                               5902.986387496378, rtol=1e-9)
+    assert outsci[50, 60] == np.float32(99.41571044921875)
+    assert outwht[50, 60] == np.float32(0.8062940239906311)
+    assert outcon[50, 60] == 1